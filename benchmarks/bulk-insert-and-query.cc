@@ -50,10 +50,15 @@
 #include <climits>
 #include <iomanip>
 #include <map>
+#include <memory>
 #include <stdexcept>
 #include <vector>
 
+#include "adaptivecuckoofilter.h"
+#include "binaryfusefilter.h"
 #include "cuckoofilter.h"
+#include "cuckoomap.h"
+#include "frozencuckoofilter.h"
 #include "random.h"
 #include "simd-block.h"
 #include "timing.h"
@@ -122,32 +127,169 @@ basic_ostream<CharT, Traits>& operator<<(
 template<typename Table>
 struct FilterAPI {};
 
-template <typename ItemType, size_t bits_per_item, template <size_t> class TableType>
-struct FilterAPI<CuckooFilter<ItemType, bits_per_item, TableType>> {
-  using Table = CuckooFilter<ItemType, bits_per_item, TableType>;
+template <typename ItemType, size_t bits_per_item,
+          template <size_t, typename> class TableType, typename HashFamily,
+          typename Allocator, size_t stash_size, size_t alt_window>
+struct FilterAPI<CuckooFilter<ItemType, bits_per_item, TableType, HashFamily, Allocator,
+                              stash_size, alt_window>> {
+  using Table = CuckooFilter<ItemType, bits_per_item, TableType, HashFamily, Allocator,
+                             stash_size, alt_window>;
   static Table ConstructFromAddCount(size_t add_count) { return Table(add_count); }
-  static void Add(uint64_t key, Table * table) {
-    if (0 != table->Add(key)) {
-      throw logic_error("The filter is too small to hold all of the elements");
+  static void AddAll(const uint64_t* keys, size_t n, Table * table) {
+    for (size_t i = 0; i < n; ++i) {
+      if (0 != table->Add(keys[i])) {
+        throw logic_error("The filter is too small to hold all of the elements");
+      }
     }
   }
-  static bool Contain(uint64_t key, const Table * table) {
-    return (0 == table->Contain(key));
+  static size_t ContainAll(const uint64_t* keys, size_t n, const Table * table) {
+    size_t found = 0;
+    for (size_t i = 0; i < n; ++i) {
+      found += (0 == table->Contain(keys[i]));
+    }
+    return found;
+  }
+};
+
+// An AdaptiveCuckooFilter with the array of items it guards, standing in for the backing
+// store. Its bits/item counts only the filter, as it would with any other store.
+template <typename Filter>
+struct WithItemStore {
+  unique_ptr<vector<uint64_t>> items;
+  Filter filter;
+  explicit WithItemStore(size_t add_count)
+    : items(new vector<uint64_t>(Filter::NumSlotsFor(add_count))),
+      filter(add_count, items.get()) {}
+  size_t SizeInBytes() const { return filter.SizeInBytes(); }
+};
+
+template <typename ItemType, size_t bits_per_item, size_t selector_bits,
+          typename HashFamily, typename Allocator>
+struct FilterAPI<WithItemStore<
+    AdaptiveCuckooFilter<ItemType, bits_per_item, selector_bits, HashFamily, Allocator>>> {
+  using Table = WithItemStore<
+      AdaptiveCuckooFilter<ItemType, bits_per_item, selector_bits, HashFamily, Allocator>>;
+  static Table ConstructFromAddCount(size_t add_count) { return Table(add_count); }
+  static void AddAll(const uint64_t* keys, size_t n, Table * table) {
+    for (size_t i = 0; i < n; ++i) {
+      if (0 != table->filter.Add(keys[i])) {
+        throw logic_error("The filter is too small to hold all of the elements");
+      }
+    }
+  }
+  static size_t ContainAll(const uint64_t* keys, size_t n, const Table * table) {
+    size_t found = 0;
+    for (size_t i = 0; i < n; ++i) {
+      found += (0 == table->filter.Contain(keys[i]));
+    }
+    return found;
+  }
+};
+
+// A CuckooMap maps each key to its low bits, and a find is a lookup of the value.
+template <typename ItemType, size_t bits_per_tag, size_t bits_per_value,
+          typename HashFamily, typename Allocator>
+struct FilterAPI<CuckooMap<ItemType, bits_per_tag, bits_per_value, HashFamily, Allocator>> {
+  using Table = CuckooMap<ItemType, bits_per_tag, bits_per_value, HashFamily, Allocator>;
+  static Table ConstructFromAddCount(size_t add_count) { return Table(add_count); }
+  static void AddAll(const uint64_t* keys, size_t n, Table * table) {
+    for (size_t i = 0; i < n; ++i) {
+      if (0 != table->Add(keys[i], keys[i] & ((1ULL << bits_per_value) - 1))) {
+        throw logic_error("The map is too small to hold all of the elements");
+      }
+    }
+  }
+  static size_t ContainAll(const uint64_t* keys, size_t n, const Table * table) {
+    size_t found = 0;
+    uint32_t value;
+    for (size_t i = 0; i < n; ++i) {
+      found += (0 == table->Lookup(keys[i], &value));
+    }
+    return found;
+  }
+};
+
+template <typename HashFamily, int log_bucket_byte_size, int lane_bits, int bits_per_key>
+struct FilterAPI<SimdBlockFilter<HashFamily, log_bucket_byte_size, lane_bits, bits_per_key>> {
+  using Table = SimdBlockFilter<HashFamily, log_bucket_byte_size, lane_bits, bits_per_key>;
+  static Table ConstructFromAddCount(size_t add_count) {
+    return Table::WithHeapSpace(add_count * 8.0 / CHAR_BIT);
+  }
+  static void AddAll(const uint64_t* keys, size_t n, Table* table) {
+    for (size_t i = 0; i < n; ++i) {
+      table->Add(keys[i]);
+    }
+  }
+  static size_t ContainAll(const uint64_t* keys, size_t n, const Table * table) {
+    size_t found = 0;
+    for (size_t i = 0; i < n; ++i) {
+      found += table->Find(keys[i]);
+    }
+    return found;
   }
 };
 
-template <>
-struct FilterAPI<SimdBlockFilter<>> {
-  using Table = SimdBlockFilter<>;
+// A BinaryFuseFilter is built all at once from its keys, so the timed adds are its
+// construction, and an empty filter stands in until then.
+template <typename ItemType, typename FingerprintType, typename HashFamily>
+struct FilterAPI<BinaryFuseFilter<ItemType, FingerprintType, HashFamily>> {
+  using Table = BinaryFuseFilter<ItemType, FingerprintType, HashFamily>;
+  static Table ConstructFromAddCount(size_t) { return Table(nullptr, 0); }
+  static void AddAll(const uint64_t* keys, size_t n, Table* table) {
+    *table = Table(keys, n);
+  }
+  static size_t ContainAll(const uint64_t* keys, size_t n, const Table * table) {
+    size_t found = 0;
+    for (size_t i = 0; i < n; ++i) {
+      found += (0 == table->Contain(keys[i]));
+    }
+    return found;
+  }
+};
+
+// A FrozenCuckooFilter is frozen from a CuckooFilter of the same parameters, so the
+// timed adds are those and Freeze(), and a frozen empty filter stands in until then.
+template <typename ItemType, size_t bits_per_item, typename HashFamily, size_t alt_window>
+struct FilterAPI<FrozenCuckooFilter<ItemType, bits_per_item, HashFamily, alt_window>> {
+  using Table = FrozenCuckooFilter<ItemType, bits_per_item, HashFamily, alt_window>;
+  using Source = CuckooFilter<ItemType, bits_per_item, SingleTable, HashFamily,
+                              allocator<char>, 4, alt_window>;
+  static Table ConstructFromAddCount(size_t) { return Source(1).Freeze(); }
+  static void AddAll(const uint64_t* keys, size_t n, Table* table) {
+    Source source(n);
+    FilterAPI<Source>::AddAll(keys, n, &source);
+    *table = source.Freeze();
+  }
+  static size_t ContainAll(const uint64_t* keys, size_t n, const Table * table) {
+    size_t found = 0;
+    for (size_t i = 0; i < n; ++i) {
+      found += (0 == table->Contain(keys[i]));
+    }
+    return found;
+  }
+};
+
+// Benchmarks Filter through its batch interface rather than one key at a time.
+template <typename Filter>
+struct Batched : Filter {
+  using Filter::Filter;
+  explicit Batched(Filter&& filter) : Filter(move(filter)) {}
+};
+
+template <typename HashFamily, int log_bucket_byte_size, int lane_bits, int bits_per_key>
+struct FilterAPI<
+    Batched<SimdBlockFilter<HashFamily, log_bucket_byte_size, lane_bits, bits_per_key>>> {
+  using Table =
+      Batched<SimdBlockFilter<HashFamily, log_bucket_byte_size, lane_bits, bits_per_key>>;
   static Table ConstructFromAddCount(size_t add_count) {
-    Table ans(ceil(log2(add_count * 8.0 / CHAR_BIT)));
-    return ans;
+    return Table(Table::WithHeapSpace(add_count * 8.0 / CHAR_BIT));
   }
-  static void Add(uint64_t key, Table* table) {
-    table->Add(key);
+  static void AddAll(const uint64_t* keys, size_t n, Table* table) {
+    table->AddMany(keys, n);
   }
-  static bool Contain(uint64_t key, const Table * table) {
-    return table->Find(key);
+  static size_t ContainAll(const uint64_t* keys, size_t n, const Table * table) {
+    vector<uint64_t> found((n + 63) / 64);
+    return table->FindMany(keys, n, found.data());
   }
 };
 
@@ -167,9 +309,7 @@ Statistics FilterBenchmark(
 
   // Add values until failure or until we run out of values to add:
   auto start_time = NowNanos();
-  for (size_t added = 0; added < add_count; ++added) {
-    FilterAPI<Table>::Add(to_add[added], &filter);
-  }
+  FilterAPI<Table>::AddAll(&to_add[0], add_count, &filter);
   result.adds_per_nano = add_count / static_cast<double>(NowNanos() - start_time);
   result.bits_per_item = static_cast<double>(CHAR_BIT * filter.SizeInBytes()) / add_count;
 
@@ -178,9 +318,8 @@ Statistics FilterBenchmark(
     const auto to_lookup_mixed = MixIn(&to_lookup[0], &to_lookup[SAMPLE_SIZE], &to_add[0],
         &to_add[add_count], found_probability);
     const auto start_time = NowNanos();
-    for (const auto v : to_lookup_mixed) {
-      found_count += FilterAPI<Table>::Contain(v, &filter);
-    }
+    found_count +=
+        FilterAPI<Table>::ContainAll(&to_lookup_mixed[0], to_lookup_mixed.size(), &filter);
     const auto lookup_time = NowNanos() - start_time;
     result.finds_per_nano[100 * found_probability] =
         SAMPLE_SIZE / static_cast<double>(lookup_time);
@@ -248,8 +387,90 @@ int main(int argc, char * argv[]) {
 
   cout << setw(NAME_WIDTH) << "SemiSort17" << cf << endl;
 
+  cf = FilterBenchmark<
+      CuckooFilter<uint64_t, 8 /* bits per item */, MortonTable /* packed blocks */>>(
+      add_count, to_add, to_lookup);
+
+  cout << setw(NAME_WIDTH) << "Morton8" << cf << endl;
+
+  cf = FilterBenchmark<
+      CuckooFilter<uint64_t, 12 /* bits per item */, MortonTable /* packed blocks */>>(
+      add_count, to_add, to_lookup);
+
+  cout << setw(NAME_WIDTH) << "Morton12" << cf << endl;
+
+  cf = FilterBenchmark<CuckooMap<uint64_t, 12 /* bits per tag */, 4 /* bits per value */>>(
+      add_count, to_add, to_lookup);
+
+  cout << setw(NAME_WIDTH) << "CuckooMap12+4" << cf << endl;
+
+  cf = FilterBenchmark<WithItemStore<AdaptiveCuckooFilter<uint64_t, 12 /* bits per item */>>>(
+      add_count, to_add, to_lookup);
+
+  cout << setw(NAME_WIDTH) << "Adaptive12" << cf << endl;
+
   cf = FilterBenchmark<SimdBlockFilter<>>(add_count, to_add, to_lookup);
 
   cout << setw(NAME_WIDTH) << "SimdBlock8" << cf << endl;
 
+  cf = FilterBenchmark<Batched<SimdBlockFilter<>>>(add_count, to_add, to_lookup);
+
+  cout << setw(NAME_WIDTH) << "SimdBatch8" << cf << endl;
+
+  cf = FilterBenchmark<
+      SimdBlockFilter<TwoIndependentMultiplyShift, 6 /* 512-bit buckets */>>(
+      add_count, to_add, to_lookup);
+
+  cout << setw(NAME_WIDTH) << "SimdBlock16" << cf << endl;
+
+  // A sweep of SimdBlockFilter geometries at the same space, named Blk<bucket bits>x<lane
+  // bits>k<bits set per key>, to pick the best point for a workload. Blk256x32k8 and
+  // Blk512x32k16 are SimdBlock8 and SimdBlock16 above.
+  cf = FilterBenchmark<SimdBlockFilter<TwoIndependentMultiplyShift, 3, 64, 4>>(
+      add_count, to_add, to_lookup);
+
+  cout << setw(NAME_WIDTH) << "Blk64x64k4" << cf << endl;
+
+  cf = FilterBenchmark<SimdBlockFilter<TwoIndependentMultiplyShift, 3, 64, 6>>(
+      add_count, to_add, to_lookup);
+
+  cout << setw(NAME_WIDTH) << "Blk64x64k6" << cf << endl;
+
+  cf = FilterBenchmark<SimdBlockFilter<TwoIndependentMultiplyShift, 4, 32, 8>>(
+      add_count, to_add, to_lookup);
+
+  cout << setw(NAME_WIDTH) << "Blk128x32k8" << cf << endl;
+
+  cf = FilterBenchmark<SimdBlockFilter<TwoIndependentMultiplyShift, 5, 32, 16>>(
+      add_count, to_add, to_lookup);
+
+  cout << setw(NAME_WIDTH) << "Blk256x32k16" << cf << endl;
+
+  cf = FilterBenchmark<SimdBlockFilter<TwoIndependentMultiplyShift, 5, 64, 4>>(
+      add_count, to_add, to_lookup);
+
+  cout << setw(NAME_WIDTH) << "Blk256x64k4" << cf << endl;
+
+  cf = FilterBenchmark<SimdBlockFilter<TwoIndependentMultiplyShift, 5, 64, 8>>(
+      add_count, to_add, to_lookup);
+
+  cout << setw(NAME_WIDTH) << "Blk256x64k8" << cf << endl;
+
+  // Static filters, for key sets that never change:
+  cf = FilterBenchmark<BinaryFuseFilter<uint64_t, uint8_t>>(add_count, to_add, to_lookup);
+
+  cout << setw(NAME_WIDTH) << "BinaryFuse8" << cf << endl;
+
+  cf = FilterBenchmark<BinaryFuseFilter<uint64_t, uint16_t>>(add_count, to_add, to_lookup);
+
+  cout << setw(NAME_WIDTH) << "BinaryFuse16" << cf << endl;
+
+  // Cuckoo12 and Cuckoo16 frozen, in no more space than above
+  cf = FilterBenchmark<FrozenCuckooFilter<uint64_t, 12>>(add_count, to_add, to_lookup);
+
+  cout << setw(NAME_WIDTH) << "Frozen12" << cf << endl;
+
+  cf = FilterBenchmark<FrozenCuckooFilter<uint64_t, 16>>(add_count, to_add, to_lookup);
+
+  cout << setw(NAME_WIDTH) << "Frozen16" << cf << endl;
 }
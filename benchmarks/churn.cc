@@ -0,0 +1,221 @@
+// This benchmark reports how fast filters that support deletion keep up with a set that
+// churns. It is invoked as:
+//
+//     ./churn.exe 10000000
+//
+// That invocation adds 10 million random keys to each filter, then replaces all of them
+// in ten rounds, each of which removes the oldest tenth of the keys and adds as many new
+// ones. It reports the rates of the first adds and of the removes and adds during churn,
+// then the lookup rate and false positive rate of keys never added, and the space used.
+// Last it removes the remaining keys with the filter's batched remove, a round at a
+// time, and reports that rate too.
+// "failed" counts adds the filter had no room for and removes of keys it did not find;
+// they are zero unless a filter overflows.
+
+#include <climits>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+#include <vector>
+
+#include "counting-simd-block.h"
+#include "cuckoofilter.h"
+#include "random.h"
+#include "timing.h"
+
+using namespace std;
+
+using namespace cuckoofilter;
+
+// The number of rounds the set is replaced in
+const size_t CHURN_ROUNDS = 10;
+
+// The number of keys never added that are looked up
+const size_t SAMPLE_SIZE = 1000 * 1000;
+
+struct Statistics {
+  double adds_per_nano;
+  double removes_per_nano;
+  double churn_adds_per_nano;
+  double finds_per_nano;
+  double batch_removes_per_nano;
+  double false_positive_probabilty;
+  double bits_per_item;
+  size_t failures;
+};
+
+ostream& operator<<(ostream& os, const Statistics& stats) {
+  os << fixed << setprecision(2) << setw(10) << stats.adds_per_nano * 1000 << setw(10)
+     << stats.removes_per_nano * 1000 << setw(10) << stats.churn_adds_per_nano * 1000
+     << setw(10) << stats.finds_per_nano * 1000 << setw(10)
+     << stats.batch_removes_per_nano * 1000 << setprecision(3) << setw(9)
+     << stats.false_positive_probabilty * 100 << '%' << setprecision(2) << setw(11)
+     << stats.bits_per_item << setw(9) << stats.failures;
+  return os;
+}
+
+// ChurnAPI gives one interface to the filters, as FilterAPI does in
+// bulk-insert-and-query.cc. Add() and Remove() return false on failure, and RemoveAll()
+// returns the number of failures.
+template <typename Table>
+struct ChurnAPI {};
+
+template <size_t bits_per_item, template <size_t, typename> class TableType>
+struct ChurnAPI<CuckooFilter<uint64_t, bits_per_item, TableType>> {
+  using Table = CuckooFilter<uint64_t, bits_per_item, TableType>;
+  static Table Construct(size_t add_count, double) { return Table(add_count); }
+  static bool Add(uint64_t key, Table* table) { return Ok == table->Add(key); }
+  static bool Remove(uint64_t key, Table* table) { return Ok == table->Delete(key); }
+  static size_t RemoveAll(const uint64_t* keys, size_t n, Table* table) {
+    vector<uint64_t> deleted((n + 63) / 64);
+    return n - table->DeleteMany(keys, n, deleted.data());
+  }
+  static bool Contain(uint64_t key, const Table* table) {
+    return Ok == table->Contain(key);
+  }
+};
+
+template <typename HashFamily>
+struct ChurnAPI<CountingSimdBlockFilter<HashFamily>> {
+  using Table = CountingSimdBlockFilter<HashFamily>;
+  static Table Construct(size_t add_count, double fpp) { return Table(add_count, fpp); }
+  static bool Add(uint64_t key, Table* table) {
+    table->Add(key);
+    return true;
+  }
+  static bool Remove(uint64_t key, Table* table) { return table->Remove(key); }
+  static size_t RemoveAll(const uint64_t* keys, size_t n, Table* table) {
+    size_t failures = 0;
+    for (size_t i = 0; i < n; ++i) failures += !table->Remove(keys[i]);
+    return failures;
+  }
+  static bool Contain(uint64_t key, const Table* table) { return table->Find(key); }
+};
+
+// keys holds the add_count keys added first and then the add_count that replace them. A
+// CountingSimdBlockFilter is sized for a false positive probability of fpp; the cuckoo
+// filters have a fixed one.
+template <typename Table>
+Statistics ChurnBenchmark(size_t add_count, double fpp, const vector<uint64_t>& keys,
+    const vector<uint64_t>& to_lookup) {
+  if (2 * add_count > keys.size()) {
+    throw out_of_range("keys must contain at least 2 * add_count values");
+  }
+
+  Table filter = ChurnAPI<Table>::Construct(add_count, fpp);
+  Statistics result;
+  result.failures = 0;
+
+  auto start_time = NowNanos();
+  for (size_t i = 0; i < add_count; ++i) {
+    result.failures += !ChurnAPI<Table>::Add(keys[i], &filter);
+  }
+  result.adds_per_nano = add_count / static_cast<double>(NowNanos() - start_time);
+
+  uint64_t remove_time = 0, add_time = 0;
+  const size_t round_size = (add_count + CHURN_ROUNDS - 1) / CHURN_ROUNDS;
+  for (size_t begin = 0; begin < add_count; begin += round_size) {
+    const size_t end = min(add_count, begin + round_size);
+    start_time = NowNanos();
+    for (size_t i = begin; i < end; ++i) {
+      result.failures += !ChurnAPI<Table>::Remove(keys[i], &filter);
+    }
+    remove_time += NowNanos() - start_time;
+    start_time = NowNanos();
+    for (size_t i = begin; i < end; ++i) {
+      result.failures += !ChurnAPI<Table>::Add(keys[add_count + i], &filter);
+    }
+    add_time += NowNanos() - start_time;
+  }
+  result.removes_per_nano = add_count / static_cast<double>(remove_time);
+  result.churn_adds_per_nano = add_count / static_cast<double>(add_time);
+
+  if (0 == result.failures) {
+    for (size_t i = add_count; i < 2 * add_count; ++i) {
+      if (!ChurnAPI<Table>::Contain(keys[i], &filter)) {
+        throw logic_error("A key added during churn was not found");
+      }
+    }
+  }
+
+  size_t found_count = 0;
+  start_time = NowNanos();
+  for (const uint64_t key : to_lookup) {
+    found_count += ChurnAPI<Table>::Contain(key, &filter);
+  }
+  result.finds_per_nano = to_lookup.size() / static_cast<double>(NowNanos() - start_time);
+  result.false_positive_probabilty = found_count / static_cast<double>(to_lookup.size());
+  result.bits_per_item = static_cast<double>(CHAR_BIT * filter.SizeInBytes()) / add_count;
+
+  start_time = NowNanos();
+  for (size_t begin = 0; begin < add_count; begin += round_size) {
+    const size_t end = min(add_count, begin + round_size);
+    result.failures +=
+        ChurnAPI<Table>::RemoveAll(&keys[add_count + begin], end - begin, &filter);
+  }
+  result.batch_removes_per_nano =
+      add_count / static_cast<double>(NowNanos() - start_time);
+  return result;
+}
+
+int main(int argc, char* argv[]) {
+  if (argc != 2) {
+    cerr << "Usage: " << argv[0] << " $NUMBER" << endl;
+    return 1;
+  }
+  stringstream input_string(argv[1]);
+  size_t add_count;
+  input_string >> add_count;
+  if (input_string.fail() || add_count == 0) {
+    cerr << "Invalid number: " << argv[1];
+    return 2;
+  }
+
+  const vector<uint64_t> keys = GenerateRandom64(2 * add_count);
+  const vector<uint64_t> to_lookup = GenerateRandom64(SAMPLE_SIZE);
+
+  constexpr int NAME_WIDTH = 13;
+
+  cout << setw(NAME_WIDTH) << "" << setw(10) << "Million" << setw(10) << "Million"
+       << setw(10) << "Million" << setw(10) << "Million" << setw(10) << "Million" << endl;
+  cout << setw(NAME_WIDTH) << "" << setw(10) << "adds/sec" << setw(10) << "rems/sec"
+       << setw(10) << "adds/sec" << setw(10) << "finds/sec" << setw(10) << "rems/sec"
+       << setw(11) << "ε"
+       << setw(11) << "bits/item" << setw(9) << "failed" << endl;
+  cout << setw(NAME_WIDTH) << "" << setw(10) << "fill" << setw(10) << "churn" << setw(10)
+       << "churn" << setw(10) << "" << setw(10) << "batch" << endl;
+
+  auto stats = ChurnBenchmark<CuckooFilter<uint64_t, 8, SingleTable>>(
+      add_count, 0, keys, to_lookup);
+
+  cout << setw(NAME_WIDTH) << "Cuckoo8" << stats << endl;
+
+  stats = ChurnBenchmark<CuckooFilter<uint64_t, 12, SingleTable>>(
+      add_count, 0, keys, to_lookup);
+
+  cout << setw(NAME_WIDTH) << "Cuckoo12" << stats << endl;
+
+  stats = ChurnBenchmark<CuckooFilter<uint64_t, 13, PackedTable>>(
+      add_count, 0, keys, to_lookup);
+
+  cout << setw(NAME_WIDTH) << "SemiSort13" << stats << endl;
+
+  stats = ChurnBenchmark<CuckooFilter<uint64_t, 16, SingleTable>>(
+      add_count, 0, keys, to_lookup);
+
+  cout << setw(NAME_WIDTH) << "Cuckoo16" << stats << endl;
+
+  // Sized for about the false positive probabilities of the cuckoo filters above:
+  stats = ChurnBenchmark<CountingSimdBlockFilter<>>(add_count, 0.02, keys, to_lookup);
+
+  cout << setw(NAME_WIDTH) << "Counting2%" << stats << endl;
+
+  stats = ChurnBenchmark<CountingSimdBlockFilter<>>(add_count, 0.002, keys, to_lookup);
+
+  cout << setw(NAME_WIDTH) << "Counting.2%" << stats << endl;
+
+  stats = ChurnBenchmark<CountingSimdBlockFilter<>>(add_count, 0.0001, keys, to_lookup);
+
+  cout << setw(NAME_WIDTH) << "Counting.01%" << stats << endl;
+}
@@ -0,0 +1,97 @@
+// This benchmark reports how building one SimdBlockFilter scales with the number of
+// threads adding to it. It is invoked as:
+//
+//     ./concurrent-build.exe 100000000 32
+//
+// That invocation adds 100 million random keys to a filter of 8 bits per key, first from
+// one thread with the plain AddMany(), then with AddManyConcurrent() from 1, 2, 4, ... 32
+// threads, each adding its own contiguous share of the keys. After each build it checks
+// that every key is found. The thread count defaults to the number of hardware threads.
+
+#include <climits>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+#include "random.h"
+#include "simd-block.h"
+#include "timing.h"
+
+using namespace std;
+
+using Filter = SimdBlockFilter<>;
+
+// Returns the adds per nanosecond of building filter from keys with thread_count threads.
+double ConcurrentBuild(Filter* filter, const vector<uint64_t>& keys, size_t thread_count) {
+  vector<thread> threads;
+  const size_t share = (keys.size() + thread_count - 1) / thread_count;
+  const auto start_time = NowNanos();
+  for (size_t t = 0; t < thread_count; ++t) {
+    const size_t begin = min(keys.size(), t * share);
+    const size_t end = min(keys.size(), begin + share);
+    threads.emplace_back([filter, &keys, begin, end]() {
+      filter->AddManyConcurrent(&keys[begin], end - begin);
+    });
+  }
+  for (auto& t : threads) t.join();
+  return keys.size() / static_cast<double>(NowNanos() - start_time);
+}
+
+void CheckAllFound(const Filter& filter, const vector<uint64_t>& keys) {
+  vector<uint64_t> found((keys.size() + 63) / 64);
+  if (filter.FindMany(&keys[0], keys.size(), &found[0]) != keys.size()) {
+    throw logic_error("A concurrently added key was not found");
+  }
+}
+
+int main(int argc, char* argv[]) {
+  if (argc != 2 && argc != 3) {
+    cerr << "Usage: " << argv[0] << " $NUMBER [$MAX_THREADS]" << endl;
+    return 1;
+  }
+  stringstream input_string(argv[1]);
+  size_t add_count;
+  input_string >> add_count;
+  if (input_string.fail() || add_count == 0) {
+    cerr << "Invalid number: " << argv[1];
+    return 2;
+  }
+  size_t max_threads = max(1u, thread::hardware_concurrency());
+  if (argc == 3) {
+    stringstream threads_string(argv[2]);
+    threads_string >> max_threads;
+    if (threads_string.fail() || max_threads == 0) {
+      cerr << "Invalid number: " << argv[2];
+      return 2;
+    }
+  }
+
+  const vector<uint64_t> to_add = GenerateRandom64(add_count);
+  const uint64_t heap_space = add_count * 8 / CHAR_BIT;
+
+  cout << setw(8) << "threads" << setw(12) << "Million" << setw(10) << "speedup" << endl;
+  cout << setw(8) << "" << setw(12) << "adds/sec" << endl;
+
+  double baseline;
+  {
+    Filter filter = Filter::WithHeapSpace(heap_space);
+    const auto start_time = NowNanos();
+    filter.AddMany(&to_add[0], to_add.size());
+    baseline = to_add.size() / static_cast<double>(NowNanos() - start_time);
+    CheckAllFound(filter, to_add);
+  }
+  cout << setw(8) << "serial" << fixed << setprecision(2) << setw(12) << baseline * 1000
+       << setw(10) << 1.0 << endl;
+
+  for (size_t threads = 1; threads <= max_threads;
+       threads = (threads == max_threads) ? threads + 1 : min(2 * threads, max_threads)) {
+    Filter filter = Filter::WithHeapSpace(heap_space);
+    const double adds_per_nano = ConcurrentBuild(&filter, to_add, threads);
+    CheckAllFound(filter, to_add);
+    cout << setw(8) << threads << setw(12) << adds_per_nano * 1000 << setw(10)
+         << adds_per_nano / baseline << endl;
+  }
+}
@@ -11,6 +11,7 @@
 //        75.00%     24.86      9.62
 //       100.00%     24.89      9.96
 
+#include <array>
 #include <climits>
 #include <iomanip>
 #include <vector>
@@ -1,14 +1,25 @@
 // This benchmark reproduces the CoNEXT 2014 results found in "Table 3: Space efficiency
-// and construction speed." It takes about two minutes to run on an Intel(R) Core(TM)
-// i7-4790 CPU @ 3.60GHz.
+// and construction speed." It takes a few minutes to run.
 //
-// Results:
+// CF and ss-CF keep up to four items that found no room in a stash, the default. The
+// "CF s=1" column keeps only one, as the paper's victim cache does, and "CF s=16" keeps
+// sixteen. The "CF w=" columns keep both buckets of three in four items in an aligned
+// block of 8 buckets (48 bytes, so one or two cache lines), 64 buckets or 512 (3 KiB, so
+// one or two pages). The lookup speed is that of absent keys.
 //
-// metrics                                    CF     ss-CF
-// # of items (million)                   127.82    127.90
-// bits per item                           12.60     12.59
-// false positive rate                     0.18%     0.09%
-// constr. speed (million keys/sec)         5.86      4.10
+// Results, pinned to one core of a shared AMD EPYC virtual machine with taskset -c 0:
+//
+// metrics                                    CF     ss-CF    CF s=1   CF s=16    CF w=8   CF w=64  CF w=512
+// # of items (million)                   128.33    128.12    127.89    128.51     60.87    127.58    128.17
+// load factor                            95.62%    95.45%    95.29%    95.75%    45.35%    95.06%    95.49%
+// bits per item                           12.55     12.57     12.59     12.53     26.46     12.62     12.57
+// false positive rate                     0.18%     0.09%     0.18%     0.18%     0.09%     0.18%     0.19%
+// constr. speed (million keys/sec)         2.08      1.75      2.23      1.98     16.03      3.08      2.48
+// lookup speed (million keys/sec)         15.63      5.54     15.31     12.20     14.06     14.92     14.21
+//
+// The lookup row times only a million keys and moves by a quarter between runs. Timing
+// 4 million lookups three times on a filter of 32 million items, stash sizes 1 and 4 look
+// up at 18.3 and 17.6 million keys/sec, and stash size 16 at 16.4.
 
 #include <climits>
 #include <iomanip>
@@ -26,12 +37,24 @@ using namespace cuckoofilter;
 const size_t FPR_SAMPLE_SIZE = 1000 * 1000;
 
 struct Metrics {
-  double add_count;  // # of items (million)
-  double space;      // bits per item
-  double fpr;        // false positive rate (%)
-  double speed;      // const. speed (million keys/sec)
+  double add_count;     // # of items (million)
+  double load;          // load factor (%)
+  double space;         // bits per item
+  double fpr;           // false positive rate (%)
+  double speed;         // const. speed (million keys/sec)
+  double lookup_speed;  // lookup speed of absent keys (million keys/sec)
 };
 
+// A 12-bit CuckooFilter that can stash stash_size items that found no room
+template <size_t stash_size>
+using StashedCuckooFilter = CuckooFilter<uint64_t, 12, SingleTable,
+    TwoIndependentMultiplyShift, allocator<char>, stash_size>;
+
+// A 12-bit CuckooFilter that keeps most items' two buckets in a block of alt_window
+template <size_t alt_window>
+using BlockLocalCuckooFilter = CuckooFilter<uint64_t, 12, SingleTable,
+    TwoIndependentMultiplyShift, allocator<char>, 4, alt_window>;
+
 template<typename Table>
 Metrics CuckooBenchmark(size_t add_count, const vector<uint64_t>& input) {
   Table cuckoo(add_count);
@@ -46,20 +69,33 @@ Metrics CuckooBenchmark(size_t add_count, const vector<uint64_t>& input) {
   // Count false positives:
   size_t false_positive_count = 0;
   size_t absent = 0;
+  start_time = NowNanos();
   for (; inserted + absent < input.size() && absent < FPR_SAMPLE_SIZE; ++absent) {
     false_positive_count += (0 == cuckoo.Contain(input[inserted + absent]));
   }
+  auto lookup_time = NowNanos() - start_time;
 
   // Calculate metrics:
   const auto time = constr_time / static_cast<double>(1000 * 1000 * 1000);
   Metrics result;
   result.add_count = static_cast<double>(inserted) / (1000 * 1000);
+  result.load = (100.0 * inserted) / (4 * Table::NumBucketsFor(add_count));
   result.space = static_cast<double>(CHAR_BIT * cuckoo.SizeInBytes()) / inserted;
   result.fpr = (100.0 * false_positive_count) / absent;
   result.speed = (inserted / time) / (1000 * 1000);
+  result.lookup_speed = absent * 1000.0 / lookup_time;
   return result;
 }
 
+void PrintRow(const char* name, double Metrics::*metric, const vector<Metrics>& columns,
+    bool percent = false) {
+  cout << setw(35) << left << name << right;
+  for (const Metrics& column : columns) {
+    cout << setw(percent ? 9 : 10) << column.*metric << (percent ? "%" : "");
+  }
+  cout << endl;
+}
+
 int main() {
   // Number of distinct values, used only for the constructor of CuckooFilter, which does
   // not allow the caller to specify the space usage directly. The actual number of
@@ -77,15 +113,24 @@ int main() {
   const auto sscf = CuckooBenchmark<
       CuckooFilter<uint64_t, 13 /* bits per item */, PackedTable /* semi-sorted*/>>(
       add_count, input);
+  // CF with a single victim slot instead of a stash, as in the paper, and with a larger
+  // stash:
+  const auto cf1 = CuckooBenchmark<StashedCuckooFilter<1>>(add_count, input);
+  const auto cf16 = CuckooBenchmark<StashedCuckooFilter<16>>(add_count, input);
+  // CF with both buckets of an item in a small block of the table:
+  const auto cfw8 = CuckooBenchmark<BlockLocalCuckooFilter<8>>(add_count, input);
+  const auto cfw64 = CuckooBenchmark<BlockLocalCuckooFilter<64>>(add_count, input);
+  const auto cfw512 = CuckooBenchmark<BlockLocalCuckooFilter<512>>(add_count, input);
+  const vector<Metrics> columns = {cf, sscf, cf1, cf16, cfw8, cfw64, cfw512};
 
-  cout << setw(35) << left << "metrics " << setw(10) << right << "CF" << setw(10)
-       << "ss-CF" << endl
-       << fixed << setprecision(2) << setw(35) << left << "# of items (million) "
-       << setw(10) << right << cf.add_count << setw(10) << sscf.add_count << endl
-       << setw(35) << left << "bits per item " << setw(10) << right << cf.space
-       << setw(10) << sscf.space << endl
-       << setw(35) << left << "false positive rate " << setw(9) << right << cf.fpr << "%"
-       << setw(9) << sscf.fpr << "%" << endl
-       << setw(35) << left << "constr. speed (million keys/sec) " << setw(10) << right
-       << cf.speed << setw(10) << sscf.speed << endl;
+  cout << setw(35) << left << "metrics " << right << setw(10) << "CF" << setw(10)
+       << "ss-CF" << setw(10) << "CF s=1" << setw(10) << "CF s=16" << setw(10)
+       << "CF w=8" << setw(10) << "CF w=64" << setw(10) << "CF w=512" << endl
+       << fixed << setprecision(2);
+  PrintRow("# of items (million) ", &Metrics::add_count, columns);
+  PrintRow("load factor ", &Metrics::load, columns, true);
+  PrintRow("bits per item ", &Metrics::space, columns);
+  PrintRow("false positive rate ", &Metrics::fpr, columns, true);
+  PrintRow("constr. speed (million keys/sec) ", &Metrics::speed, columns);
+  PrintRow("lookup speed (million keys/sec) ", &Metrics::lookup_speed, columns);
 }
@@ -1,12 +1,977 @@
+#include "adaptivecuckoofilter.h"
+#include "binaryfusefilter.h"
+#include "counting-simd-block.h"
 #include "cuckoofilter.h"
+#include "cuckoofilterbank.h"
+#include "cuckoomap.h"
+#include "filterhandle.h"
+#include "frozencuckoofilter.h"
+#include "sharedcuckoofilter.h"
+#include "simd-block.h"
+#include "windowedcuckoofilter.h"
 
 #include <assert.h>
 #include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 
+#include <algorithm>
+#include <fstream>
 #include <iostream>
+#include <random>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <thread>
 #include <vector>
 
+using cuckoofilter::AdaptiveCuckooFilter;
 using cuckoofilter::CuckooFilter;
+using cuckoofilter::CuckooFilterBank;
+using cuckoofilter::CuckooMap;
+using cuckoofilter::TwoIndependentMultiplyShift;
+using cuckoofilter::WindowedCuckooFilter;
+
+// The checks below use a fixed hash function, so their false positives are
+// the same on every run.
+const uint64_t kSeed = 42;
+
+// Add items from 0 until Add() fails, which it does once the stash is full,
+// and return how many were added.
+template <typename Filter>
+size_t Fill(Filter &filter, const size_t max_items) {
+  size_t num_inserted = 0;
+  while (num_inserted < max_items &&
+         filter.Add(num_inserted) == cuckoofilter::Ok) {
+    num_inserted++;
+  }
+  return num_inserted;
+}
+
+// Whether f() throws an Exception.
+template <typename Exception, typename Function>
+bool Throws(Function f) {
+  try {
+    f();
+  } catch (const Exception &) {
+    return true;
+  }
+  return false;
+}
+
+// MakeFilter() picks each specialization for some false positive rate and
+// capacity, and the batch methods of each one agree with its single-key ones:
+// every key added is found, absent keys meet the rate asked for, and deletes
+// remove keys where the filter supports them.
+void TestFilterHandle() {
+  struct Case {
+    double false_positive_rate;
+    size_t max_num_keys;
+    const char *name;
+  };
+  const Case cases[] = {
+      {0.5, 3000, "SimdBlock8"},    {2.5e-4, 3000, "Cuckoo16"},
+      {3.7e-3, 3900, "Cuckoo12"},   {2.2e-2, 3900, "SemiSort9"},
+      {9.7e-4, 3000, "SemiSort13"}, {8.3e-5, 3000, "SemiSort17"},
+  };
+  std::mt19937_64 random(kSeed);
+  for (const Case &c : cases) {
+    const std::unique_ptr<cuckoofilter::FilterHandle> filter =
+        cuckoofilter::MakeFilter(c.false_positive_rate, c.max_num_keys);
+    assert(filter->Name() == c.name);
+    // well short of max_num_keys, so Add() cannot run out of space
+    std::vector<uint64_t> keys(c.max_num_keys * 9 / 10);
+    for (uint64_t &key : keys) key = random();
+    const size_t num_added = filter->AddMany(keys.data(), keys.size());
+    assert(num_added == keys.size());
+    std::vector<uint64_t> found((keys.size() + 63) / 64);
+    size_t num_found =
+        filter->ContainMany(keys.data(), keys.size(), found.data());
+    assert(num_found == keys.size());
+
+    std::vector<uint64_t> probes(20000);
+    for (uint64_t &probe : probes) probe = random();
+    std::vector<uint64_t> probe_found(probes.size() / 64 + 1);
+    num_found =
+        filter->ContainMany(probes.data(), probes.size(), probe_found.data());
+    assert(num_found <= 1.5 * c.false_positive_rate * probes.size() + 10);
+    for (size_t i = 0; i < probes.size(); i++) {
+      const bool bit = (probe_found[i / 64] >> (i % 64)) & 1;
+      assert(bit == (filter->Contain(probes[i]) == cuckoofilter::Ok));
+    }
+
+    const size_t half = keys.size() / 2;
+    const size_t num_deleted = filter->DeleteMany(keys.data(), half);
+    assert(num_deleted == (filter->SupportsDelete() ? half : 0));
+    num_found = filter->ContainMany(keys.data() + half, keys.size() - half,
+                                    found.data());
+    assert(num_found == keys.size() - half);
+    num_found = filter->ContainMany(keys.data(), half, found.data());
+    // deleted keys are found only as false positives
+    assert(filter->SupportsDelete()
+               ? num_found <= 1.5 * c.false_positive_rate * half + 10
+               : num_found == half);
+  }
+  assert(Throws<std::invalid_argument>([] { cuckoofilter::MakeFilter(0, 1); }));
+  assert(Throws<std::invalid_argument>([] { cuckoofilter::MakeFilter(1, 1); }));
+}
+
+// An allocator that counts the bytes its copies have outstanding.
+template <typename T>
+struct CountingAllocator {
+  typedef T value_type;
+  int64_t *live_bytes;
+
+  explicit CountingAllocator(int64_t *live_bytes) : live_bytes(live_bytes) {}
+  template <typename U>
+  CountingAllocator(const CountingAllocator<U> &that)
+      : live_bytes(that.live_bytes) {}
+
+  T *allocate(size_t n) {
+    *live_bytes += n * sizeof(T);
+    return std::allocator<T>().allocate(n);
+  }
+  void deallocate(T *p, size_t n) {
+    *live_bytes -= n * sizeof(T);
+    std::allocator<T>().deallocate(p, n);
+  }
+  bool operator==(const CountingAllocator &that) const {
+    return live_bytes == that.live_bytes;
+  }
+  bool operator!=(const CountingAllocator &that) const {
+    return !(*this == that);
+  }
+};
+
+// A filter takes its table from the allocator given and returns it once,
+// keeps its items when moved or move-assigned, and a moved-from filter can be
+// destroyed or assigned to.
+template <size_t bits_per_item,
+          template <size_t, typename> class TableType>
+void TestMoveAndAllocator() {
+  typedef CuckooFilter<size_t, bits_per_item, TableType,
+                       TwoIndependentMultiplyShift, CountingAllocator<char>>
+      Filter;
+  int64_t live_bytes = 0;
+  const CountingAllocator<char> allocator(&live_bytes);
+  {
+    Filter filter(1000, allocator, TwoIndependentMultiplyShift(kSeed));
+    assert(live_bytes > 0);
+    const size_t num_inserted = Fill(filter, 500);
+    assert(num_inserted == 500);
+    const int64_t one_table = live_bytes;
+
+    Filter moved(std::move(filter));
+    assert(live_bytes == one_table);
+    Filter assigned(1000, allocator, TwoIndependentMultiplyShift(kSeed));
+    assigned = std::move(moved);
+    for (size_t i = 0; i < num_inserted; i++) {
+      assert(assigned.Contain(i) == cuckoofilter::Ok);
+    }
+    assert(assigned.Size() == num_inserted);
+
+    filter = Filter(100, allocator, TwoIndependentMultiplyShift(kSeed));
+    const cuckoofilter::Status status = filter.Add(7);
+    assert(status == cuckoofilter::Ok);
+    assert(filter.Contain(7) == cuckoofilter::Ok);
+  }
+  assert(live_bytes == 0);
+
+  // SimdBlockFilter moves its directory too.
+  typedef SimdBlockFilter<TwoIndependentMultiplyShift> BlockFilter;
+  BlockFilter block =
+      BlockFilter::WithHeapSpace(4096, TwoIndependentMultiplyShift(kSeed));
+  block.Add(7);
+  const BlockFilter moved_block(std::move(block));
+  assert(moved_block.Find(7));
+}
+
+// A frozen filter finds every item, at most about 2^-bits_per_item more false
+// positives than the filter it was frozen from, and is smaller than it when
+// the table is less than half full.
+template <size_t bits_per_item,
+          template <size_t, typename> class TableType = cuckoofilter::SingleTable>
+void TestFreeze(const size_t total_items, const size_t num_items) {
+  CuckooFilter<size_t, bits_per_item, TableType> filter(
+      total_items, std::allocator<char>(), TwoIndependentMultiplyShift(kSeed));
+  for (size_t i = 0; i < num_items; i++) {
+    const cuckoofilter::Status status = filter.Add(i);
+    assert(status == cuckoofilter::Ok);
+  }
+  const auto frozen = filter.Freeze();
+  assert(frozen.Size() == num_items);
+  if (2 * num_items <= total_items) {
+    assert(frozen.SizeInBytes() <= filter.SizeInBytes());
+  }
+  for (size_t i = 0; i < num_items; i++) {
+    assert(frozen.Contain(i) == cuckoofilter::Ok);
+  }
+  const size_t num_probes = 100000;
+  size_t table_false = 0, frozen_false = 0;
+  for (size_t i = num_items; i < num_items + num_probes; i++) {
+    table_false += filter.Contain(i) == cuckoofilter::Ok;
+    frozen_false += frozen.Contain(i) == cuckoofilter::Ok;
+  }
+  assert(frozen_false <=
+         2 * (table_false + (num_probes >> bits_per_item)) + 20);
+}
+
+// A TryAdd() that fails leaves every lookup and Size() as they were.
+void TestTryAdd() {
+  const size_t total_items = 1000;
+  const size_t num_probes = 4 * total_items;
+  CuckooFilter<size_t, 12> filter(total_items, std::allocator<char>(),
+                                  TwoIndependentMultiplyShift(kSeed));
+  const size_t num_inserted = Fill(filter, 4 * total_items);
+  assert(num_inserted < 4 * total_items);
+
+  std::vector<bool> found(num_probes);
+  size_t failures = 0;
+  for (size_t i = num_probes; i < num_probes + 100; i++) {
+    for (size_t j = 0; j < num_probes; j++) {
+      found[j] = filter.Contain(j) == cuckoofilter::Ok;
+    }
+    const size_t size = filter.Size();
+    if (filter.TryAdd(i) == cuckoofilter::Ok) {
+      assert(filter.Size() == size + 1);
+      assert(filter.Contain(i) == cuckoofilter::Ok);
+      continue;
+    }
+    failures++;
+    assert(filter.Size() == size);
+    for (size_t j = 0; j < num_probes; j++) {
+      assert(found[j] == (filter.Contain(j) == cuckoofilter::Ok));
+    }
+  }
+  assert(failures > 0);
+}
+
+// AddIfAbsent() stores an item once, and AddManyIfAbsent() stops at the
+// first item there is no room for.
+void TestAddIfAbsent() {
+  const size_t total_items = 1000;
+  CuckooFilter<size_t, 12> filter(total_items, std::allocator<char>(),
+                                  TwoIndependentMultiplyShift(kSeed));
+  for (size_t i = 0; i < 100; i++) {
+    const cuckoofilter::Status status = filter.AddIfAbsent(i);
+    assert(status == cuckoofilter::Ok);
+  }
+  for (size_t i = 0; i < 100; i++) {
+    const cuckoofilter::Status status = filter.AddIfAbsent(i);
+    assert(status == cuckoofilter::AlreadyPresent);
+  }
+  assert(filter.Size() == 100);
+
+  // Items repeated in a batch, or already added, are added once.
+  const size_t repeated[] = {100, 101, 100, 0, 102, 101};
+  uint64_t added = 0;
+  const size_t repeated_stop = filter.AddManyIfAbsent(repeated, 6, &added);
+  assert(repeated_stop == 6);
+  assert(added == 0x13);
+  assert(filter.Size() == 103);
+
+  // Far more items than fit: AddManyIfAbsent() returns where it stopped,
+  // and only items before that are added.
+  const size_t n = 4 * total_items;
+  std::vector<size_t> items(n);
+  for (size_t i = 0; i < n; i++) {
+    items[i] = 1000 + i;
+  }
+  std::vector<uint64_t> bits((n + 63) / 64);
+  const size_t size = filter.Size();
+  const size_t stop = filter.AddManyIfAbsent(items.data(), n, bits.data());
+  assert(stop < n);
+  size_t num_added = 0;
+  for (size_t i = 0; i < n; i++) {
+    const bool bit = (bits[i / 64] >> (i % 64)) & 1;
+    assert(i < stop || !bit);
+    if (i < stop) {
+      assert(filter.Contain(items[i]) == cuckoofilter::Ok);
+    }
+    num_added += bit;
+  }
+  assert(filter.Size() == size + num_added);
+  const cuckoofilter::Status status = filter.AddIfAbsent(items[stop]);
+  assert(status == cuckoofilter::NotEnoughSpace);
+}
+
+// DeleteMany() deletes an item once per time it was added, and finds items
+// in the stash.
+void TestDeleteMany() {
+  CuckooFilter<size_t, 12> filter(1000, std::allocator<char>(),
+                                  TwoIndependentMultiplyShift(kSeed));
+  cuckoofilter::Status status = filter.Add(7);
+  assert(status == cuckoofilter::Ok);
+  status = filter.Add(7);
+  assert(status == cuckoofilter::Ok);
+  const size_t repeated[] = {7, 7, 7};
+  uint64_t deleted = 0;
+  const size_t num_deleted = filter.DeleteMany(repeated, 3, &deleted);
+  assert(num_deleted == 2);
+  assert(deleted == 0x3);
+  assert(filter.Size() == 0);
+  assert(filter.Contain(7) == cuckoofilter::NotFound);
+
+  // Add() fails only once the stash is full, so the last items added are
+  // stashed.
+  const size_t num_inserted = Fill(filter, 4000);
+  assert(num_inserted < 4000);
+  std::vector<size_t> items(num_inserted);
+  for (size_t i = 0; i < num_inserted; i++) {
+    items[i] = num_inserted - 1 - i;
+  }
+  std::vector<uint64_t> bits((num_inserted + 63) / 64);
+  const size_t num_stashed_deleted =
+      filter.DeleteMany(items.data(), num_inserted, bits.data());
+  assert(num_stashed_deleted == num_inserted);
+  assert(filter.Size() == 0);
+  for (size_t i = 0; i < num_inserted; i++) {
+    assert(filter.Contain(i) == cuckoofilter::NotFound);
+  }
+  status = filter.Add(0);
+  assert(status == cuckoofilter::Ok);
+}
+
+// With alt_window, AltIndex() is its own inverse and keeps both buckets in
+// one block of alt_window buckets, in tables smaller than a block too, and a
+// filter finds every item it holds.
+template <size_t alt_window>
+void TestAltWindow() {
+  typedef cuckoofilter::CuckooLayout<12, 4, alt_window> Layout;
+  for (size_t num_buckets = 1; num_buckets <= 4096; num_buckets *= 2) {
+    const size_t block = std::min(alt_window, num_buckets);
+    for (uint32_t tag = 1; tag < (1 << 12); tag++) {
+      const size_t index = (tag * 2654435761u) & (num_buckets - 1);
+      const size_t alt = Layout::AltIndex(index, tag, num_buckets);
+      assert(alt < num_buckets);
+      assert(Layout::AltIndex(alt, tag, num_buckets) == index);
+      if ((tag & 3) != 0) {
+        assert(alt / block == index / block);
+        assert(alt != index || num_buckets < alt_window);
+      }
+    }
+  }
+
+  const size_t sizes[] = {4, 64, 1000, 100000};
+  for (size_t max_num_keys : sizes) {
+    CuckooFilter<size_t, 12, cuckoofilter::SingleTable,
+                 TwoIndependentMultiplyShift, std::allocator<char>, 4,
+                 alt_window>
+        filter(max_num_keys, std::allocator<char>(),
+               TwoIndependentMultiplyShift(kSeed));
+    const size_t num_inserted = Fill(filter, max_num_keys);
+    assert(num_inserted > 0);
+    for (size_t i = 0; i < num_inserted; i++) {
+      assert(filter.Contain(i) == cuckoofilter::Ok);
+    }
+  }
+}
+
+// A CuckooMap finds the value of every item it holds, stashed ones included,
+// and a full map refuses an item without losing any.
+void TestMap() {
+  CuckooMap<size_t, 12, 4> map(1000, std::allocator<char>(),
+                               TwoIndependentMultiplyShift(kSeed));
+  size_t num_inserted = 0;
+  while (num_inserted < 4000 &&
+         map.Add(num_inserted, num_inserted % 16) == cuckoofilter::Ok) {
+    num_inserted++;
+  }
+  assert(num_inserted < 4000);
+  assert(map.Size() == num_inserted);
+  uint32_t value;
+  for (size_t i = 0; i < num_inserted; i++) {
+    assert(map.Lookup(i, &value) == cuckoofilter::Ok && value == i % 16);
+  }
+  for (size_t i = 0; i < num_inserted; i++) {
+    const cuckoofilter::Status status = map.Add(i, (i + 1) % 16);
+    assert(status == cuckoofilter::Ok);
+  }
+  assert(map.Size() == num_inserted);
+  for (size_t i = num_inserted; i-- > 0;) {
+    assert(map.Lookup(i, &value) == cuckoofilter::Ok && value == (i + 1) % 16);
+    const cuckoofilter::Status status = map.Delete(i);
+    assert(status == cuckoofilter::Ok);
+  }
+  assert(map.Size() == 0);
+}
+
+// An AdaptiveCuckooFilter stops finding a reported false positive and still
+// finds every item in its store, and Delete() removes only the given item.
+void TestAdaptive() {
+  typedef AdaptiveCuckooFilter<size_t, 12> Filter;
+  const size_t total_items = 10000;
+  std::vector<size_t> store(Filter::NumSlotsFor(total_items));
+  Filter filter(total_items, &store, std::allocator<char>(),
+                TwoIndependentMultiplyShift(kSeed));
+  const size_t num_inserted = Fill(filter, total_items);
+  assert(num_inserted == total_items);
+
+  size_t reported = 0, still_found = 0;
+  for (size_t i = total_items; reported < 200; i++) {
+    if (filter.Contain(i) != cuckoofilter::Ok) continue;
+    const cuckoofilter::Status status = filter.ReportFalsePositive(i);
+    assert(status == cuckoofilter::Ok);
+    reported++;
+    still_found += filter.Contain(i) == cuckoofilter::Ok;
+  }
+  assert(still_found == 0);
+  for (size_t i = 0; i < num_inserted; i++) {
+    assert(filter.Contain(i) == cuckoofilter::Ok);
+  }
+  cuckoofilter::Status status = filter.ReportFalsePositive(0);
+  assert(status == cuckoofilter::AlreadyPresent);
+
+  for (size_t i = 0; i < num_inserted; i += 2) {
+    status = filter.Delete(i);
+    assert(status == cuckoofilter::Ok);
+    status = filter.Delete(i);
+    assert(status == cuckoofilter::NotFound);
+  }
+  assert(filter.Size() == num_inserted / 2);
+  for (size_t i = 1; i < num_inserted; i += 2) {
+    assert(filter.Contain(i) == cuckoofilter::Ok);
+  }
+}
+
+// Items are found for num_generations generations, then expire.
+void TestWindowed() {
+  const size_t total_items = 1000;
+  const size_t num_generations = 3;
+  WindowedCuckooFilter<size_t, 12, num_generations> filter(
+      total_items, std::allocator<char>(), TwoIndependentMultiplyShift(kSeed));
+  std::vector<uint64_t> found(total_items / 64 + 1);
+  for (size_t generation = 0; generation < 10; generation++) {
+    const size_t first = generation * total_items;
+    for (size_t i = first; i < first + total_items; i++) {
+      const cuckoofilter::Status status = filter.Add(i);
+      assert(status == cuckoofilter::Ok);
+    }
+    for (size_t i = first; i < first + total_items; i++) {
+      const cuckoofilter::Status status = filter.AddIfAbsent(i);
+      assert(status == cuckoofilter::AlreadyPresent);
+    }
+    // the live generations are found, the expired ones only as often as a
+    // false positive
+    for (size_t age = 0; age <= generation; age++) {
+      std::vector<size_t> items(total_items);
+      for (size_t i = 0; i < total_items; i++) {
+        items[i] = first - age * total_items + i;
+      }
+      const size_t count =
+          filter.ContainMany(items.data(), total_items, found.data());
+      if (age < num_generations) {
+        assert(count == total_items);
+      } else {
+        assert(count < total_items / 20);
+      }
+      for (size_t i = 0; i < total_items; i++) {
+        assert(((found[i / 64] >> (i % 64)) & 1) ==
+               (filter.Contain(items[i]) == cuckoofilter::Ok));
+      }
+    }
+    filter.Advance();
+  }
+}
+
+// Each shard's filter finds its own items, and ContainMany() reports what
+// Contain() does.
+void TestBank() {
+  const size_t num_filters = 100;
+  const size_t total_items = 500;
+  CuckooFilterBank<size_t, 12> bank(num_filters, total_items,
+                                    std::allocator<char>(),
+                                    TwoIndependentMultiplyShift(kSeed));
+  for (size_t k = 0; k < num_filters; k++) {
+    for (size_t i = 0; i < total_items; i++) {
+      const cuckoofilter::Status status = bank.Add(k, k * total_items + i);
+      assert(status == cuckoofilter::Ok);
+    }
+    assert(bank.Size(k) == total_items);
+  }
+  const size_t n = 2 * num_filters * total_items;
+  const size_t words = bank.BitmapWords();
+  std::vector<size_t> items(n);
+  for (size_t i = 0; i < n; i++) {
+    items[i] = i;
+  }
+  std::vector<uint64_t> many(n * words);
+  std::vector<uint64_t> one(words);
+  const size_t count = bank.ContainMany(items.data(), n, many.data());
+  size_t total = 0;
+  for (size_t i = 0; i < n; i++) {
+    total += bank.Contain(items[i], one.data());
+    for (size_t w = 0; w < words; w++) {
+      assert(one[w] == many[i * words + w]);
+    }
+    if (i < num_filters * total_items) {
+      const size_t k = i / total_items;
+      assert((one[k / 64] >> (k % 64)) & 1);
+    }
+  }
+  assert(count == total);
+  // a deleted item is no longer found in its filter, barring a false
+  // positive
+  size_t still_found = 0;
+  for (size_t i = 0; i < total_items; i++) {
+    const cuckoofilter::Status status = bank.Delete(0, i);
+    assert(status == cuckoofilter::Ok);
+    bank.Contain(i, one.data());
+    still_found += one[0] & 1;
+  }
+  assert(bank.Size(0) == 0);
+  assert(still_found == 0);
+}
+
+// A read-only attach to a SharedCuckooFilter answers as the writer does and
+// refuses every write, and a filter with a different bits_per_item cannot
+// attach.
+void TestShared() {
+  typedef cuckoofilter::SharedCuckooFilter<size_t, 12> Filter;
+  const std::string name =
+      "/cuckoofilter-test-" + std::to_string(static_cast<long>(getpid()));
+  Filter::Remove(name);
+  Filter writer(name, 10000);
+  const size_t num_inserted = Fill(writer, 5000);
+  assert(num_inserted == 5000);
+  cuckoofilter::Status status = writer.Delete(0);
+  assert(status == cuckoofilter::Ok);
+  assert(Throws<std::system_error>([&] { Filter again(name, 10000); }));
+
+  const Filter reader(name);
+  assert(reader.Size() == num_inserted - 1);
+  for (size_t i = 1; i < num_inserted; i++) {
+    assert(reader.Contain(i) == cuckoofilter::Ok);
+  }
+  for (size_t i = 0; i < 100000; i++) {
+    const size_t absent = num_inserted + i;
+    assert(reader.Contain(absent) == writer.Contain(absent));
+  }
+  // a write is seen by readers attached before it
+  status = writer.Add(num_inserted);
+  assert(status == cuckoofilter::Ok);
+  assert(reader.Contain(num_inserted) == cuckoofilter::Ok);
+  assert(reader.Size() == num_inserted);
+
+  // not const, to call the writer's methods
+  Filter attached(name);
+  const size_t item = 1;
+  uint64_t deleted;
+  assert(Throws<std::logic_error>([&] { attached.Add(item); }));
+  assert(Throws<std::logic_error>([&] { attached.TryAdd(item); }));
+  assert(Throws<std::logic_error>([&] { attached.AddIfAbsent(item); }));
+  assert(Throws<std::logic_error>([&] { attached.Delete(item); }));
+  assert(Throws<std::logic_error>(
+      [&] { attached.DeleteMany(&item, 1, &deleted); }));
+  assert(attached.Contain(item) == cuckoofilter::Ok);
+
+  typedef cuckoofilter::SharedCuckooFilter<size_t, 13> OtherFilter;
+  assert(Throws<std::runtime_error>([&] { OtherFilter other(name); }));
+  Filter::Remove(name);
+  assert(Throws<std::system_error>([&] { Filter gone(name); }));
+}
+
+// Fill a filter, delete 60% of its items, halve it, and check that every item
+// left is still found.
+template <typename Filter>
+void TestShrink(const size_t total_items) {
+  Filter filter(total_items);
+  size_t num_inserted = 0;
+  for (size_t i = 0; i < total_items; i++, num_inserted++) {
+    if (filter.Add(i) != cuckoofilter::Ok) {
+      break;
+    }
+  }
+  for (size_t i = 0; i < num_inserted; i++) {
+    if (i % 5 < 3) {
+      const cuckoofilter::Status status = filter.Delete(i);
+      assert(status == cuckoofilter::Ok);
+    }
+  }
+  const size_t num_left = filter.Size();
+  const size_t bytes = filter.SizeInBytes();
+  const cuckoofilter::Status status = filter.Shrink();
+  assert(status == cuckoofilter::Ok);
+  assert(filter.SizeInBytes() < bytes);
+  assert(filter.Size() == num_left);
+  for (size_t i = 0; i < num_inserted; i++) {
+    if (i % 5 >= 3) {
+      assert(filter.Contain(i) == cuckoofilter::Ok);
+    }
+  }
+}
+
+// A SIMD kernel for buckets of 2^log_bucket_byte_size bytes sets exactly the
+// bits the scalar one sets, and finds the same keys.
+template <typename Ops, int log_bucket_byte_size, int bits_per_key>
+void CheckSimdBlockKernel() {
+  if (!Ops::Supported()) return;
+  typedef ScalarBucket<log_bucket_byte_size, 32, bits_per_key> Scalar;
+  const uint64_t kNumBuckets = 16;
+  alignas(64) uint32_t scalar[kNumBuckets << (log_bucket_byte_size - 2)] = {};
+  alignas(64) uint32_t simd[kNumBuckets << (log_bucket_byte_size - 2)] = {};
+  const TwoIndependentMultiplyShift hasher(kSeed);
+  for (uint64_t key = 0; key < 100; key++) {
+    Scalar::InsertKey(scalar, kNumBuckets, hasher, key);
+    Ops::InsertKey(simd, kNumBuckets, hasher, key);
+  }
+  assert(memcmp(scalar, simd, sizeof(simd)) == 0);
+  for (uint64_t key = 0; key < 10000; key++) {
+    assert(Ops::ContainsKey(simd, kNumBuckets, hasher, key) ==
+           Scalar::ContainsKey(scalar, kNumBuckets, hasher, key));
+  }
+}
+
+// Every instruction set the CPU supports builds the same filter, with one or
+// more bits per lane.
+void TestSimdBlockKernels() {
+  CheckSimdBlockKernel<Sse2Bucket<4, 4>, 4, 4>();
+  CheckSimdBlockKernel<Sse2Bucket<4, 12>, 4, 12>();
+  CheckSimdBlockKernel<Sse2Bucket<5, 8>, 5, 8>();
+  CheckSimdBlockKernel<Sse41Bucket<4, 4>, 4, 4>();
+  CheckSimdBlockKernel<Sse41Bucket<5, 16>, 5, 16>();
+  CheckSimdBlockKernel<Sse41Bucket<6, 16>, 6, 16>();
+  CheckSimdBlockKernel<Avx2Bucket<5, 8>, 5, 8>();
+  CheckSimdBlockKernel<Avx2Bucket<5, 24>, 5, 24>();
+  CheckSimdBlockKernel<Avx2Bucket<6, 16>, 6, 16>();
+  CheckSimdBlockKernel<Avx512Bucket<6, 16>, 6, 16>();
+  CheckSimdBlockKernel<Avx512Bucket<6, 32>, 6, 32>();
+
+  // 512-bit buckets use AVX-512 wherever the CPU has it.
+  const SimdBlockFilter<TwoIndependentMultiplyShift, 6> filter(12);
+  const bool avx512 = Avx512Bucket<6, 16>::Supported();
+  assert(!avx512 || strcmp(filter.InstructionSet(), "AVX-512") == 0);
+}
+
+// Save() of a SimdBlockFilter, to compare the bits of two filters.
+template <typename Filter>
+std::string SavedBits(const Filter &filter) {
+  std::ostringstream out;
+  filter.Save(out);
+  return out.str();
+}
+
+// AddMany() sets the bits Add() does, and FindMany() finds the keys Find()
+// does, for batches that are not a multiple of 64 keys.
+template <typename Filter>
+void TestSimdBlockBatch() {
+  const TwoIndependentMultiplyShift hasher(kSeed);
+  Filter one = Filter::WithHeapSpace(4096, hasher);
+  Filter many = Filter::WithHeapSpace(4096, hasher);
+  std::vector<uint64_t> keys;
+  for (uint64_t key = 0; key < 1000; key++) keys.push_back(key * key % 1009);
+  for (uint64_t key : keys) one.Add(key);
+  many.AddMany(keys.data(), 0);
+  many.AddMany(keys.data(), keys.size());
+  assert(SavedBits(one) == SavedBits(many));
+
+  std::vector<uint64_t> probes;
+  for (uint64_t key = 0; key < 10000 - 7; key++) probes.push_back(key);
+  std::vector<uint64_t> found((probes.size() + 63) / 64);
+  const size_t num_found =
+      many.FindMany(probes.data(), probes.size(), found.data());
+  size_t expected = 0;
+  for (size_t i = 0; i < probes.size(); i++) {
+    const bool bit = (found[i / 64] >> (i % 64)) & 1;
+    assert(bit == one.Find(probes[i]));
+    expected += bit;
+  }
+  assert(num_found == expected);
+  assert(many.FindMany(probes.data(), 0, found.data()) == 0);
+}
+
+// Threads adding keys with AddConcurrent() and AddManyConcurrent() set the
+// bits that Add() of every key sets, so no key is lost.
+template <typename Filter>
+void TestSimdBlockConcurrent() {
+  const TwoIndependentMultiplyShift hasher(kSeed);
+  Filter serial = Filter::WithHeapSpace(1 << 14, hasher);
+  Filter concurrent = Filter::WithHeapSpace(1 << 14, hasher);
+  const size_t kNumThreads = 4, kKeysPerThread = 20000;
+  std::vector<uint64_t> keys(kNumThreads * kKeysPerThread);
+  for (size_t i = 0; i < keys.size(); i++) keys[i] = i * 0x9e3779b97f4a7c15ULL;
+  for (uint64_t key : keys) serial.Add(key);
+
+  std::vector<std::thread> threads;
+  for (size_t t = 0; t < kNumThreads; t++) {
+    threads.push_back(std::thread([&, t] {
+      const uint64_t *const begin = keys.data() + t * kKeysPerThread;
+      const size_t half = kKeysPerThread / 2;
+      for (size_t i = 0; i < half; i++) concurrent.AddConcurrent(begin[i]);
+      concurrent.AddManyConcurrent(begin + half, kKeysPerThread - half);
+    }));
+  }
+  for (std::thread &thread : threads) thread.join();
+  for (uint64_t key : keys) assert(concurrent.Find(key));
+  assert(SavedBits(serial) == SavedBits(concurrent));
+}
+
+// Union() finds at least every key either filter finds, Intersect() only
+// keys both find and every key added to both, and Fold() at least every key
+// the filter found.
+// Filters of different sizes or hashers cannot be combined.
+template <typename Filter>
+void TestSimdBlockCombine() {
+  const TwoIndependentMultiplyShift hasher(kSeed);
+  Filter x = Filter::WithHeapSpace(8192, hasher);
+  Filter y = Filter::WithHeapSpace(8192, hasher);
+  for (uint64_t key = 0; key < 2000; key++) x.Add(key);
+  for (uint64_t key = 1000; key < 3000; key++) y.Add(key);
+
+  const Filter both = Filter::Union(x, y);
+  const Filter common = Filter::Intersect(x, y);
+  std::istringstream x_saved(SavedBits(x));
+  Filter folded = Filter::Load(x_saved);
+  folded.Fold();
+  assert(folded.SizeInBytes() == x.SizeInBytes() / 2);
+  for (uint64_t key = 0; key < 3000; key++) assert(both.Find(key));
+  for (uint64_t key = 1000; key < 2000; key++) assert(common.Find(key));
+  for (uint64_t key = 0; key < 2000; key++) assert(folded.Find(key));
+  for (uint64_t key = 0; key < 100000; key++) {
+    const bool in_x = x.Find(key), in_y = y.Find(key);
+    assert(!(in_x || in_y) || both.Find(key));
+    assert(!common.Find(key) || (in_x && in_y));
+    assert(!in_x || folded.Find(key));
+  }
+
+  x.UnionWith(y);
+  assert(SavedBits(x) == SavedBits(both));
+  std::istringstream y_saved(SavedBits(y));
+  Filter y_common = Filter::Load(y_saved);
+  y_common.IntersectWith(common);
+  assert(SavedBits(y_common) == SavedBits(common));
+
+  const size_t bucket_bytes =
+      Filter::WithHeapSpace(0, hasher).SizeInBytes() / 2;
+  const Filter smaller = Filter::WithHeapSpace(4096, hasher);
+  const Filter other_hasher =
+      Filter::WithHeapSpace(8192, TwoIndependentMultiplyShift(kSeed + 1));
+  assert(Throws<std::invalid_argument>([&] { x.UnionWith(smaller); }));
+  assert(Throws<std::invalid_argument>([&] { x.IntersectWith(other_hasher); }));
+  Filter two = Filter::WithHeapSpace(2 * bucket_bytes, hasher);
+  Filter three = Filter::WithHeapSpace(3 * bucket_bytes, hasher);
+  assert(Throws<std::logic_error>([&] { two.Fold(); }));
+  assert(Throws<std::logic_error>([&] { three.Fold(); }));
+}
+
+// A filter of 2^log_bucket_byte_size-byte buckets of lane_bits-bit lanes,
+// sized for 20000 keys at a false positive probability of 1%, is the fewest
+// buckets that the model says reach it, finds every key added and meets that
+// probability. Filters sized in bytes get whole buckets, at least two.
+template <int log_bucket_byte_size, int lane_bits, int bits_per_key>
+void TestSimdBlockGeometry() {
+  typedef SimdBlockFilter<TwoIndependentMultiplyShift, log_bucket_byte_size,
+                          lane_bits, bits_per_key>
+      Filter;
+  const size_t ndv = 20000;
+  const double fpp = 0.01;
+  Filter filter(ndv, fpp, TwoIndependentMultiplyShift(kSeed));
+  const uint64_t bucket_bytes = 1 << log_bucket_byte_size;
+  const uint64_t bytes = filter.SizeInBytes();
+  assert(bytes == Filter::MinHeapSpace(ndv, fpp));
+  assert(bytes % bucket_bytes == 0);
+  assert(Filter::FalsePositiveProbOfSpace(ndv, bytes) <= fpp);
+  assert(Filter::FalsePositiveProbOfSpace(ndv, bytes - bucket_bytes) > fpp);
+  const uint64_t heap_spaces[] = {0, 1, 2 * bucket_bytes, 3 * bucket_bytes,
+                                  3 * bucket_bytes + 1, 1000003};
+  for (uint64_t heap_space : heap_spaces) {
+    const uint64_t expected =
+        std::max<uint64_t>(2, heap_space / bucket_bytes) * bucket_bytes;
+    assert(Filter::WithHeapSpace(heap_space).SizeInBytes() == expected);
+  }
+  for (int log_heap_space = 0; log_heap_space < 20; log_heap_space++) {
+    const uint64_t expected = std::max<uint64_t>(2 * bucket_bytes,
+                                                 1 << log_heap_space);
+    assert(Filter(log_heap_space).SizeInBytes() == expected);
+  }
+
+  // Random keys: multiply-shift hashes of consecutive keys fall on a lattice.
+  std::mt19937_64 random(kSeed);
+  std::vector<uint64_t> keys(ndv);
+  for (uint64_t &key : keys) key = random();
+  for (uint64_t key : keys) filter.Add(key);
+  for (uint64_t key : keys) assert(filter.Find(key));
+  const size_t num_probes = 200000;
+  size_t false_positives = 0;
+  for (size_t i = 0; i < num_probes; i++) {
+    false_positives += filter.Find(random());
+  }
+  assert(false_positives <= 1.2 * fpp * num_probes);
+}
+
+// CountingSimdBlockFilter::Remove() undoes Add(): the keys left are all
+// found, removed keys are found no more often than false positives, and
+// removing every key leaves a filter that finds nothing.
+void TestCountingSimdBlock() {
+  const size_t ndv = 10000;
+  const double fpp = 0.01;
+  CountingSimdBlockFilter<TwoIndependentMultiplyShift> filter(
+      ndv, fpp, TwoIndependentMultiplyShift(kSeed));
+  std::mt19937_64 random(kSeed);
+  std::vector<uint64_t> keys(ndv);
+  for (uint64_t &key : keys) key = random();
+  for (uint64_t key : keys) filter.Add(key);
+  // a key added twice is found until it is removed twice
+  filter.Add(keys[0]);
+
+  size_t num_removed = 0;
+  for (size_t i = 0; i < ndv; i += 2, num_removed++) {
+    const bool removed = filter.Remove(keys[i]);
+    assert(removed);
+  }
+  assert(filter.Find(keys[0]));
+  size_t still_found = 0;
+  for (size_t i = 0; i < ndv; i++) {
+    if (i % 2 == 1) {
+      assert(filter.Find(keys[i]));
+    } else if (i != 0) {
+      still_found += filter.Find(keys[i]);
+    }
+  }
+  assert(still_found <= 2 * fpp * num_removed);
+
+  uint64_t absent;
+  do {
+    absent = random();
+  } while (filter.Find(absent));
+  assert(!filter.Remove(absent));
+
+  for (size_t i = 0; i < ndv; i++) {
+    if (i % 2 == 1 || i == 0) {
+      const bool removed = filter.Remove(keys[i]);
+      assert(removed);
+    }
+  }
+  for (uint64_t key : keys) assert(!filter.Find(key));
+  for (size_t i = 0; i < 100000; i++) assert(!filter.Find(random()));
+}
+
+// Write data to a new temporary file and return its path.
+std::string WriteTempFile(const std::string &data) {
+  char path[] = "/tmp/cuckoofilter-test-XXXXXX";
+  const int fd = mkstemp(path);
+  assert(fd >= 0);
+  close(fd);
+  std::ofstream out(path, std::ios::binary);
+  out.write(data.data(), data.size());
+  out.close();
+  return path;
+}
+
+// A SimdBlockFilter read back by Load() or Map() answers every lookup as the
+// saved one does, and a truncated or corrupt file is refused.
+void TestSimdBlockSave() {
+  typedef SimdBlockFilter<TwoIndependentMultiplyShift> Filter;
+  Filter filter =
+      Filter::WithHeapSpace(100 * 32, TwoIndependentMultiplyShift(kSeed));
+  for (uint64_t key = 0; key < 1000; key++) filter.Add(key);
+  std::ostringstream out;
+  filter.Save(out);
+  const std::string saved = out.str();
+
+  std::istringstream in(saved);
+  const Filter loaded = Filter::Load(in);
+  const std::string path = WriteTempFile(saved);
+  const std::unique_ptr<const Filter> mapped = Filter::Map(path);
+  assert(loaded.SizeInBytes() == filter.SizeInBytes());
+  assert(mapped->SizeInBytes() == filter.SizeInBytes());
+  for (uint64_t key = 0; key < 100000; key++) {
+    assert(loaded.Find(key) == filter.Find(key));
+    assert(mapped->Find(key) == filter.Find(key));
+  }
+  unlink(path.c_str());
+
+  // FileHeader: magic, six 32-bit fields, then num_buckets, directory_offset
+  // and directory_bytes
+  const size_t kNumBucketsAt = 32, kOffsetAt = 40, kBytesAt = 48;
+  std::vector<std::string> bad;
+  bad.push_back(saved.substr(0, saved.size() - 1));
+  bad.push_back(saved.substr(0, 32));
+  bad.push_back(saved + '\0');
+  bad.push_back(saved);
+  bad.back()[0] ^= 1;
+  // twice the buckets, with an offset that wraps around to the file's end:
+  // directory_offset + directory_bytes == file size modulo 2^64
+  std::string wrapped = saved;
+  uint64_t num_buckets, offset, bytes;
+  memcpy(&num_buckets, &wrapped[kNumBucketsAt], 8);
+  memcpy(&offset, &wrapped[kOffsetAt], 8);
+  memcpy(&bytes, &wrapped[kBytesAt], 8);
+  num_buckets *= 2;
+  bytes *= 2;
+  offset = wrapped.size() - bytes;
+  assert(offset % 64 == 0 && offset > wrapped.size());
+  memcpy(&wrapped[kNumBucketsAt], &num_buckets, 8);
+  memcpy(&wrapped[kOffsetAt], &offset, 8);
+  memcpy(&wrapped[kBytesAt], &bytes, 8);
+  bad.push_back(wrapped);
+  for (size_t i = 0; i < bad.size(); i++) {
+    const std::string bad_path = WriteTempFile(bad[i]);
+    assert(Throws<std::runtime_error>([&] { Filter::Map(bad_path); }));
+    unlink(bad_path.c_str());
+    // Load() reads a stream and cannot tell that extra bytes follow.
+    if (bad[i].size() > saved.size()) continue;
+    std::istringstream bad_in(bad[i]);
+    assert(Throws<std::runtime_error>([&] { Filter::Load(bad_in); }));
+  }
+  assert(Throws<std::system_error>([] { Filter::Map("/nonexistent/filter"); }));
+}
+
+// A BinaryFuseFilter finds every key it was built from, meets the false
+// positive rate of its fingerprint width, answers every lookup as it did after
+// a Save() and Load(), and refuses to load truncated, corrupt or mistyped data.
+template <typename FingerprintType>
+void TestBinaryFuseSave() {
+  typedef cuckoofilter::BinaryFuseFilter<uint64_t, FingerprintType> Filter;
+  std::mt19937_64 random(kSeed);
+  std::vector<uint64_t> keys(10000);
+  for (uint64_t &key : keys) key = random();
+  const Filter filter(keys.data(), keys.size());
+  assert(filter.Size() == keys.size());
+  for (uint64_t key : keys) assert(filter.Contain(key) == cuckoofilter::Ok);
+
+  std::ostringstream out;
+  filter.Save(out);
+  const std::string saved = out.str();
+  std::istringstream in(saved);
+  const Filter loaded = Filter::Load(in);
+  assert(loaded.Size() == filter.Size());
+  assert(loaded.SizeInBytes() == filter.SizeInBytes());
+  for (uint64_t key : keys) assert(loaded.Contain(key) == cuckoofilter::Ok);
+  const size_t num_probes = 100000;
+  size_t false_positives = 0;
+  for (size_t i = 0; i < num_probes; i++) {
+    const uint64_t probe = random();
+    const cuckoofilter::Status status = filter.Contain(probe);
+    assert(loaded.Contain(probe) == status);
+    false_positives += status == cuckoofilter::Ok;
+  }
+  assert(false_positives <=
+         2 * (num_probes >> (8 * sizeof(FingerprintType))) + 20);
+
+  // FileHeader: magic, four 32-bit fields, num_items, seed, then
+  // segment_length
+  const size_t kSegmentLengthAt = 40;
+  std::vector<std::string> bad;
+  bad.push_back(saved.substr(0, saved.size() - 1));
+  bad.push_back(saved.substr(0, 32));
+  bad.push_back(saved);
+  bad.back()[0] ^= 1;
+  bad.push_back(saved);
+  const uint64_t segment_length = 3;
+  memcpy(&bad.back()[kSegmentLengthAt], &segment_length, 8);
+  for (size_t i = 0; i < bad.size(); i++) {
+    std::istringstream bad_in(bad[i]);
+    assert(Throws<std::runtime_error>([&] { Filter::Load(bad_in); }));
+  }
+  std::istringstream mistyped(saved);
+  assert(Throws<std::runtime_error>([&] {
+    cuckoofilter::BinaryFuseFilter<uint64_t, uint32_t>::Load(mistyped);
+  }));
+}
 
 int main(int argc, char **argv) {
   size_t total_items = 1000000;
@@ -48,5 +1013,57 @@ int main(int argc, char **argv) {
   std::cout << "false positive rate is "
             << 100.0 * false_queries / total_queries << "%\n";
 
+  TestFilterHandle();
+  TestMoveAndAllocator<12, cuckoofilter::SingleTable>();
+  TestMoveAndAllocator<13, cuckoofilter::PackedTable>();
+  TestMoveAndAllocator<12, cuckoofilter::MortonTable>();
+  TestShrink<CuckooFilter<size_t, 12>>(100000);
+  TestShrink<CuckooFilter<size_t, 13, cuckoofilter::PackedTable>>(100000);
+  TestShrink<CuckooFilter<size_t, 12, cuckoofilter::MortonTable>>(100000);
+  TestFreeze<12>(100000, 50000);
+  TestFreeze<12>(100000, 100000);
+  TestFreeze<8>(100000, 100000);
+  TestFreeze<13, cuckoofilter::PackedTable>(100000, 100000);
+  TestFreeze<12>(10, 10);
+  TestTryAdd();
+  TestAddIfAbsent();
+  TestDeleteMany();
+  TestAltWindow<8>();
+  TestAltWindow<64>();
+  TestAltWindow<512>();
+  TestMap();
+  TestAdaptive();
+  TestWindowed();
+  TestBank();
+  TestShared();
+  TestSimdBlockKernels();
+  TestSimdBlockBatch<SimdBlockFilter<TwoIndependentMultiplyShift>>();
+  TestSimdBlockBatch<SimdBlockFilter<TwoIndependentMultiplyShift, 6>>();
+  TestSimdBlockBatch<SimdBlockFilter<TwoIndependentMultiplyShift, 3, 64, 4>>();
+  TestSimdBlockConcurrent<SimdBlockFilter<TwoIndependentMultiplyShift>>();
+  TestSimdBlockConcurrent<SimdBlockFilter<TwoIndependentMultiplyShift, 6>>();
+  TestSimdBlockConcurrent<
+      SimdBlockFilter<TwoIndependentMultiplyShift, 3, 64, 4>>();
+  TestSimdBlockCombine<SimdBlockFilter<TwoIndependentMultiplyShift>>();
+  TestSimdBlockCombine<SimdBlockFilter<TwoIndependentMultiplyShift, 6>>();
+  TestSimdBlockCombine<
+      SimdBlockFilter<TwoIndependentMultiplyShift, 3, 64, 4>>();
+  TestSimdBlockSave();
+  TestBinaryFuseSave<uint8_t>();
+  TestBinaryFuseSave<uint16_t>();
+  TestSimdBlockGeometry<3, 32, 2>();
+  TestSimdBlockGeometry<3, 32, 8>();
+  TestSimdBlockGeometry<3, 64, 1>();
+  TestSimdBlockGeometry<3, 64, 6>();
+  TestSimdBlockGeometry<4, 32, 4>();
+  TestSimdBlockGeometry<4, 64, 8>();
+  TestSimdBlockGeometry<5, 32, 8>();
+  TestSimdBlockGeometry<5, 32, 16>();
+  TestSimdBlockGeometry<5, 64, 4>();
+  TestSimdBlockGeometry<6, 32, 16>();
+  TestSimdBlockGeometry<6, 32, 32>();
+  TestSimdBlockGeometry<6, 64, 8>();
+  TestCountingSimdBlock();
+
   return 0;
 }
@@ -0,0 +1,370 @@
+#ifndef CUCKOO_FILTER_ADAPTIVE_CUCKOO_FILTER_H_
+#define CUCKOO_FILTER_ADAPTIVE_CUCKOO_FILTER_H_
+
+#include <assert.h>
+#include <algorithm>
+#include <memory>
+#include <sstream>
+#include <vector>
+
+#include "cuckoofilter.h"
+#include "selectortable.h"
+
+namespace cuckoofilter {
+
+// A cuckoo filter that stops matching an absent item once the caller reports
+// it as a false positive, after Mitzenmacher, Pontarelli and Reviriego,
+// "Adaptive Cuckoo Filters". Each bucket has a selector that chooses which of
+// several fingerprint hashes made its tags, and a lookup compares a bucket
+// with the item's fingerprint for that bucket's selector. Reporting a false
+// positive moves each bucket that matched to another selector under which
+// none of its items' tags is the reported item's, so that item no longer
+// matches while the stored items still do. The paper keeps a selector per
+// slot; one per bucket costs a quarter of a bit per item for each selector
+// bit and keeps a lookup to one word comparison per bucket, as in
+// CuckooFilter.
+//
+// Picking new tags needs the items in the bucket. As in the paper, they come
+// from the backing store the filter guards, which the caller lays out like
+// the table: the filter puts each item it adds in slot 4 * bucket + position
+// of the store and moves it there as it moves the tag, and reads the slots
+// of a bucket when it reports or deletes. Lookups read only the table. Since
+// the items are at hand, Delete() is exact. It takes six template
+// parameters:
+//   ItemType:  the type of item you want to insert, compared with ==
+//   bits_per_item: how many bits each item is hashed into
+//   selector_bits: the bits of each bucket's selector, 1 or 2. One bit gives
+// two fingerprint hashes and the faster lookup; two give four, which a bucket
+// runs out of only after more reports.
+//   HashFamily: the hash function applied to each item
+//   Allocator: where the table storage comes from, std::allocator by default
+//   ItemStore: the caller's store, with an ItemType at each slot from 0 to
+// NumSlotsFor(max_num_keys), read as (*store)[slot] and written by assigning
+// to it; std::vector<ItemType> by default. Slots whose tag is empty hold
+// whatever was last put there and are never read.
+// Filters are movable but not copyable, and the store must outlive them.
+template <typename ItemType, size_t bits_per_item, size_t selector_bits = 1,
+          typename HashFamily = TwoIndependentMultiplyShift,
+          typename Allocator = std::allocator<char>,
+          typename ItemStore = std::vector<ItemType>>
+class AdaptiveCuckooFilter {
+  typedef SelectorTable<bits_per_item, selector_bits, Allocator> Table;
+
+  static const size_t kTagsPerBucket = 4;
+  static const size_t kNumSelectors = Table::kNumSelectors;
+  // how many items that found no room in the table are kept aside
+  static const size_t kStashSize = 4;
+
+  // Storage of tags and the selector of each bucket
+  Table table_;
+
+  // (*items_)[kTagsPerBucket * i + j] is the item whose tag is in pos(i,j)
+  ItemStore *items_;
+
+  // Number of items stored
+  size_t num_items_;
+
+  // Items that were kicked out of the table for good. They are compared in
+  // full, so they are never false positives.
+  ItemType stash_[kStashSize];
+  size_t stash_items_;
+
+  HashFamily hasher_;
+
+  // the first bucket and tag 0 are CuckooFilter's
+  typedef CuckooLayout<bits_per_item, kStashSize, 0> Layout;
+
+  inline size_t IndexHash(uint32_t hv) const {
+    return Layout::IndexHash(hv, table_.NumBuckets());
+  }
+
+  inline uint32_t TagHash(uint32_t hv) const { return Layout::TagHash(hv); }
+
+  // Tags 1 to 3, as many as there are selectors, are windows of bits 16 to
+  // 63 of the low half of the hash times a 64-bit odd constant, as far apart
+  // as they fit, so they cost one multiplication between them.
+  static const size_t kTagStride = (48 - bits_per_item) / 2;
+
+  // The two buckets of an item with the given hash. The second is picked by
+  // tag 0, as in CuckooFilter, so an item keeps its buckets whatever the
+  // selectors.
+  inline void GenerateIndexHash(const uint64_t hash, size_t *i1,
+                                size_t *i2) const {
+    *i1 = IndexHash(hash >> 32);
+    *i2 = Layout::AltIndex(*i1, TagHash(hash), table_.NumBuckets());
+  }
+
+  // GenerateIndexHash() and the item's tag for every selector. Tag 0 is the
+  // tag a CuckooFilter would use.
+  inline void GenerateIndexTagsHash(const ItemType &item, size_t *i1,
+                                    size_t *i2, uint32_t *tags) const {
+    const uint64_t hash = hasher_(item);
+    GenerateIndexHash(hash, i1, i2);
+    const uint64_t mixed =
+        static_cast<uint32_t>(hash) * 0x9e3779b97f4a7c15ULL;
+    tags[0] = TagHash(hash);
+    for (size_t s = 1; s < kNumSelectors; s++) {
+      tags[s] = TagHash(mixed >> (64 - bits_per_item - (s - 1) * kTagStride));
+    }
+  }
+
+  // the tag of the item in pos(i,j) for the given selector
+  uint32_t StoredTag(const size_t i, const size_t j,
+                     const uint32_t selector) const {
+    size_t i1, i2;
+    uint32_t tags[kNumSelectors];
+    GenerateIndexTagsHash((*items_)[kTagsPerBucket * i + j], &i1, &i2, tags);
+    return tags[selector];
+  }
+
+  bool StashContains(const ItemType &item) const {
+    for (size_t j = 0; j < stash_items_; j++) {
+      if (stash_[j] == item) return true;
+    }
+    return false;
+  }
+
+  Status AddImpl(const ItemType &item);
+
+  // Moves bucket i to a selector under which none of its tags is tags[s] for
+  // that selector s.
+  void Reselect(const size_t i, const uint32_t *tags);
+
+  // load factor is the fraction of occupancy
+  double LoadFactor() const { return 1.0 * Size() / table_.SizeInTags(); }
+
+  double BitsPerItem() const { return 8.0 * SizeInBytes() / Size(); }
+
+ public:
+  // A filter for max_num_keys items, which are put in items. It must have at
+  // least NumSlotsFor(max_num_keys) slots.
+  AdaptiveCuckooFilter(const size_t max_num_keys, ItemStore *items,
+                       const Allocator &allocator = Allocator(),
+                       const HashFamily &hasher = HashFamily())
+      : table_(Layout::NumBucketsFor(max_num_keys), allocator),
+        items_(items),
+        num_items_(0),
+        stash_(),
+        stash_items_(0),
+        hasher_(hasher) {}
+
+  AdaptiveCuckooFilter(AdaptiveCuckooFilter &&) = default;
+  AdaptiveCuckooFilter &operator=(AdaptiveCuckooFilter &&) = default;
+  AdaptiveCuckooFilter(const AdaptiveCuckooFilter &) = delete;
+  AdaptiveCuckooFilter &operator=(const AdaptiveCuckooFilter &) = delete;
+
+  // the number of slots of the item store of a filter for max_num_keys items
+  static size_t NumSlotsFor(const size_t max_num_keys) {
+    return kTagsPerBucket * Layout::NumBucketsFor(max_num_keys);
+  }
+
+  // Add an item to the filter and its store.
+  Status Add(const ItemType &item);
+
+  // Report if the item is inserted, with false positive rate.
+  Status Contain(const ItemType &item) const;
+
+  // Tell the filter that Contain() found an item that is not in it, so it
+  // stops finding it. Changes the selector of each of the item's two buckets
+  // that matched it, hashing the at most four items in the bucket for each
+  // selector tried. Returns Ok if the item was found and now almost surely is
+  // not, NotFound if it was not found, and AlreadyPresent if it is in the
+  // filter.
+  Status ReportFalsePositive(const ItemType &item);
+
+  // Delete an item from the filter. Only an item that was added is found.
+  Status Delete(const ItemType &item);
+
+  /* methods for providing stats  */
+  // summary infomation
+  std::string Info() const;
+
+  // number of current inserted items;
+  size_t Size() const { return num_items_; }
+
+  // size of the filter in bytes, not counting the item store
+  size_t SizeInBytes() const { return table_.SizeInBytes() + sizeof(stash_); }
+};
+
+template <typename ItemType, size_t bits_per_item, size_t selector_bits,
+          typename HashFamily, typename Allocator, typename ItemStore>
+Status AdaptiveCuckooFilter<ItemType, bits_per_item, selector_bits, HashFamily,
+                            Allocator, ItemStore>::
+    Add(const ItemType &item) {
+  if (stash_items_ == kStashSize) {
+    return NotEnoughSpace;
+  }
+  return AddImpl(item);
+}
+
+template <typename ItemType, size_t bits_per_item, size_t selector_bits,
+          typename HashFamily, typename Allocator, typename ItemStore>
+Status AdaptiveCuckooFilter<ItemType, bits_per_item, selector_bits, HashFamily,
+                            Allocator, ItemStore>::
+    AddImpl(const ItemType &item) {
+  size_t i1, i2;
+  uint32_t tags[kNumSelectors];
+  GenerateIndexTagsHash(item, &i1, &i2, tags);
+
+  // An item takes the tag its bucket's selector picks, wherever it goes.
+  ItemType curitem = item;
+  size_t curindex = i1;
+
+  for (uint32_t count = 0; count < kMaxCuckooCount; count++) {
+    const uint32_t tag = tags[table_.ReadSelector(curindex)];
+    for (size_t j = 0; j < kTagsPerBucket; j++) {
+      if (table_.ReadTag(curindex, j) == 0) {
+        table_.WriteTag(curindex, j, tag);
+        (*items_)[kTagsPerBucket * curindex + j] = curitem;
+        num_items_++;
+        return Ok;
+      }
+    }
+    if (count > 0) {
+      const size_t r = rand() % kTagsPerBucket;
+      table_.WriteTag(curindex, r, tag);
+      const ItemType kicked = (*items_)[kTagsPerBucket * curindex + r];
+      (*items_)[kTagsPerBucket * curindex + r] = curitem;
+      curitem = kicked;
+      GenerateIndexTagsHash(curitem, &i1, &i2, tags);
+    }
+    curindex = curindex == i1 ? i2 : i1;
+  }
+
+  stash_[stash_items_++] = curitem;
+  num_items_++;
+  return Ok;
+}
+
+template <typename ItemType, size_t bits_per_item, size_t selector_bits,
+          typename HashFamily, typename Allocator, typename ItemStore>
+Status AdaptiveCuckooFilter<ItemType, bits_per_item, selector_bits, HashFamily,
+                            Allocator, ItemStore>::
+    Contain(const ItemType &item) const {
+  size_t i1, i2;
+  uint32_t tags[kNumSelectors];
+  GenerateIndexTagsHash(item, &i1, &i2, tags);
+
+  if (table_.FindTagInBuckets(i1, i2, tags) ||
+      (stash_items_ != 0 && StashContains(item))) {
+    return Ok;
+  } else {
+    return NotFound;
+  }
+}
+
+template <typename ItemType, size_t bits_per_item, size_t selector_bits,
+          typename HashFamily, typename Allocator, typename ItemStore>
+void AdaptiveCuckooFilter<ItemType, bits_per_item, selector_bits, HashFamily,
+                          Allocator, ItemStore>::
+    Reselect(const size_t i, const uint32_t *tags) {
+  const uint32_t selector = table_.ReadSelector(i);
+  // the first selector after this one that tells the items apart, or the
+  // next one if none does
+  uint32_t next = (selector + 1) % kNumSelectors;
+  for (size_t k = 1; k < kNumSelectors; k++) {
+    const uint32_t s = (selector + k) % kNumSelectors;
+    bool apart = true;
+    for (size_t j = 0; j < kTagsPerBucket; j++) {
+      if (table_.ReadTag(i, j) != 0) {
+        apart &= StoredTag(i, j, s) != tags[s];
+      }
+    }
+    if (apart) {
+      next = s;
+      break;
+    }
+  }
+  for (size_t j = 0; j < kTagsPerBucket; j++) {
+    if (table_.ReadTag(i, j) != 0) {
+      table_.WriteTag(i, j, StoredTag(i, j, next));
+    }
+  }
+  table_.WriteSelector(i, next);
+}
+
+template <typename ItemType, size_t bits_per_item, size_t selector_bits,
+          typename HashFamily, typename Allocator, typename ItemStore>
+Status AdaptiveCuckooFilter<ItemType, bits_per_item, selector_bits, HashFamily,
+                            Allocator, ItemStore>::
+    ReportFalsePositive(const ItemType &item) {
+  size_t i1, i2;
+  uint32_t tags[kNumSelectors];
+  GenerateIndexTagsHash(item, &i1, &i2, tags);
+
+  if (stash_items_ != 0 && StashContains(item)) return AlreadyPresent;
+  bool matched[2] = {false, false};
+  const size_t buckets[2] = {i1, i2};
+  for (size_t b = 0; b < 2; b++) {
+    const size_t i = buckets[b];
+    const uint32_t tag = tags[table_.ReadSelector(i)];
+    for (size_t j = 0; j < kTagsPerBucket; j++) {
+      if (table_.ReadTag(i, j) != tag) continue;
+      if ((*items_)[kTagsPerBucket * i + j] == item) return AlreadyPresent;
+      matched[b] = true;
+    }
+  }
+  if (matched[0]) Reselect(i1, tags);
+  if (matched[1] && i2 != i1) Reselect(i2, tags);
+  return matched[0] || matched[1] ? Ok : NotFound;
+}
+
+template <typename ItemType, size_t bits_per_item, size_t selector_bits,
+          typename HashFamily, typename Allocator, typename ItemStore>
+Status AdaptiveCuckooFilter<ItemType, bits_per_item, selector_bits, HashFamily,
+                            Allocator, ItemStore>::
+    Delete(const ItemType &item) {
+  size_t i1, i2;
+  uint32_t tags[kNumSelectors];
+  GenerateIndexTagsHash(item, &i1, &i2, tags);
+
+  const size_t buckets[2] = {i1, i2};
+  for (size_t i : buckets) {
+    const uint32_t tag = tags[table_.ReadSelector(i)];
+    for (size_t j = 0; j < kTagsPerBucket; j++) {
+      if (table_.ReadTag(i, j) != tag ||
+          !((*items_)[kTagsPerBucket * i + j] == item)) {
+        continue;
+      }
+      table_.WriteTag(i, j, 0);
+      num_items_--;
+      // The freed slot may make room for a stashed item.
+      if (stash_items_ != 0) {
+        const ItemType stashed = stash_[--stash_items_];
+        num_items_--;
+        AddImpl(stashed);
+      }
+      return Ok;
+    }
+  }
+  for (size_t j = 0; j < stash_items_; j++) {
+    if (stash_[j] == item) {
+      stash_[j] = stash_[--stash_items_];
+      num_items_--;
+      return Ok;
+    }
+  }
+  return NotFound;
+}
+
+template <typename ItemType, size_t bits_per_item, size_t selector_bits,
+          typename HashFamily, typename Allocator, typename ItemStore>
+std::string AdaptiveCuckooFilter<ItemType, bits_per_item, selector_bits,
+                                 HashFamily, Allocator, ItemStore>::Info()
+    const {
+  std::stringstream ss;
+  ss << "AdaptiveCuckooFilter Status:\n"
+     << "\t\t" << table_.Info() << "\n"
+     << "\t\tKeys stored: " << Size() << "\n"
+     << "\t\tKeys stashed: " << stash_items_ << "\n"
+     << "\t\tLoad factor: " << LoadFactor() << "\n"
+     << "\t\tHashtable size: " << (SizeInBytes() >> 10) << " KB\n";
+  if (Size() > 0) {
+    ss << "\t\tbit/key:   " << BitsPerItem() << "\n";
+  } else {
+    ss << "\t\tbit/key:   N/A\n";
+  }
+  return ss.str();
+}
+}  // namespace cuckoofilter
+#endif  // CUCKOO_FILTER_ADAPTIVE_CUCKOO_FILTER_H_
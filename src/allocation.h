@@ -0,0 +1,75 @@
+#ifndef CUCKOO_FILTER_ALLOCATION_H_
+#define CUCKOO_FILTER_ALLOCATION_H_
+
+#include <string.h>
+
+#include <memory>
+#include <type_traits>
+#include <utility>
+
+namespace cuckoofilter {
+
+// Specialize this to std::true_type for allocators that hand out memory that
+// is already zeroed (e.g. fresh mmap()ed pages or an arena cleared in bulk),
+// so tables can skip clearing their storage on construction.
+template <typename Allocator>
+struct AllocatorZeroesMemory : std::false_type {};
+
+// Byte storage obtained from an allocator. Tables keep a raw pointer for the
+// hot path and hand the allocator back its own pointer type on release, so
+// allocators with fancy pointers (e.g. offset pointers into shared memory)
+// work as well.
+template <typename Allocator>
+class ByteStorage {
+  typedef typename std::allocator_traits<Allocator>::template rebind_alloc<char>
+      CharAllocator;
+  typedef std::allocator_traits<CharAllocator> Traits;
+
+  CharAllocator allocator_;
+  char *data_;
+  size_t size_;
+
+ public:
+  ByteStorage(const size_t size, const Allocator &allocator)
+      : allocator_(allocator), data_(nullptr), size_(size) {
+    data_ = &*Traits::allocate(allocator_, size_);
+    if (!AllocatorZeroesMemory<CharAllocator>::value) {
+      memset(data_, 0, size_);
+    }
+  }
+
+  ByteStorage(ByteStorage &&that) noexcept
+      : allocator_(std::move(that.allocator_)),
+        data_(that.data_),
+        size_(that.size_) {
+    that.data_ = nullptr;
+    that.size_ = 0;
+  }
+
+  ByteStorage &operator=(ByteStorage &&that) noexcept {
+    std::swap(allocator_, that.allocator_);
+    std::swap(data_, that.data_);
+    std::swap(size_, that.size_);
+    return *this;
+  }
+
+  ~ByteStorage() {
+    if (data_ != nullptr) {
+      Traits::deallocate(
+          allocator_,
+          std::pointer_traits<typename Traits::pointer>::pointer_to(*data_),
+          size_);
+    }
+  }
+
+  char *data() const { return data_; }
+  size_t size() const { return size_; }
+  CharAllocator get_allocator() const { return allocator_; }
+
+  ByteStorage(const ByteStorage &) = delete;
+  ByteStorage &operator=(const ByteStorage &) = delete;
+};
+
+}  // namespace cuckoofilter
+
+#endif  // CUCKOO_FILTER_ALLOCATION_H_
@@ -0,0 +1,418 @@
+#ifndef CUCKOO_FILTER_BINARY_FUSE_FILTER_H_
+#define CUCKOO_FILTER_BINARY_FUSE_FILTER_H_
+
+#include <string.h>
+
+#include <algorithm>
+#include <cmath>
+#include <istream>
+#include <ostream>
+#include <stdexcept>
+#include <type_traits>
+#include <vector>
+
+#include "cuckoofilter.h"
+#include "hashutil.h"
+
+namespace cuckoofilter {
+
+// A static filter built once from a set of keys, after Graf and Lemire's
+// "Binary Fuse Filters: Fast and Smaller Than Xor Filters". Each key maps to
+// three slots in a table of fingerprints, and a key is found if the xor of its
+// three slots is its fingerprint. It takes about 1.13 fingerprints of space per
+// key for large sets, so an 8-bit fingerprint gives a false positive rate of
+// about 0.4% at 9 bits per key, and a 16-bit one 0.0015% at 18 bits per key.
+// Keys cannot be added or deleted once the filter is built.
+//
+// The table is split into segments, and a key's three slots lie in three
+// consecutive segments. Construction "peels" the key set: a slot that only one
+// key maps to can be assigned last, after every other key, so it is pushed on a
+// stack and its key removed, until every key is on the stack. Filling the
+// slots in reverse stack order then satisfies every key. Peeling fails with
+// small probability, and is retried with another seed.
+//
+// It takes three template parameters:
+//   ItemType: the type of item you want to insert
+//   FingerprintType: uint8_t or uint16_t, the fingerprint of each item
+//   HashFamily: the hash function applied to each item
+// Filters are movable but not copyable.
+template <typename ItemType, typename FingerprintType = uint8_t,
+          typename HashFamily = TwoIndependentMultiplyShift>
+class BinaryFuseFilter {
+  static_assert(std::is_unsigned<FingerprintType>::value,
+                "fingerprints are unsigned integers");
+
+  // Construction gives up after this many seeds; each fails with probability
+  // well under 1%.
+  static const int kMaxIterations = 100;
+
+  // The largest segment the sizing rule below picks is capped to this:
+  static const uint64_t kMaxSegmentLength = 1 << 18;
+
+  std::vector<FingerprintType> fingerprints_;
+
+  // Number of distinct items stored
+  size_t num_items_;
+
+  uint64_t seed_;
+  uint64_t segment_length_;
+  // the number of slots the first of a key's slots can be in
+  uint64_t segment_count_length_;
+
+  HashFamily hasher_;
+
+  // 64-bit finalizer of MurmurHash3, to derive a new hash for each seed:
+  static uint64_t Mix(uint64_t h) {
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+  }
+
+  static uint64_t SplitMix64(uint64_t *state) {
+    uint64_t z = (*state += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+  }
+
+  inline uint64_t Hash(const ItemType &item) const {
+    return Mix(hasher_(item) + seed_);
+  }
+
+  inline FingerprintType Fingerprint(const uint64_t hash) const {
+    return static_cast<FingerprintType>(hash ^ (hash >> 32));
+  }
+
+  // Slot `index` (0, 1 or 2) of hash. The first is the high bits of hash
+  // scaled to segment_count_length_; the others are in the next segments,
+  // offset by bits [18, 36) and [0, 18) of hash.
+  inline uint64_t Slot(const int index, const uint64_t hash) const {
+    const uint64_t h = static_cast<uint64_t>(
+        (static_cast<unsigned __int128>(hash) * segment_count_length_) >> 64);
+    const uint64_t low_bits = hash & ((1ULL << 36) - 1);
+    return (h + index * segment_length_) ^
+           ((low_bits >> (36 - 18 * index)) & (segment_length_ - 1));
+  }
+
+  void Allocate(size_t num_keys);
+  void Populate(std::vector<uint64_t> *hashes);
+
+  // The saved format is this header, the bytes of the hasher and then the
+  // fingerprints. Integers are in the byte order of the saving machine.
+  struct FileHeader {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t fingerprint_bytes;
+    uint32_t hasher_bytes;
+    uint32_t reserved;
+    uint64_t num_items;
+    uint64_t seed;
+    uint64_t segment_length;
+    uint64_t segment_count_length;
+    uint64_t array_length;
+  };
+  static_assert(sizeof(FileHeader) == 64, "FileHeader must fill 64 bytes");
+
+  static const uint64_t kFileMagic = 0x31544c4645535546ULL;  // "FUSEFLT1"
+  static const uint32_t kFileVersion = 1;
+
+  template <typename, size_t, typename, size_t>
+  friend class FrozenCuckooFilter;
+
+  explicit BinaryFuseFilter(const HashFamily &hasher)
+      : num_items_(0),
+        seed_(0),
+        segment_length_(0),
+        segment_count_length_(0),
+        hasher_(hasher) {}
+
+ public:
+  // Build a filter holding keys[0, n), which may repeat. Throws runtime_error
+  // in the vanishingly unlikely case that construction does not succeed.
+  BinaryFuseFilter(const ItemType *keys, const size_t n,
+                   const HashFamily &hasher = HashFamily());
+
+  BinaryFuseFilter(BinaryFuseFilter &&) = default;
+  BinaryFuseFilter &operator=(BinaryFuseFilter &&) = default;
+  BinaryFuseFilter(const BinaryFuseFilter &) = delete;
+  BinaryFuseFilter &operator=(const BinaryFuseFilter &) = delete;
+
+  // Report if the item is inserted, with false positive rate.
+  Status Contain(const ItemType &item) const;
+
+  // number of distinct items stored
+  size_t Size() const { return num_items_; }
+
+  // size of the filter in bytes.
+  size_t SizeInBytes() const {
+    return fingerprints_.size() * sizeof(FingerprintType);
+  }
+
+  // Write the filter to out. Throws runtime_error if the stream fails.
+  // HashFamily must be trivially copyable.
+  void Save(std::ostream &out) const;
+
+  // Read a filter written by Save(). Throws runtime_error if the data is not a
+  // saved filter of this type.
+  static BinaryFuseFilter Load(std::istream &in);
+};
+
+// The sizing rules of the paper for 3-wise filters: segments grow with the
+// number of keys, and the space overhead shrinks from about 1.5 at a thousand
+// keys to 1.125 at a million and more.
+template <typename ItemType, typename FingerprintType, typename HashFamily>
+void BinaryFuseFilter<ItemType, FingerprintType, HashFamily>::Allocate(
+    const size_t num_keys) {
+  const uint64_t arity = 3;
+  segment_length_ =
+      num_keys == 0
+          ? 4
+          : 1ULL << static_cast<int>(floor(log(num_keys) / log(3.33) + 2.25));
+  // not std::min(), which would bind a reference to kMaxSegmentLength and
+  // need a definition of it
+  if (segment_length_ > kMaxSegmentLength) {
+    segment_length_ = kMaxSegmentLength;
+  }
+  const double size_factor =
+      num_keys <= 1
+          ? 0
+          : std::max(1.125, 0.875 + 0.25 * log(1000000.0) / log(num_keys));
+  const uint64_t capacity = static_cast<uint64_t>(round(num_keys * size_factor));
+  uint64_t segment_count = (capacity + segment_length_ - 1) / segment_length_;
+  segment_count = segment_count <= arity - 1 ? 1 : segment_count - (arity - 1);
+  segment_count_length_ = segment_count * segment_length_;
+  fingerprints_.assign((segment_count + arity - 1) * segment_length_, 0);
+}
+
+// hashes holds the hash of every key, before seeding. It is deduplicated in
+// place if it has repeats.
+template <typename ItemType, typename FingerprintType, typename HashFamily>
+void BinaryFuseFilter<ItemType, FingerprintType, HashFamily>::Populate(
+    std::vector<uint64_t> *hashes) {
+  size_t size = hashes->size();
+  const uint64_t capacity = fingerprints_.size();
+  // For each slot, the xor of the hashes of the keys still mapped to it, and
+  // four times their number plus the xor of which of their three slots (0, 1
+  // or 2) it is for each.
+  std::vector<uint64_t> t2hash(capacity);
+  std::vector<uint8_t> t2count(capacity);
+  // The keys in the order they were peeled, and which of their slots each was
+  // peeled from. Until peeling, reverse_order holds the seeded hashes sorted
+  // roughly by first slot, so that the slots are visited in order.
+  std::vector<uint64_t> reverse_order(size + 1);
+  std::vector<uint8_t> reverse_h(size);
+  std::vector<uint64_t> alone(capacity);
+
+  int block_bits = 1;
+  while ((1ULL << block_bits) < segment_count_length_ / segment_length_) {
+    ++block_bits;
+  }
+  const uint64_t block = 1ULL << block_bits;
+  std::vector<uint64_t> start_pos(block);
+  uint64_t slots[5];
+
+  uint64_t rng = 0x726b2b9d438b9d4dULL;
+  for (int iteration = 0;; ++iteration) {
+    if (iteration == kMaxIterations) {
+      throw std::runtime_error("BinaryFuseFilter construction failed");
+    }
+    seed_ = SplitMix64(&rng);
+    std::fill(reverse_order.begin(), reverse_order.begin() + size, 0);
+    reverse_order[size] = 1;
+    std::fill(t2count.begin(), t2count.end(), 0);
+    std::fill(t2hash.begin(), t2hash.end(), 0);
+
+    for (uint64_t i = 0; i < block; ++i) {
+      start_pos[i] = (i * size) >> block_bits;
+    }
+    for (size_t i = 0; i < size; ++i) {
+      const uint64_t hash = Mix((*hashes)[i] + seed_);
+      uint64_t segment_index = hash >> (64 - block_bits);
+      while (reverse_order[start_pos[segment_index]] != 0) {
+        segment_index = (segment_index + 1) & (block - 1);
+      }
+      reverse_order[start_pos[segment_index]] = hash;
+      ++start_pos[segment_index];
+    }
+
+    bool error = false;
+    size_t duplicates = 0;
+    for (size_t i = 0; i < size; ++i) {
+      const uint64_t hash = reverse_order[i];
+      const uint64_t h0 = Slot(0, hash), h1 = Slot(1, hash),
+                     h2 = Slot(2, hash);
+      t2count[h0] += 4;
+      t2hash[h0] ^= hash;
+      t2count[h1] += 4;
+      t2count[h1] ^= 1;
+      t2hash[h1] ^= hash;
+      t2count[h2] += 4;
+      t2count[h2] ^= 2;
+      t2hash[h2] ^= hash;
+      // A key whose hash equals an earlier one's cancels it out of a slot
+      // both map to; take it back out.
+      if ((t2hash[h0] & t2hash[h1] & t2hash[h2]) == 0 &&
+          ((t2hash[h0] == 0 && t2count[h0] == 8) ||
+           (t2hash[h1] == 0 && t2count[h1] == 8) ||
+           (t2hash[h2] == 0 && t2count[h2] == 8))) {
+        ++duplicates;
+        t2count[h0] -= 4;
+        t2hash[h0] ^= hash;
+        t2count[h1] -= 4;
+        t2count[h1] ^= 1;
+        t2hash[h1] ^= hash;
+        t2count[h2] -= 4;
+        t2count[h2] ^= 2;
+        t2hash[h2] ^= hash;
+      }
+      // an 8-bit count that wrapped around:
+      error |= t2count[h0] < 4 || t2count[h1] < 4 || t2count[h2] < 4;
+    }
+    if (error) continue;
+
+    // Queue the slots that one key maps to.
+    size_t queue_size = 0;
+    for (uint64_t i = 0; i < capacity; ++i) {
+      alone[queue_size] = i;
+      queue_size += (t2count[i] >> 2) == 1;
+    }
+    size_t stack_size = 0;
+    while (queue_size > 0) {
+      const uint64_t index = alone[--queue_size];
+      if ((t2count[index] >> 2) != 1) continue;
+      const uint64_t hash = t2hash[index];
+      const uint8_t found = t2count[index] & 3;
+      slots[0] = Slot(0, hash);
+      slots[1] = Slot(1, hash);
+      slots[2] = Slot(2, hash);
+      slots[3] = slots[0];
+      slots[4] = slots[1];
+      reverse_h[stack_size] = found;
+      reverse_order[stack_size] = hash;
+      ++stack_size;
+      for (int other = 1; other <= 2; ++other) {
+        const uint64_t other_index = slots[found + other];
+        alone[queue_size] = other_index;
+        queue_size += (t2count[other_index] >> 2) == 2;
+        t2count[other_index] -= 4;
+        t2count[other_index] ^= (found + other) % 3;
+        t2hash[other_index] ^= hash;
+      }
+    }
+    if (stack_size + duplicates == size) {
+      size = stack_size;
+      break;
+    }
+    if (duplicates > 0) {
+      std::sort(hashes->begin(), hashes->begin() + size);
+      size = std::unique(hashes->begin(), hashes->begin() + size) -
+             hashes->begin();
+    }
+  }
+
+  for (size_t i = size; i-- > 0;) {
+    const uint64_t hash = reverse_order[i];
+    const uint8_t found = reverse_h[i];
+    slots[0] = Slot(0, hash);
+    slots[1] = Slot(1, hash);
+    slots[2] = Slot(2, hash);
+    slots[3] = slots[0];
+    slots[4] = slots[1];
+    fingerprints_[slots[found]] = Fingerprint(hash) ^
+                                  fingerprints_[slots[found + 1]] ^
+                                  fingerprints_[slots[found + 2]];
+  }
+  num_items_ = size;
+}
+
+template <typename ItemType, typename FingerprintType, typename HashFamily>
+BinaryFuseFilter<ItemType, FingerprintType, HashFamily>::BinaryFuseFilter(
+    const ItemType *keys, const size_t n, const HashFamily &hasher)
+    : num_items_(0),
+      seed_(0),
+      segment_length_(0),
+      segment_count_length_(0),
+      hasher_(hasher) {
+  Allocate(n);
+  std::vector<uint64_t> hashes(n);
+  for (size_t i = 0; i < n; ++i) hashes[i] = hasher_(keys[i]);
+  Populate(&hashes);
+}
+
+template <typename ItemType, typename FingerprintType, typename HashFamily>
+Status BinaryFuseFilter<ItemType, FingerprintType, HashFamily>::Contain(
+    const ItemType &key) const {
+  const uint64_t hash = Hash(key);
+  const FingerprintType f = Fingerprint(hash) ^ fingerprints_[Slot(0, hash)] ^
+                            fingerprints_[Slot(1, hash)] ^
+                            fingerprints_[Slot(2, hash)];
+  return f == 0 ? Ok : NotFound;
+}
+
+template <typename ItemType, typename FingerprintType, typename HashFamily>
+void BinaryFuseFilter<ItemType, FingerprintType, HashFamily>::Save(
+    std::ostream &out) const {
+  static_assert(std::is_trivially_copyable<HashFamily>::value,
+                "the hasher is saved byte for byte");
+  FileHeader header;
+  memset(&header, 0, sizeof(header));
+  header.magic = kFileMagic;
+  header.version = kFileVersion;
+  header.fingerprint_bytes = sizeof(FingerprintType);
+  header.hasher_bytes = sizeof(HashFamily);
+  header.num_items = num_items_;
+  header.seed = seed_;
+  header.segment_length = segment_length_;
+  header.segment_count_length = segment_count_length_;
+  header.array_length = fingerprints_.size();
+  out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+  out.write(reinterpret_cast<const char *>(&hasher_), sizeof(hasher_));
+  out.write(reinterpret_cast<const char *>(fingerprints_.data()),
+            SizeInBytes());
+  if (!out) throw std::runtime_error("failed to save BinaryFuseFilter");
+}
+
+template <typename ItemType, typename FingerprintType, typename HashFamily>
+BinaryFuseFilter<ItemType, FingerprintType, HashFamily>
+BinaryFuseFilter<ItemType, FingerprintType, HashFamily>::Load(
+    std::istream &in) {
+  static_assert(std::is_trivially_copyable<HashFamily>::value,
+                "the hasher is saved byte for byte");
+  FileHeader header;
+  if (!in.read(reinterpret_cast<char *>(&header), sizeof(header)) ||
+      header.magic != kFileMagic || header.version != kFileVersion) {
+    throw std::runtime_error("not a saved BinaryFuseFilter");
+  }
+  const uint64_t segment_length = header.segment_length;
+  if (header.fingerprint_bytes != sizeof(FingerprintType) ||
+      header.hasher_bytes != sizeof(HashFamily)) {
+    throw std::runtime_error("saved BinaryFuseFilter has a different type");
+  }
+  if (segment_length == 0 || segment_length > kMaxSegmentLength ||
+      (segment_length & (segment_length - 1)) != 0 ||
+      header.segment_count_length == 0 ||
+      header.segment_count_length % segment_length != 0 ||
+      header.array_length !=
+          header.segment_count_length + 2 * segment_length ||
+      header.num_items > header.array_length) {
+    throw std::runtime_error("saved BinaryFuseFilter is corrupt");
+  }
+  HashFamily hasher;
+  in.read(reinterpret_cast<char *>(&hasher), sizeof(hasher));
+  BinaryFuseFilter result(hasher);
+  result.num_items_ = header.num_items;
+  result.seed_ = header.seed;
+  result.segment_length_ = segment_length;
+  result.segment_count_length_ = header.segment_count_length;
+  result.fingerprints_.resize(header.array_length);
+  in.read(reinterpret_cast<char *>(result.fingerprints_.data()),
+          result.SizeInBytes());
+  if (!in) throw std::runtime_error("saved BinaryFuseFilter is truncated");
+  return result;
+}
+
+}  // namespace cuckoofilter
+#endif  // CUCKOO_FILTER_BINARY_FUSE_FILTER_H_
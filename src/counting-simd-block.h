@@ -0,0 +1,364 @@
+// A counting variant of SimdBlockFilter, for sets that shrink as well as grow. It keeps
+// the split block layout, but each bit becomes a small saturating counter, so Remove()
+// can undo an Add().
+//
+// A bucket is one 64-byte cache line of eight 64-bit lanes, each holding sixteen 4-bit
+// counters. Add() increments one counter per lane, the one given by the most
+// significant 4 bits of hash * SimdBlockRehash()[lane], and Remove() decrements the same
+// counters. Find() checks that all eight are nonzero, so it touches one cache line like
+// SimdBlockFilter::Find(). A counter that reaches 15 stays there, since it no longer
+// knows how many keys it counts: that costs false positives but never false negatives.
+// At up to 16 keys per bucket a counter saturates with probability about 10^-12.
+//
+// Counters and the smaller number of positions per lane cost space: at the same false
+// positive probability this takes four to five times as much as a SimdBlockFilter.
+//
+// The bucket operations have scalar, AVX2 and AVX-512 versions with the same layout, and
+// each filter uses the fastest one the CPU supports.
+
+#pragma once
+
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+
+#include <algorithm>
+#include <new>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+#include "hashutil.h"
+#include "simd-block.h"
+
+// The operations on a single bucket, one struct per instruction set.
+struct ScalarCountingBucket {
+  static constexpr const char* kInstructionSet = "scalar";
+
+  // The bit offset of the key's counter in lane:
+  static int Shift(const uint32_t hash, const int lane) noexcept {
+    return 4 * ((hash * SimdBlockRehash()[lane]) >> 28);
+  }
+
+  static void Insert(uint64_t* const bucket, const uint32_t hash) noexcept {
+    for (int i = 0; i < 8; ++i) {
+      const int shift = Shift(hash, i);
+      if (((bucket[i] >> shift) & 15) != 15) bucket[i] += uint64_t{1} << shift;
+    }
+  }
+
+  // Only called on buckets that contain hash, so no counter is zero.
+  static void Remove(uint64_t* const bucket, const uint32_t hash) noexcept {
+    for (int i = 0; i < 8; ++i) {
+      const int shift = Shift(hash, i);
+      if (((bucket[i] >> shift) & 15) != 15) bucket[i] -= uint64_t{1} << shift;
+    }
+  }
+
+  static bool Contains(const uint64_t* const bucket, const uint32_t hash) noexcept {
+    // Accumulate the empty counters of all lanes rather than branching on each lane.
+    bool empty = false;
+    for (int i = 0; i < 8; ++i) empty |= 0 == ((bucket[i] >> Shift(hash, i)) & 15);
+    return !empty;
+  }
+};
+
+#if defined(__x86_64__) || defined(__i386__)
+
+struct Avx2CountingBucket {
+  static constexpr const char* kInstructionSet = "AVX2";
+  static bool Supported() { return __builtin_cpu_supports("avx2"); }
+
+  // The bit offsets of the key's counters in lanes [0, 4) and [4, 8).
+  [[gnu::always_inline, gnu::target("avx2")]] static inline void Shifts(
+      const uint32_t hash, __m256i* const shift) noexcept {
+    const __m256i rehash =
+        _mm256_load_si256(reinterpret_cast<const __m256i*>(SimdBlockRehash()));
+    __m256i product = _mm256_mullo_epi32(rehash, _mm256_set1_epi32(hash));
+    product = _mm256_slli_epi32(_mm256_srli_epi32(product, 28), 2);
+    shift[0] = _mm256_cvtepu32_epi64(_mm256_castsi256_si128(product));
+    shift[1] = _mm256_cvtepu32_epi64(_mm256_extracti128_si256(product, 1));
+  }
+
+  [[gnu::target("avx2")]] static void Insert(
+      uint64_t* const bucket, const uint32_t hash) noexcept {
+    __m256i shift[2];
+    Shifts(hash, shift);
+    __m256i* const vector = reinterpret_cast<__m256i*>(bucket);
+    const __m256i ones = _mm256_set1_epi64x(1), full = _mm256_set1_epi64x(15);
+    for (int v = 0; v < 2; ++v) {
+      const __m256i counter =
+          _mm256_and_si256(_mm256_srlv_epi64(vector[v], shift[v]), full);
+      const __m256i step = _mm256_andnot_si256(
+          _mm256_cmpeq_epi64(counter, full), _mm256_sllv_epi64(ones, shift[v]));
+      vector[v] = _mm256_add_epi64(vector[v], step);
+    }
+  }
+
+  [[gnu::target("avx2")]] static void Remove(
+      uint64_t* const bucket, const uint32_t hash) noexcept {
+    __m256i shift[2];
+    Shifts(hash, shift);
+    __m256i* const vector = reinterpret_cast<__m256i*>(bucket);
+    const __m256i ones = _mm256_set1_epi64x(1), full = _mm256_set1_epi64x(15);
+    for (int v = 0; v < 2; ++v) {
+      const __m256i counter =
+          _mm256_and_si256(_mm256_srlv_epi64(vector[v], shift[v]), full);
+      const __m256i step = _mm256_andnot_si256(
+          _mm256_cmpeq_epi64(counter, full), _mm256_sllv_epi64(ones, shift[v]));
+      vector[v] = _mm256_sub_epi64(vector[v], step);
+    }
+  }
+
+  [[gnu::target("avx2")]] static bool Contains(
+      const uint64_t* const bucket, const uint32_t hash) noexcept {
+    __m256i shift[2];
+    Shifts(hash, shift);
+    const __m256i* const vector = reinterpret_cast<const __m256i*>(bucket);
+    const __m256i full = _mm256_set1_epi64x(15), zero = _mm256_setzero_si256();
+    // All ones in each lane whose counter is zero:
+    __m256i empty = zero;
+    for (int v = 0; v < 2; ++v) {
+      const __m256i counter =
+          _mm256_and_si256(vector[v], _mm256_sllv_epi64(full, shift[v]));
+      empty = _mm256_or_si256(empty, _mm256_cmpeq_epi64(counter, zero));
+    }
+    return _mm256_testz_si256(empty, empty);
+  }
+};
+
+// See the note on Avx512Bucket about these warnings.
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wuninitialized"
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+struct Avx512CountingBucket {
+  static constexpr const char* kInstructionSet = "AVX-512";
+  static bool Supported() { return __builtin_cpu_supports("avx512f"); }
+
+  // The bit offsets of the key's counters in each lane. Only the first eight products
+  // are used.
+  [[gnu::always_inline, gnu::target("avx512f")]] static inline __m512i Shifts(
+      const uint32_t hash) noexcept {
+    __m512i product =
+        _mm512_mullo_epi32(_mm512_load_si512(SimdBlockRehash()), _mm512_set1_epi32(hash));
+    product = _mm512_slli_epi32(_mm512_srli_epi32(product, 28), 2);
+    return _mm512_cvtepu32_epi64(_mm512_castsi512_si256(product));
+  }
+
+  [[gnu::target("avx512f")]] static void Insert(
+      uint64_t* const bucket, const uint32_t hash) noexcept {
+    const __m512i shift = Shifts(hash);
+    const __m512i full = _mm512_set1_epi64(15);
+    const __m512i vector = _mm512_load_si512(bucket);
+    const __m512i counter = _mm512_and_si512(_mm512_srlv_epi64(vector, shift), full);
+    const __mmask8 unsaturated = _mm512_cmpneq_epi64_mask(counter, full);
+    _mm512_store_si512(bucket, _mm512_mask_add_epi64(vector, unsaturated, vector,
+        _mm512_sllv_epi64(_mm512_set1_epi64(1), shift)));
+  }
+
+  [[gnu::target("avx512f")]] static void Remove(
+      uint64_t* const bucket, const uint32_t hash) noexcept {
+    const __m512i shift = Shifts(hash);
+    const __m512i full = _mm512_set1_epi64(15);
+    const __m512i vector = _mm512_load_si512(bucket);
+    const __m512i counter = _mm512_and_si512(_mm512_srlv_epi64(vector, shift), full);
+    const __mmask8 unsaturated = _mm512_cmpneq_epi64_mask(counter, full);
+    _mm512_store_si512(bucket, _mm512_mask_sub_epi64(vector, unsaturated, vector,
+        _mm512_sllv_epi64(_mm512_set1_epi64(1), shift)));
+  }
+
+  [[gnu::target("avx512f")]] static bool Contains(
+      const uint64_t* const bucket, const uint32_t hash) noexcept {
+    const __m512i counters = _mm512_sllv_epi64(_mm512_set1_epi64(15), Shifts(hash));
+    return 0xff == _mm512_test_epi64_mask(_mm512_load_si512(bucket), counters);
+  }
+};
+#pragma GCC diagnostic pop
+
+#endif  // defined(__x86_64__) || defined(__i386__)
+
+// The bucket operations of the instruction set a filter runs on.
+struct CountingBlockKernel {
+  const char* instruction_set;
+  void (*insert)(uint64_t* bucket, uint32_t hash);
+  void (*remove)(uint64_t* bucket, uint32_t hash);
+  bool (*contains)(const uint64_t* bucket, uint32_t hash);
+
+  template <typename Ops>
+  static CountingBlockKernel Of() {
+    return CountingBlockKernel{
+        Ops::kInstructionSet, &Ops::Insert, &Ops::Remove, &Ops::Contains};
+  }
+};
+
+// The fastest kernel this CPU supports.
+inline CountingBlockKernel CountingBlockBestKernel() {
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_cpu_init();
+  if (Avx512CountingBucket::Supported()) {
+    return CountingBlockKernel::Of<Avx512CountingBucket>();
+  }
+  if (Avx2CountingBucket::Supported()) {
+    return CountingBlockKernel::Of<Avx2CountingBucket>();
+  }
+#endif
+  return CountingBlockKernel::Of<ScalarCountingBucket>();
+}
+
+template <typename HashFamily = ::cuckoofilter::TwoIndependentMultiplyShift>
+class CountingSimdBlockFilter {
+ private:
+  // Eight lanes of sixteen 4-bit counters:
+  using Bucket = uint64_t[8];
+
+  // A key's bucket is chosen by the low 32 bits of its hash, scaled to the number of
+  // buckets as in SimdBlockFilter, and its counters by the high 32 bits.
+  uint64_t num_buckets_;
+
+  Bucket* directory_;
+
+  HashFamily hasher_;
+
+  // Chosen for this CPU when the filter is constructed:
+  const CountingBlockKernel kernel_;
+
+  uint32_t BucketIndex(const uint64_t hash) const noexcept {
+    return (static_cast<uint64_t>(static_cast<uint32_t>(hash)) * num_buckets_) >> 32;
+  }
+
+  // The number of buckets in heap_space bytes, clamped to [2, 2^32]:
+  static uint64_t NumBucketsFor(const uint64_t heap_space) {
+    const uint64_t num_buckets = heap_space / sizeof(Bucket);
+    return ::std::min<uint64_t>(1ull << 32, ::std::max<uint64_t>(2, num_buckets));
+  }
+
+  static double FalsePositiveProbOfBuckets(const size_t ndv, const uint64_t num_buckets);
+
+  CountingSimdBlockFilter(const HashFamily& hasher, uint64_t num_buckets);
+
+ public:
+  // Consumes at most (1 << log_heap_space) bytes on the heap.
+  explicit CountingSimdBlockFilter(
+      const int log_heap_space, const HashFamily& hasher = HashFamily());
+
+  // The smallest filter, to the bucket, with a false positive probability of at most
+  // fpp while it holds ndv distinct keys; see MinHeapSpace().
+  CountingSimdBlockFilter(
+      const size_t ndv, const double fpp, const HashFamily& hasher = HashFamily());
+
+  CountingSimdBlockFilter(CountingSimdBlockFilter&& that)
+    : num_buckets_(that.num_buckets_),
+      directory_(that.directory_),
+      hasher_(that.hasher_),
+      kernel_(that.kernel_) {
+    that.directory_ = nullptr;
+  }
+  ~CountingSimdBlockFilter() noexcept { free(directory_); }
+
+  void Add(const uint64_t key) noexcept;
+
+  // Undo an Add() of key. Returns false, leaving the filter unchanged, if key is not
+  // found. Removing a key that was never added but is found (a false positive) takes
+  // counts from the keys that share its counters, which may then be missed.
+  bool Remove(const uint64_t key) noexcept;
+
+  bool Find(const uint64_t key) const noexcept;
+
+  uint64_t SizeInBytes() const { return sizeof(Bucket) * num_buckets_; }
+
+  // The instruction set of the bucket operations in use, such as "AVX2":
+  const char* InstructionSet() const { return kernel_.instruction_set; }
+
+  // The size in bytes of the smallest filter with a false positive probability of at
+  // most fpp while it holds ndv distinct keys:
+  static uint64_t MinHeapSpace(const size_t ndv, const double fpp);
+
+  // The false positive probability of a filter of heap_space bytes holding ndv distinct
+  // keys:
+  static double FalsePositiveProbOfSpace(const size_t ndv, const uint64_t heap_space) {
+    return FalsePositiveProbOfBuckets(ndv, NumBucketsFor(heap_space));
+  }
+
+ private:
+  CountingSimdBlockFilter(const CountingSimdBlockFilter&) = delete;
+  void operator=(const CountingSimdBlockFilter&) = delete;
+};
+
+template <typename HashFamily>
+CountingSimdBlockFilter<HashFamily>::CountingSimdBlockFilter(
+    const HashFamily& hasher, const uint64_t num_buckets)
+  : num_buckets_(num_buckets),
+    directory_(nullptr),
+    hasher_(hasher),
+    kernel_(CountingBlockBestKernel()) {
+  const size_t alloc_size = num_buckets_ * sizeof(Bucket);
+  const int malloc_failed =
+      posix_memalign(reinterpret_cast<void**>(&directory_), 64, alloc_size);
+  if (malloc_failed) throw ::std::bad_alloc();
+  memset(directory_, 0, alloc_size);
+}
+
+template <typename HashFamily>
+CountingSimdBlockFilter<HashFamily>::CountingSimdBlockFilter(
+    const int log_heap_space, const HashFamily& hasher)
+  : CountingSimdBlockFilter(hasher, NumBucketsFor(
+        1ull << ::std::min(38, ::std::max(0, log_heap_space)))) {}
+
+template <typename HashFamily>
+CountingSimdBlockFilter<HashFamily>::CountingSimdBlockFilter(
+    const size_t ndv, const double fpp, const HashFamily& hasher)
+  : CountingSimdBlockFilter(hasher, MinHeapSpace(ndv, fpp) / sizeof(Bucket)) {}
+
+template <typename HashFamily>
+uint64_t CountingSimdBlockFilter<HashFamily>::MinHeapSpace(
+    const size_t ndv, const double fpp) {
+  uint64_t low = 2, high = 1ull << 32;
+  while (low < high) {
+    const uint64_t middle = low + (high - low) / 2;
+    if (FalsePositiveProbOfBuckets(ndv, middle) > fpp) {
+      low = middle + 1;
+    } else {
+      high = middle;
+    }
+  }
+  return low * sizeof(Bucket);
+}
+
+// As for SimdBlockFilter, with a bucket holding j keys having each of a lane's sixteen
+// counters nonzero with probability 1 - (15 / 16)^j.
+template <typename HashFamily>
+double CountingSimdBlockFilter<HashFamily>::FalsePositiveProbOfBuckets(
+    const size_t ndv, const uint64_t num_buckets) {
+  if (0 == ndv) return 0;
+  const double lambda = ndv / static_cast<double>(num_buckets);
+  const double spread = 10 * sqrt(lambda) + 10;
+  double result = 0;
+  for (double j = ::std::max(0.0, floor(lambda - spread)); j <= lambda + spread; ++j) {
+    const double log_poisson = -lambda + j * log(lambda) - lgamma(j + 1);
+    result += exp(log_poisson) * pow(1 - pow(15.0 / 16, j), 8);
+  }
+  return ::std::min(1.0, result);
+}
+
+template <typename HashFamily>
+inline void CountingSimdBlockFilter<HashFamily>::Add(const uint64_t key) noexcept {
+  const auto hash = hasher_(key);
+  kernel_.insert(directory_[BucketIndex(hash)], hash >> 32);
+}
+
+template <typename HashFamily>
+inline bool CountingSimdBlockFilter<HashFamily>::Remove(const uint64_t key) noexcept {
+  const auto hash = hasher_(key);
+  uint64_t* const bucket = directory_[BucketIndex(hash)];
+  if (!kernel_.contains(bucket, hash >> 32)) return false;
+  kernel_.remove(bucket, hash >> 32);
+  return true;
+}
+
+template <typename HashFamily>
+inline bool CountingSimdBlockFilter<HashFamily>::Find(const uint64_t key) const noexcept {
+  const auto hash = hasher_(key);
+  return kernel_.contains(directory_[BucketIndex(hash)], hash >> 32);
+}
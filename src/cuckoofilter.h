@@ -3,9 +3,13 @@
 
 #include <assert.h>
 #include <algorithm>
+#include <memory>
+#include <utility>
+#include <vector>
 
 #include "debug.h"
 #include "hashutil.h"
+#include "mortontable.h"
 #include "packedtable.h"
 #include "printutil.h"
 #include "singletable.h"
@@ -17,51 +21,194 @@ enum Status {
   NotFound = 1,
   NotEnoughSpace = 2,
   NotSupported = 3,
+  // AddIfAbsent() found the item, with false positive rate, so left it out
+  AlreadyPresent = 4,
+  // a reader of a SharedCuckooFilter gave up waiting for the writer to finish
+  // an update
+  Busy = 5,
 };
 
 // maximum number of cuckoo kicks before claiming failure
 const size_t kMaxCuckooCount = 500;
 
+template <typename ItemType, size_t bits_per_item, typename HashFamily,
+          size_t alt_window>
+class FrozenCuckooFilter;
+
+// Where a cuckoo table of bits_per_item-bit tags puts an item: how a hash
+// picks its first bucket and tag, how the tag picks the other bucket, and the
+// stash of stash_size tags that found no room in either. CuckooFilter and
+// CuckooMap share it, so a tag has the same buckets in both whatever their
+// tables hold. See CuckooFilter for alt_window.
+template <size_t bits_per_item, size_t stash_size, size_t alt_window>
+struct CuckooLayout {
+  // words of Stash::tag_bits
+  static const size_t kTagBitWords = 4;
+
+  // Tags that were kicked out of the table for good, each with the smaller
+  // of its two bucket indexes. A tag of 0 marks a free entry. The fields are
+  // separate arrays, so a lookup compares every entry at once. Bit tag % 256
+  // of tag_bits is set for each stashed tag, so most lookups skip the search
+  // even when the stash is full.
+  typedef struct {
+    uint32_t index[stash_size];
+    uint32_t tag[stash_size];
+    uint32_t size;
+    uint64_t tag_bits[kTagBitWords];
+  } Stash;
+
+  static inline size_t IndexHash(const uint32_t hv, const size_t num_buckets) {
+    // num_buckets is always a power of two, so modulo can be replaced with
+    // bitwise-and:
+    return hv & (num_buckets - 1);
+  }
+
+  static inline uint32_t TagHash(const uint32_t hv) {
+    uint32_t tag;
+    tag = hv & ((1ULL << bits_per_item) - 1);
+    tag += (tag == 0);
+    return tag;
+  }
+
+  static inline size_t AltIndex(const size_t index, const uint32_t tag,
+                                const size_t num_buckets) {
+    // NOTE(binfan): originally we use:
+    // index ^ HashUtil::BobHash((const void*) (&tag), 4)) & table_.INDEXMASK;
+    // now doing a quick-n-dirty way:
+    // 0x5bd1e995 is the hash constant from MurmurHash2
+    if (alt_window == 0 || (tag & 3) == 0) {
+      return IndexHash((uint32_t)(index ^ (tag * 0x5bd1e995)), num_buckets);
+    }
+    // XOR with an offset from 1 to alt_window - 1 stays in the block of index
+    // and never gives index back, unless the table is smaller than a block.
+    // Either way the choice depends only on the tag, so AltIndex() of the
+    // result is index again.
+    const uint64_t h = static_cast<uint32_t>(tag * 0x5bd1e995);
+    const size_t offset = 1 + ((h * (alt_window - 1)) >> 32);
+    return index ^ (offset & (std::min(alt_window, num_buckets) - 1));
+  }
+
+  static void SetTagBit(Stash *stash, const uint32_t tag) {
+    stash->tag_bits[(tag / 64) % kTagBitWords] |= 1ULL << (tag % 64);
+  }
+
+  // false if no stash entry holds tag
+  static bool MayBeStashed(const Stash &stash, const uint32_t tag) {
+    return (stash.tag_bits[(tag / 64) % kTagBitWords] >> (tag % 64)) & 1;
+  }
+
+  // Put the tag of an item in buckets i1 and i2 in a free stash entry, and
+  // return the entry.
+  static size_t AddToStash(Stash *stash, const size_t i1, const size_t i2,
+                           const uint32_t tag) {
+    for (size_t j = 0; j < stash_size; j++) {
+      if (stash->tag[j] == 0) {
+        stash->index[j] = std::min(i1, i2);
+        stash->tag[j] = tag;
+        stash->size++;
+        SetTagBit(stash, tag);
+        return j;
+      }
+    }
+    assert(false);
+    return stash_size;
+  }
+
+  static void RemoveFromStash(Stash *stash, const size_t j) {
+    stash->tag[j] = 0;
+    stash->size--;
+    std::fill(stash->tag_bits, stash->tag_bits + kTagBitWords, 0);
+    for (size_t k = 0; k < stash_size; k++) {
+      if (stash->tag[k] != 0) SetTagBit(stash, stash->tag[k]);
+    }
+  }
+
+  // Branch-free after the tag_bits test, so compilers compare several entries
+  // per SIMD instruction.
+  static bool StashContains(const Stash &stash, const size_t i1,
+                            const size_t i2, const uint32_t tag) {
+    if (!MayBeStashed(stash, tag)) return false;
+    const uint32_t index = std::min(i1, i2);
+    uint32_t found = 0;
+    for (size_t j = 0; j < stash_size; j++) {
+      found |= (stash.tag[j] == tag) & (stash.index[j] == index);
+    }
+    return found != 0;
+  }
+
+  // the stash entry of the tag of an item in buckets i1 and i2, or
+  // stash_size if it is not stashed
+  static size_t FindInStash(const Stash &stash, const size_t i1,
+                            const size_t i2, const uint32_t tag) {
+    if (!MayBeStashed(stash, tag)) return stash_size;
+    const uint32_t index = std::min(i1, i2);
+    for (size_t j = 0; j < stash_size; j++) {
+      if (stash.tag[j] == tag && stash.index[j] == index) return j;
+    }
+    return stash_size;
+  }
+
+  // number of buckets of a table for max_num_keys items
+  static size_t NumBucketsFor(const size_t max_num_keys) {
+    size_t assoc = 4;
+    size_t num_buckets = upperpower2(std::max<uint64_t>(1, max_num_keys / assoc));
+    double frac = (double)max_num_keys / num_buckets / assoc;
+    if (frac > 0.96) {
+      num_buckets <<= 1;
+    }
+    return num_buckets;
+  }
+};
+
 // A cuckoo filter class exposes a Bloomier filter interface,
-// providing methods of Add, Delete, Contain. It takes three
+// providing methods of Add, Delete, Contain. It takes seven
 // template parameters:
 //   ItemType:  the type of item you want to insert
 //   bits_per_item: how many bits each item is hashed into
 //   TableType: the storage of table, SingleTable by default, and
 // PackedTable to enable semi-sorting
+//   HashFamily: the hash function applied to each item
+//   Allocator: where the table storage comes from, std::allocator by default
+//   stash_size: how many items that found no room in the table are kept
+// aside, 4 by default. Add() fails once they are all in use.
+//   alt_window: 0 by default, so an item's two buckets may lie anywhere in
+// the table. Otherwise a power of two: the table is split into aligned blocks
+// of alt_window buckets, and for three in four tags both buckets lie in one
+// block. A block that fits in a cache line or a page makes the second bucket
+// of most lookups cheap. The other tags still spread items between blocks,
+// which keeps the load factor close to that of the full table for blocks of 64
+// buckets or more; smaller blocks fill less.
+// Filters are movable but not copyable. CuckooMap, in cuckoomap.h, stores a
+// small value with each item as well.
 template <typename ItemType, size_t bits_per_item,
-          template <size_t> class TableType = SingleTable,
-          typename HashFamily = TwoIndependentMultiplyShift>
+          template <size_t, typename> class TableType = SingleTable,
+          typename HashFamily = TwoIndependentMultiplyShift,
+          typename Allocator = std::allocator<char>, size_t stash_size = 4,
+          size_t alt_window = 0>
 class CuckooFilter {
+  static_assert(stash_size >= 1, "the stash needs room for one item");
+  static_assert(alt_window == 0 ||
+                    (alt_window >= 2 && (alt_window & (alt_window - 1)) == 0),
+                "alt_window must be 0 or a power of two of at least 2");
+
+  typedef CuckooLayout<bits_per_item, stash_size, alt_window> Layout;
+  typedef typename Layout::Stash Stash;
+
   // Storage of items
-  TableType<bits_per_item> *table_;
+  TableType<bits_per_item, Allocator> table_;
 
   // Number of items stored
   size_t num_items_;
 
-  typedef struct {
-    size_t index;
-    uint32_t tag;
-    bool used;
-  } VictimCache;
-
-  VictimCache victim_;
+  Stash stash_;
 
   HashFamily hasher_;
 
   inline size_t IndexHash(uint32_t hv) const {
-    // table_->num_buckets is always a power of two, so modulo can be replaced
-    // with
-    // bitwise-and:
-    return hv & (table_->NumBuckets() - 1);
+    return Layout::IndexHash(hv, table_.NumBuckets());
   }
 
-  inline uint32_t TagHash(uint32_t hv) const {
-    uint32_t tag;
-    tag = hv & ((1ULL << bits_per_item) - 1);
-    tag += (tag == 0);
-    return tag;
-  }
+  inline uint32_t TagHash(uint32_t hv) const { return Layout::TagHash(hv); }
 
   inline void GenerateIndexTagHash(const ItemType& item, size_t* index,
                                    uint32_t* tag) const {
@@ -71,43 +218,123 @@ class CuckooFilter {
   }
 
   inline size_t AltIndex(const size_t index, const uint32_t tag) const {
-    // NOTE(binfan): originally we use:
-    // index ^ HashUtil::BobHash((const void*) (&tag), 4)) & table_->INDEXMASK;
-    // now doing a quick-n-dirty way:
-    // 0x5bd1e995 is the hash constant from MurmurHash2
-    return IndexHash((uint32_t)(index ^ (tag * 0x5bd1e995)));
+    return Layout::AltIndex(index, tag, table_.NumBuckets());
   }
 
+  // Stores the tag of an item whose first bucket is i, kicking tags to their
+  // other buckets and the last one to the stash. Returns NotEnoughSpace,
+  // changing nothing, if the stash is already full.
   Status AddImpl(const size_t i, const uint32_t tag);
 
-  // load factor is the fraction of occupancy
-  double LoadFactor() const { return 1.0 * Size() / table_->SizeInTags(); }
+  Status AddIfAbsentImpl(const size_t i1, const size_t i2, const uint32_t tag);
 
-  double BitsPerItem() const { return 8.0 * table_->SizeInBytes() / Size(); }
+  // Removes the tag from bucket i1, bucket i2 or the stash, in that order.
+  // Sets *freed_slot if it came out of the table, which may make room for a
+  // stashed item.
+  Status DeleteImpl(const size_t i1, const size_t i2, const uint32_t tag,
+                    bool *freed_slot);
 
- public:
-  explicit CuckooFilter(const size_t max_num_keys) : num_items_(0), victim_(), hasher_() {
-    size_t assoc = 4;
-    size_t num_buckets = upperpower2(std::max<uint64_t>(1, max_num_keys / assoc));
-    double frac = (double)max_num_keys / num_buckets / assoc;
-    if (frac > 0.96) {
-      num_buckets <<= 1;
-    }
-    victim_.used = false;
-    table_ = new TableType<bits_per_item>(num_buckets);
+  // Tries to move up to count stashed items into the table.
+  void Unstash(size_t count);
+
+  // The batch methods work on groups of this many items, one word of result
+  // bits each. The buckets of a group are all prefetched before any is
+  // touched, so their cache misses overlap.
+  static const size_t kBatchSize = 64;
+
+  void AddToStash(const size_t i1, const size_t i2, const uint32_t tag) {
+    Layout::AddToStash(&stash_, i1, i2, tag);
   }
 
-  ~CuckooFilter() { delete table_; }
+  void RemoveFromStash(const size_t j) { Layout::RemoveFromStash(&stash_, j); }
+
+  static bool StashContains(const Stash &stash, const size_t i1,
+                            const size_t i2, const uint32_t tag) {
+    return Layout::StashContains(stash, i1, i2, tag);
+  }
+
+  // load factor is the fraction of occupancy
+  double LoadFactor() const { return 1.0 * Size() / table_.SizeInTags(); }
+
+  double BitsPerItem() const { return 8.0 * table_.SizeInBytes() / Size(); }
+
+  template <typename, size_t, template <size_t, typename> class, typename>
+  friend class SharedCuckooFilter;
+
+  template <typename, size_t, typename, size_t>
+  friend class FrozenCuckooFilter;
+
+  template <typename, size_t, size_t, template <size_t, typename> class,
+            typename, typename>
+  friend class WindowedCuckooFilter;
+
+  template <typename, size_t, template <size_t, typename> class, typename,
+            typename>
+  friend class CuckooFilterBank;
+
+ public:
+  explicit CuckooFilter(const size_t max_num_keys,
+                        const Allocator &allocator = Allocator(),
+                        const HashFamily &hasher = HashFamily())
+      : table_(NumBucketsFor(max_num_keys), allocator),
+        num_items_(0),
+        stash_(),
+        hasher_(hasher) {}
+
+  CuckooFilter(CuckooFilter &&) = default;
+  CuckooFilter &operator=(CuckooFilter &&) = default;
+  CuckooFilter(const CuckooFilter &) = delete;
+  CuckooFilter &operator=(const CuckooFilter &) = delete;
 
   // Add an item to the filter.
   Status Add(const ItemType &item);
 
+  // Add an item to the filter, or leave the filter as it was and return
+  // NotEnoughSpace if neither the table nor the stash has room for it. Unlike
+  // Add(), a failure does not fill the filter, so the caller can keep adding
+  // and send the items that did not fit elsewhere.
+  Status TryAdd(const ItemType &item);
+
+  // Add the item unless Contain() would find it, hashing it and reading its
+  // buckets once. Returns AlreadyPresent if it was found, so repeated adds of
+  // one item store it once.
+  Status AddIfAbsent(const ItemType &item);
+
+  // AddIfAbsent() for items[0, n), in order, so an item repeated in the batch
+  // is added once. Sets bit i % 64 of added[i / 64] if items[i] was added,
+  // overwriting the first (n + 63) / 64 words. Returns n, or the index of the
+  // first item there was no room for; it and the items after it are not
+  // added, and their bits are clear.
+  size_t AddManyIfAbsent(const ItemType *items, const size_t n,
+                         uint64_t *added);
+
   // Report if the item is inserted, with false positive rate.
   Status Contain(const ItemType &item) const;
 
   // Delete an key from the filter
   Status Delete(const ItemType &item);
 
+  // Delete() for items[0, n), in order. Sets bit i % 64 of deleted[i / 64] if
+  // items[i] was found and deleted, overwriting the first (n + 63) / 64 words,
+  // and returns the number deleted. The buckets are prefetched as in
+  // AddManyIfAbsent(), and stashed items are moved into the freed slots once,
+  // after the last delete, rather than after each.
+  size_t DeleteMany(const ItemType *items, const size_t n, uint64_t *deleted);
+
+  // Halve the table, merging bucket i + NumBuckets() / 2 into bucket i, the
+  // reverse of doubling it. The buckets of a tag depend on the low bits of
+  // its index, so every tag keeps both of its buckets and no item is needed
+  // again. Tags that do not fit in their merged bucket, and stashed ones, are
+  // added again through the usual cuckoo kicks. If they do not all fit, the
+  // filter is left as it was and NotEnoughSpace is returned; a table of one
+  // bucket returns NotSupported. While it runs, both tables are allocated.
+  Status Shrink();
+
+  // A compact read-only copy of the filter, for once no more items will be
+  // added or deleted. It is defined in frozencuckoofilter.h.
+  FrozenCuckooFilter<ItemType, bits_per_item, HashFamily, alt_window> Freeze()
+      const;
+
   /* methods for providing stats  */
   // summary infomation
   std::string Info() const;
@@ -116,36 +343,46 @@ class CuckooFilter {
   size_t Size() const { return num_items_; }
 
   // size of the filter in bytes.
-  size_t SizeInBytes() const { return table_->SizeInBytes(); }
+  size_t SizeInBytes() const { return table_.SizeInBytes(); }
+
+  // number of buckets the constructor allocates for max_num_keys items
+  static size_t NumBucketsFor(const size_t max_num_keys) {
+    return Layout::NumBucketsFor(max_num_keys);
+  }
 };
 
 template <typename ItemType, size_t bits_per_item,
-          template <size_t> class TableType, typename HashFamily>
-Status CuckooFilter<ItemType, bits_per_item, TableType, HashFamily>::Add(
-    const ItemType &item) {
+          template <size_t, typename> class TableType, typename HashFamily,
+          typename Allocator, size_t stash_size, size_t alt_window>
+Status CuckooFilter<ItemType, bits_per_item, TableType, HashFamily, Allocator,
+                    stash_size, alt_window>::Add(const ItemType &item) {
   size_t i;
   uint32_t tag;
 
-  if (victim_.used) {
-    return NotEnoughSpace;
-  }
-
   GenerateIndexTagHash(item, &i, &tag);
   return AddImpl(i, tag);
 }
 
 template <typename ItemType, size_t bits_per_item,
-          template <size_t> class TableType, typename HashFamily>
-Status CuckooFilter<ItemType, bits_per_item, TableType, HashFamily>::AddImpl(
-    const size_t i, const uint32_t tag) {
+          template <size_t, typename> class TableType, typename HashFamily,
+          typename Allocator, size_t stash_size, size_t alt_window>
+Status CuckooFilter<ItemType, bits_per_item, TableType, HashFamily, Allocator,
+                    stash_size, alt_window>::AddImpl(const size_t i,
+                                                     const uint32_t tag) {
   size_t curindex = i;
   uint32_t curtag = tag;
   uint32_t oldtag;
 
+  // The kicks end in a free slot or the stash, so a free stash entry now
+  // means the item is stored; without one, a kicked-out tag could be lost.
+  if (stash_.size == stash_size) {
+    return NotEnoughSpace;
+  }
+
   for (uint32_t count = 0; count < kMaxCuckooCount; count++) {
     bool kickout = count > 0;
     oldtag = 0;
-    if (table_->InsertTagToBucket(curindex, curtag, kickout, oldtag)) {
+    if (table_.InsertTagToBucket(curindex, curtag, kickout, oldtag)) {
       num_items_++;
       return Ok;
     }
@@ -155,16 +392,123 @@ Status CuckooFilter<ItemType, bits_per_item, TableType, HashFamily>::AddImpl(
     curindex = AltIndex(curindex, curtag);
   }
 
-  victim_.index = curindex;
-  victim_.tag = curtag;
-  victim_.used = true;
+  AddToStash(curindex, AltIndex(curindex, curtag), curtag);
+  num_items_++;
   return Ok;
 }
 
 template <typename ItemType, size_t bits_per_item,
-          template <size_t> class TableType, typename HashFamily>
-Status CuckooFilter<ItemType, bits_per_item, TableType, HashFamily>::Contain(
-    const ItemType &key) const {
+          template <size_t, typename> class TableType, typename HashFamily,
+          typename Allocator, size_t stash_size, size_t alt_window>
+Status CuckooFilter<ItemType, bits_per_item, TableType, HashFamily, Allocator,
+                    stash_size, alt_window>::TryAdd(const ItemType &item) {
+  size_t curindex;
+  uint32_t curtag;
+  uint32_t oldtag;
+  // the bucket of each kick, the tag it put there and the bucket of the tag
+  // it kicked out, to undo them. The buckets differ only for a MortonTable.
+  size_t path_index[kMaxCuckooCount];
+  uint32_t path_tag[kMaxCuckooCount];
+  size_t path_kicked[kMaxCuckooCount];
+
+  GenerateIndexTagHash(item, &curindex, &curtag);
+  for (uint32_t count = 0; count < kMaxCuckooCount; count++) {
+    bool kickout = count > 0;
+    const size_t index = curindex;
+    oldtag = 0;
+    if (table_.InsertTagToBucket(curindex, curtag, kickout, oldtag)) {
+      num_items_++;
+      return Ok;
+    }
+    if (kickout) {
+      path_index[count] = index;
+      path_tag[count] = curtag;
+      path_kicked[count] = curindex;
+      curtag = oldtag;
+    }
+    curindex = AltIndex(curindex, curtag);
+  }
+
+  if (stash_.size < stash_size) {
+    AddToStash(curindex, AltIndex(curindex, curtag), curtag);
+    num_items_++;
+    return Ok;
+  }
+
+  // Walk the path back, putting each kicked out tag back in place of the one
+  // that replaced it. A bucket is a multiset of tags, so which of equal tags
+  // is replaced does not matter. The tag left over is the new item's.
+  for (uint32_t count = kMaxCuckooCount - 1; count > 0; count--) {
+    table_.DeleteTagFromBucket(path_index[count], path_tag[count]);
+    table_.InsertTagToBucket(path_kicked[count], curtag, false, oldtag);
+    curtag = path_tag[count];
+  }
+  return NotEnoughSpace;
+}
+
+template <typename ItemType, size_t bits_per_item,
+          template <size_t, typename> class TableType, typename HashFamily,
+          typename Allocator, size_t stash_size, size_t alt_window>
+Status CuckooFilter<ItemType, bits_per_item, TableType, HashFamily, Allocator,
+                    stash_size, alt_window>::
+    AddIfAbsentImpl(const size_t i1, const size_t i2, const uint32_t tag) {
+  if (StashContains(stash_, i1, i2, tag) ||
+      table_.FindTagInBuckets(i1, i2, tag)) {
+    return AlreadyPresent;
+  }
+  return AddImpl(i1, tag);
+}
+
+template <typename ItemType, size_t bits_per_item,
+          template <size_t, typename> class TableType, typename HashFamily,
+          typename Allocator, size_t stash_size, size_t alt_window>
+Status CuckooFilter<ItemType, bits_per_item, TableType, HashFamily, Allocator,
+                    stash_size, alt_window>::AddIfAbsent(const ItemType &item) {
+  size_t i1;
+  uint32_t tag;
+
+  GenerateIndexTagHash(item, &i1, &tag);
+  return AddIfAbsentImpl(i1, AltIndex(i1, tag), tag);
+}
+
+template <typename ItemType, size_t bits_per_item,
+          template <size_t, typename> class TableType, typename HashFamily,
+          typename Allocator, size_t stash_size, size_t alt_window>
+size_t CuckooFilter<ItemType, bits_per_item, TableType, HashFamily, Allocator,
+                    stash_size, alt_window>::
+    AddManyIfAbsent(const ItemType *items, const size_t n, uint64_t *added) {
+  size_t i1[kBatchSize], i2[kBatchSize];
+  uint32_t tag[kBatchSize];
+
+  for (size_t i = 0; i < n; i += kBatchSize) {
+    const size_t m = n - i < kBatchSize ? n - i : kBatchSize;
+    for (size_t j = 0; j < m; j++) {
+      GenerateIndexTagHash(items[i + j], &i1[j], &tag[j]);
+      i2[j] = AltIndex(i1[j], tag[j]);
+      table_.template PrefetchBucket<1>(i1[j]);
+      table_.template PrefetchBucket<1>(i2[j]);
+    }
+    added[i / kBatchSize] = 0;
+    for (size_t j = 0; j < m; j++) {
+      const Status status = AddIfAbsentImpl(i1[j], i2[j], tag[j]);
+      if (status == NotEnoughSpace) {
+        for (size_t k = i / kBatchSize + 1; k * kBatchSize < n; k++) {
+          added[k] = 0;
+        }
+        return i + j;
+      }
+      added[i / kBatchSize] |= static_cast<uint64_t>(status == Ok) << j;
+    }
+  }
+  return n;
+}
+
+template <typename ItemType, size_t bits_per_item,
+          template <size_t, typename> class TableType, typename HashFamily,
+          typename Allocator, size_t stash_size, size_t alt_window>
+Status CuckooFilter<ItemType, bits_per_item, TableType, HashFamily, Allocator,
+                    stash_size, alt_window>::Contain(const ItemType &key)
+    const {
   bool found = false;
   size_t i1, i2;
   uint32_t tag;
@@ -174,10 +518,9 @@ Status CuckooFilter<ItemType, bits_per_item, TableType, HashFamily>::Contain(
 
   assert(i1 == AltIndex(i2, tag));
 
-  found = victim_.used && (tag == victim_.tag) &&
-          (i1 == victim_.index || i2 == victim_.index);
+  found = StashContains(stash_, i1, i2, tag);
 
-  if (found || table_->FindTagInBuckets(i1, i2, tag)) {
+  if (found || table_.FindTagInBuckets(i1, i2, tag)) {
     return Ok;
   } else {
     return NotFound;
@@ -185,48 +528,167 @@ Status CuckooFilter<ItemType, bits_per_item, TableType, HashFamily>::Contain(
 }
 
 template <typename ItemType, size_t bits_per_item,
-          template <size_t> class TableType, typename HashFamily>
-Status CuckooFilter<ItemType, bits_per_item, TableType, HashFamily>::Delete(
-    const ItemType &key) {
+          template <size_t, typename> class TableType, typename HashFamily,
+          typename Allocator, size_t stash_size, size_t alt_window>
+Status CuckooFilter<ItemType, bits_per_item, TableType, HashFamily, Allocator,
+                    stash_size, alt_window>::
+    DeleteImpl(const size_t i1, const size_t i2, const uint32_t tag,
+               bool *freed_slot) {
+  if (table_.DeleteTagFromBucket(i1, tag) ||
+      table_.DeleteTagFromBucket(i2, tag)) {
+    num_items_--;
+    *freed_slot = true;
+    return Ok;
+  }
+  const size_t j = Layout::FindInStash(stash_, i1, i2, tag);
+  if (j != stash_size) {
+    RemoveFromStash(j);
+    num_items_--;
+    return Ok;
+  }
+  return NotFound;
+}
+
+template <typename ItemType, size_t bits_per_item,
+          template <size_t, typename> class TableType, typename HashFamily,
+          typename Allocator, size_t stash_size, size_t alt_window>
+void CuckooFilter<ItemType, bits_per_item, TableType, HashFamily, Allocator,
+                  stash_size, alt_window>::Unstash(size_t count) {
+  // An item whose kicks still fail ends up back in the stash, in an entry no
+  // later than the one it was taken from, so each is tried at most once.
+  for (size_t j = 0; j < stash_size && count != 0 && stash_.size != 0; j++) {
+    if (stash_.tag[j] != 0) {
+      const size_t i = stash_.index[j];
+      const uint32_t tag = stash_.tag[j];
+      RemoveFromStash(j);
+      num_items_--;
+      AddImpl(i, tag);
+      count--;
+    }
+  }
+}
+
+template <typename ItemType, size_t bits_per_item,
+          template <size_t, typename> class TableType, typename HashFamily,
+          typename Allocator, size_t stash_size, size_t alt_window>
+Status CuckooFilter<ItemType, bits_per_item, TableType, HashFamily, Allocator,
+                    stash_size, alt_window>::Delete(const ItemType &key) {
   size_t i1, i2;
   uint32_t tag;
+  bool freed_slot = false;
 
   GenerateIndexTagHash(key, &i1, &tag);
   i2 = AltIndex(i1, tag);
 
-  if (table_->DeleteTagFromBucket(i1, tag)) {
-    num_items_--;
-    goto TryEliminateVictim;
-  } else if (table_->DeleteTagFromBucket(i2, tag)) {
-    num_items_--;
-    goto TryEliminateVictim;
-  } else if (victim_.used && tag == victim_.tag &&
-             (i1 == victim_.index || i2 == victim_.index)) {
-    // num_items_--;
-    victim_.used = false;
-    return Ok;
-  } else {
-    return NotFound;
+  const Status status = DeleteImpl(i1, i2, tag, &freed_slot);
+  // The freed slot may make room for a stashed item.
+  if (freed_slot) {
+    Unstash(1);
+  }
+  return status;
+}
+
+template <typename ItemType, size_t bits_per_item,
+          template <size_t, typename> class TableType, typename HashFamily,
+          typename Allocator, size_t stash_size, size_t alt_window>
+size_t CuckooFilter<ItemType, bits_per_item, TableType, HashFamily, Allocator,
+                    stash_size, alt_window>::
+    DeleteMany(const ItemType *items, const size_t n, uint64_t *deleted) {
+  size_t i1[kBatchSize], i2[kBatchSize];
+  uint32_t tag[kBatchSize];
+  size_t count = 0;
+  bool freed_slot = false;
+
+  for (size_t i = 0; i < n; i += kBatchSize) {
+    const size_t m = n - i < kBatchSize ? n - i : kBatchSize;
+    for (size_t j = 0; j < m; j++) {
+      GenerateIndexTagHash(items[i + j], &i1[j], &tag[j]);
+      i2[j] = AltIndex(i1[j], tag[j]);
+      table_.template PrefetchBucket<1>(i1[j]);
+      table_.template PrefetchBucket<1>(i2[j]);
+    }
+    uint64_t word = 0;
+    for (size_t j = 0; j < m; j++) {
+      const bool found = DeleteImpl(i1[j], i2[j], tag[j], &freed_slot) == Ok;
+      word |= static_cast<uint64_t>(found) << j;
+      count += found;
+    }
+    deleted[i / kBatchSize] = word;
+  }
+  if (freed_slot) {
+    Unstash(stash_size);
+  }
+  return count;
+}
+
+template <typename ItemType, size_t bits_per_item,
+          template <size_t, typename> class TableType, typename HashFamily,
+          typename Allocator, size_t stash_size, size_t alt_window>
+Status CuckooFilter<ItemType, bits_per_item, TableType, HashFamily, Allocator,
+                    stash_size, alt_window>::Shrink() {
+  typedef TableType<bits_per_item, Allocator> Table;
+  const size_t num_buckets = table_.NumBuckets();
+  if (num_buckets < 2) {
+    return NotSupported;
+  }
+  Table half(num_buckets / 2 / Table::kBucketMultiple,
+             table_.get_allocator());
+  if (Size() > half.SizeInTags() + stash_size) {
+    return NotEnoughSpace;
+  }
+  Table old(std::move(table_));
+  table_ = std::move(half);
+  const Stash old_stash = stash_;
+  const size_t old_num_items = num_items_;
+  stash_ = Stash();
+  num_items_ = 0;
+
+  // Merge without kicks first, so that most tags are placed in one pass.
+  const size_t mask = table_.NumBuckets() - 1;
+  std::vector<std::pair<size_t, uint32_t>> overflow;
+  uint32_t tags[4];
+  uint32_t oldtag;
+  for (size_t i = 0; i < num_buckets; i++) {
+    old.ReadBucket(i, tags);
+    for (size_t j = 0; j < 4; j++) {
+      if (tags[j] == 0) continue;
+      size_t index = i & mask;
+      if (table_.InsertTagToBucket(index, tags[j], false, oldtag)) {
+        num_items_++;
+      } else {
+        overflow.push_back(std::make_pair(index, tags[j]));
+      }
+    }
   }
-TryEliminateVictim:
-  if (victim_.used) {
-    victim_.used = false;
-    size_t i = victim_.index;
-    uint32_t tag = victim_.tag;
-    AddImpl(i, tag);
+  for (size_t j = 0; j < stash_size; j++) {
+    if (old_stash.tag[j] != 0) {
+      overflow.push_back(std::make_pair(old_stash.index[j] & mask,
+                                        old_stash.tag[j]));
+    }
+  }
+  for (const auto &entry : overflow) {
+    if (AddImpl(entry.first, entry.second) != Ok) {
+      table_ = std::move(old);
+      stash_ = old_stash;
+      num_items_ = old_num_items;
+      return NotEnoughSpace;
+    }
   }
   return Ok;
 }
 
 template <typename ItemType, size_t bits_per_item,
-          template <size_t> class TableType, typename HashFamily>
-std::string CuckooFilter<ItemType, bits_per_item, TableType, HashFamily>::Info() const {
+          template <size_t, typename> class TableType, typename HashFamily,
+          typename Allocator, size_t stash_size, size_t alt_window>
+std::string CuckooFilter<ItemType, bits_per_item, TableType, HashFamily,
+                         Allocator, stash_size, alt_window>::Info() const {
   std::stringstream ss;
   ss << "CuckooFilter Status:\n"
-     << "\t\t" << table_->Info() << "\n"
+     << "\t\t" << table_.Info() << "\n"
      << "\t\tKeys stored: " << Size() << "\n"
+     << "\t\tKeys stashed: " << stash_.size << "\n"
      << "\t\tLoad factor: " << LoadFactor() << "\n"
-     << "\t\tHashtable size: " << (table_->SizeInBytes() >> 10) << " KB\n";
+     << "\t\tHashtable size: " << (table_.SizeInBytes() >> 10) << " KB\n";
   if (Size() > 0) {
     ss << "\t\tbit/key:   " << BitsPerItem() << "\n";
   } else {
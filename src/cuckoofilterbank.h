@@ -0,0 +1,210 @@
+#ifndef CUCKOO_FILTER_CUCKOO_FILTER_BANK_H_
+#define CUCKOO_FILTER_CUCKOO_FILTER_BANK_H_
+
+#include <assert.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <memory>
+#include <sstream>
+#include <vector>
+
+#include "cuckoofilter.h"
+
+namespace cuckoofilter {
+
+// A bank of CuckooFilters, one per shard, that finds which shards may hold a
+// key. Every filter has the same capacity and one shared hash function, so a
+// key is hashed once and has the same two buckets and tag in every filter; a
+// lookup then reads two buckets per filter and sets a bit for each filter
+// that matches. Size the filters for the largest shard.
+//
+// Lookups report into a bitmap of BitmapWords() words per key: bit k % 64 of
+// word k / 64 is set iff filter k may hold the key. Adds and deletes name the
+// filter they apply to. Banks are movable but not copyable.
+template <typename ItemType, size_t bits_per_item,
+          template <size_t, typename> class TableType = SingleTable,
+          typename HashFamily = TwoIndependentMultiplyShift,
+          typename Allocator = std::allocator<char>>
+class CuckooFilterBank {
+  typedef CuckooFilter<ItemType, bits_per_item, TableType, HashFamily,
+                       Allocator>
+      Filter;
+
+  // lookups prefetch the buckets of the filter this many ahead of the one
+  // they check
+  static const size_t kPrefetchDistance = 8;
+  // ContainMany() hashes items in groups of this many
+  static const size_t kBatchSize = Filter::kBatchSize;
+
+  std::vector<Filter> filters_;
+
+  // the buckets and tag of an item, the same in every filter
+  void Hash(const ItemType &item, size_t *i1, size_t *i2,
+            uint32_t *tag) const {
+    const Filter &filter = filters_[0];
+    filter.GenerateIndexTagHash(item, i1, tag);
+    *i2 = filter.AltIndex(*i1, *tag);
+  }
+
+  void Prefetch(const size_t k, const size_t i1, const size_t i2) const {
+    filters_[k].table_.template PrefetchBucket<0>(i1);
+    filters_[k].table_.template PrefetchBucket<0>(i2);
+  }
+
+  bool Find(const size_t k, const size_t i1, const size_t i2,
+            const uint32_t tag) const {
+    const Filter &filter = filters_[k];
+    return Filter::StashContains(filter.stash_, i1, i2, tag) ||
+           filter.table_.FindTagInBuckets(i1, i2, tag);
+  }
+
+ public:
+  // A bank of num_filters filters, each for max_num_keys items.
+  CuckooFilterBank(const size_t num_filters, const size_t max_num_keys,
+                   const Allocator &allocator = Allocator(),
+                   const HashFamily &hasher = HashFamily())
+      : filters_() {
+    assert(num_filters >= 1);
+    filters_.reserve(num_filters);
+    for (size_t k = 0; k < num_filters; k++) {
+      filters_.emplace_back(max_num_keys, allocator, hasher);
+    }
+  }
+
+  CuckooFilterBank(CuckooFilterBank &&) = default;
+  CuckooFilterBank &operator=(CuckooFilterBank &&) = default;
+  CuckooFilterBank(const CuckooFilterBank &) = delete;
+  CuckooFilterBank &operator=(const CuckooFilterBank &) = delete;
+
+  // Add an item to filter k.
+  Status Add(const size_t k, const ItemType &item) {
+    return filters_[k].Add(item);
+  }
+
+  // Delete an item from filter k.
+  Status Delete(const size_t k, const ItemType &item) {
+    return filters_[k].Delete(item);
+  }
+
+  // Set the bits of the filters that may hold the item in matches, which
+  // has BitmapWords() words, and return how many there are.
+  size_t Contain(const ItemType &item, uint64_t *matches) const {
+    size_t i1, i2;
+    uint32_t tag;
+    Hash(item, &i1, &i2, &tag);
+
+    const size_t n = filters_.size();
+    memset(matches, 0, BitmapWords() * sizeof(uint64_t));
+    for (size_t k = 0; k < kPrefetchDistance && k < n; k++) {
+      Prefetch(k, i1, i2);
+    }
+    size_t count = 0;
+    for (size_t k = 0; k < n; k++) {
+      if (k + kPrefetchDistance < n) {
+        Prefetch(k + kPrefetchDistance, i1, i2);
+      }
+      const bool found = Find(k, i1, i2, tag);
+      matches[k / 64] |= static_cast<uint64_t>(found) << (k % 64);
+      count += found;
+    }
+    return count;
+  }
+
+  // Contain() for items[0, n). The bitmap of items[i] is the BitmapWords()
+  // words from matches + i * BitmapWords(). Returns the number of bits set
+  // in all of them. The items are hashed 64 at a time, and the prefetches run
+  // on from the last filters of one item to the first of the next, so the
+  // cache misses of consecutive items overlap too.
+  size_t ContainMany(const ItemType *items, const size_t n,
+                     uint64_t *matches) const {
+    const size_t words = BitmapWords();
+    const size_t num_filters = filters_.size();
+    size_t i1[kBatchSize], i2[kBatchSize];
+    uint32_t tag[kBatchSize];
+    size_t count = 0;
+
+    memset(matches, 0, n * words * sizeof(uint64_t));
+    for (size_t i = 0; i < n; i += kBatchSize) {
+      const size_t m = n - i < kBatchSize ? n - i : kBatchSize;
+      for (size_t j = 0; j < m; j++) {
+        Hash(items[i + j], &i1[j], &i2[j], &tag[j]);
+      }
+      // the filter and item of the next prefetch that crosses to a later
+      // item
+      size_t pk = 0, pj = 0;
+      for (size_t d = 0; d < kPrefetchDistance && pj < m; d++) {
+        Prefetch(pk, i1[pj], i2[pj]);
+        if (++pk == num_filters) {
+          pk = 0;
+          pj++;
+        }
+      }
+      for (size_t j = 0; j < m; j++) {
+        uint64_t *bitmap = matches + (i + j) * words;
+        size_t k = 0;
+        for (; k + kPrefetchDistance < num_filters; k++) {
+          Prefetch(k + kPrefetchDistance, i1[j], i2[j]);
+          const bool found = Find(k, i1[j], i2[j], tag[j]);
+          bitmap[k / 64] |= static_cast<uint64_t>(found) << (k % 64);
+          count += found;
+        }
+        // The prefetches of this item's own filters are done; from here
+        // they are of the next item's, starting with its first filter.
+        if (k != 0) {
+          pk = 0;
+          pj = j + 1;
+        }
+        for (; k < num_filters; k++) {
+          if (pj < m) {
+            Prefetch(pk, i1[pj], i2[pj]);
+            if (++pk == num_filters) {
+              pk = 0;
+              pj++;
+            }
+          }
+          const bool found = Find(k, i1[j], i2[j], tag[j]);
+          bitmap[k / 64] |= static_cast<uint64_t>(found) << (k % 64);
+          count += found;
+        }
+      }
+    }
+    return count;
+  }
+
+  // number of filters in the bank
+  size_t NumFilters() const { return filters_.size(); }
+
+  // words of the bitmap a lookup of one item reports into
+  size_t BitmapWords() const { return (filters_.size() + 63) / 64; }
+
+  /* methods for providing stats  */
+  // summary infomation
+  std::string Info() const {
+    std::stringstream ss;
+    ss << "CuckooFilterBank Status:\n"
+       << "\t\tFilters: " << filters_.size() << "\n"
+       << "\t\tKeys stored: " << Size() << "\n"
+       << "\t\tHashtable size: " << (SizeInBytes() >> 10) << " KB\n";
+    return ss.str();
+  }
+
+  // number of items in filter k
+  size_t Size(const size_t k) const { return filters_[k].Size(); }
+
+  // number of items in all filters
+  size_t Size() const {
+    size_t size = 0;
+    for (const Filter &filter : filters_) {
+      size += filter.Size();
+    }
+    return size;
+  }
+
+  // size of all filters in bytes
+  size_t SizeInBytes() const {
+    return filters_.size() * filters_[0].SizeInBytes();
+  }
+};
+}  // namespace cuckoofilter
+#endif  // CUCKOO_FILTER_CUCKOO_FILTER_BANK_H_
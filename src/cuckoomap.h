@@ -0,0 +1,261 @@
+#ifndef CUCKOO_FILTER_CUCKOO_MAP_H_
+#define CUCKOO_FILTER_CUCKOO_MAP_H_
+
+#include <assert.h>
+#include <memory>
+#include <sstream>
+
+#include "cuckoofilter.h"
+#include "valuetable.h"
+
+namespace cuckoofilter {
+
+// An approximate map from items to small values, such as shard ids. It is a
+// cuckoo filter whose table keeps a value of bits_per_value bits next to each
+// tag, so a lookup reads one value from the same two buckets that Contain()
+// would read, with no separate hash map. Buckets, tags and the stash are
+// CuckooFilter's, from CuckooLayout; the stash keeps the values of its tags
+// alongside. It takes five template parameters:
+//   ItemType:  the type of item you want to insert
+//   bits_per_tag: how many bits each item is hashed into
+//   bits_per_value: how many bits of value are stored with each item; the
+// two together are at most 32
+//   HashFamily: the hash function applied to each item
+//   Allocator: where the table storage comes from, std::allocator by default
+//
+// Lookup() of an item that was never added finds a value with the false
+// positive rate of the filter, and the value it finds is that of some other
+// item. Items are told apart only by their tag and buckets, so adding an item
+// that collides with one already in the map replaces its value.
+// Maps are movable but not copyable.
+template <typename ItemType, size_t bits_per_tag, size_t bits_per_value,
+          typename HashFamily = TwoIndependentMultiplyShift,
+          typename Allocator = std::allocator<char>>
+class CuckooMap {
+  // how many items that found no room in the table are kept aside
+  static const size_t kStashSize = 4;
+
+  typedef CuckooLayout<bits_per_tag, kStashSize, 0> Layout;
+
+  // Storage of items and their values
+  ValueTable<bits_per_tag, bits_per_value, Allocator> table_;
+
+  // Number of items stored
+  size_t num_items_;
+
+  // Items that were kicked out of the table for good, and the value of each
+  // stash entry
+  typename Layout::Stash stash_;
+  uint32_t stash_values_[kStashSize];
+
+  HashFamily hasher_;
+
+  inline void GenerateIndexTagHash(const ItemType &item, size_t *index,
+                                   uint32_t *tag) const {
+    const uint64_t hash = hasher_(item);
+    *index = Layout::IndexHash(hash >> 32, table_.NumBuckets());
+    *tag = Layout::TagHash(hash);
+  }
+
+  inline size_t AltIndex(const size_t index, const uint32_t tag) const {
+    return Layout::AltIndex(index, tag, table_.NumBuckets());
+  }
+
+  // As CuckooFilter's, carrying each tag's value along. Returns
+  // NotEnoughSpace, changing nothing, if the stash is already full.
+  Status AddImpl(const size_t i, const uint32_t tag, const uint32_t value);
+
+  // Tries to move one stashed item into the table.
+  void Unstash();
+
+  // load factor is the fraction of occupancy
+  double LoadFactor() const { return 1.0 * Size() / table_.SizeInTags(); }
+
+  double BitsPerItem() const { return 8.0 * table_.SizeInBytes() / Size(); }
+
+ public:
+  explicit CuckooMap(const size_t max_num_keys,
+                     const Allocator &allocator = Allocator(),
+                     const HashFamily &hasher = HashFamily())
+      : table_(Layout::NumBucketsFor(max_num_keys), allocator),
+        num_items_(0),
+        stash_(),
+        stash_values_(),
+        hasher_(hasher) {}
+
+  CuckooMap(CuckooMap &&) = default;
+  CuckooMap &operator=(CuckooMap &&) = default;
+  CuckooMap(const CuckooMap &) = delete;
+  CuckooMap &operator=(const CuckooMap &) = delete;
+
+  // Map the item to value, which must be less than 2^bits_per_value. If the
+  // item is found, its value is replaced. Fails with NotEnoughSpace once the
+  // stash is full, as CuckooFilter::Add() does.
+  Status Add(const ItemType &item, const uint32_t value);
+
+  // Set *value to the value of the item and return Ok, or return NotFound.
+  // With the false positive rate, an item that was never added is found too.
+  Status Lookup(const ItemType &item, uint32_t *value) const;
+
+  // Delete an item and its value from the map.
+  Status Delete(const ItemType &item);
+
+  /* methods for providing stats  */
+  // summary infomation
+  std::string Info() const;
+
+  // number of current inserted items;
+  size_t Size() const { return num_items_; }
+
+  // size of the map in bytes.
+  size_t SizeInBytes() const { return table_.SizeInBytes(); }
+};
+
+template <typename ItemType, size_t bits_per_tag, size_t bits_per_value,
+          typename HashFamily, typename Allocator>
+Status CuckooMap<ItemType, bits_per_tag, bits_per_value, HashFamily,
+                 Allocator>::Add(const ItemType &item, const uint32_t value) {
+  size_t i1, i2;
+  uint32_t tag;
+
+  assert(value < (1ULL << bits_per_value));
+  GenerateIndexTagHash(item, &i1, &tag);
+  i2 = AltIndex(i1, tag);
+
+  if (table_.ReplaceValueInBucket(i1, tag, value) ||
+      table_.ReplaceValueInBucket(i2, tag, value)) {
+    return Ok;
+  }
+  const size_t j = Layout::FindInStash(stash_, i1, i2, tag);
+  if (j != kStashSize) {
+    stash_values_[j] = value;
+    return Ok;
+  }
+  return AddImpl(i1, tag, value);
+}
+
+template <typename ItemType, size_t bits_per_tag, size_t bits_per_value,
+          typename HashFamily, typename Allocator>
+Status CuckooMap<ItemType, bits_per_tag, bits_per_value, HashFamily,
+                 Allocator>::AddImpl(const size_t i, const uint32_t tag,
+                                     const uint32_t value) {
+  size_t curindex = i;
+  uint32_t curtag = tag;
+  uint32_t curvalue = value;
+  uint32_t oldtag, oldvalue;
+
+  // The kicks end in a free slot or the stash, so a free stash entry now
+  // means the item is stored.
+  if (stash_.size == kStashSize) {
+    return NotEnoughSpace;
+  }
+
+  for (uint32_t count = 0; count < kMaxCuckooCount; count++) {
+    bool kickout = count > 0;
+    oldtag = 0;
+    if (table_.InsertTagToBucket(curindex, curtag, curvalue, kickout, oldtag,
+                                 oldvalue)) {
+      num_items_++;
+      return Ok;
+    }
+    if (kickout) {
+      curtag = oldtag;
+      curvalue = oldvalue;
+    }
+    curindex = AltIndex(curindex, curtag);
+  }
+
+  const size_t j = Layout::AddToStash(&stash_, curindex,
+                                      AltIndex(curindex, curtag), curtag);
+  stash_values_[j] = curvalue;
+  num_items_++;
+  return Ok;
+}
+
+template <typename ItemType, size_t bits_per_tag, size_t bits_per_value,
+          typename HashFamily, typename Allocator>
+Status CuckooMap<ItemType, bits_per_tag, bits_per_value, HashFamily,
+                 Allocator>::Lookup(const ItemType &item,
+                                    uint32_t *value) const {
+  size_t i1, i2;
+  uint32_t tag;
+
+  GenerateIndexTagHash(item, &i1, &tag);
+  i2 = AltIndex(i1, tag);
+
+  if (table_.FindValueInBuckets(i1, i2, tag, value)) {
+    return Ok;
+  }
+  const size_t j = Layout::FindInStash(stash_, i1, i2, tag);
+  if (j != kStashSize) {
+    *value = stash_values_[j];
+    return Ok;
+  }
+  return NotFound;
+}
+
+template <typename ItemType, size_t bits_per_tag, size_t bits_per_value,
+          typename HashFamily, typename Allocator>
+void CuckooMap<ItemType, bits_per_tag, bits_per_value, HashFamily,
+               Allocator>::Unstash() {
+  for (size_t j = 0; j < kStashSize; j++) {
+    if (stash_.tag[j] != 0) {
+      const size_t i = stash_.index[j];
+      const uint32_t tag = stash_.tag[j];
+      const uint32_t value = stash_values_[j];
+      Layout::RemoveFromStash(&stash_, j);
+      num_items_--;
+      AddImpl(i, tag, value);
+      return;
+    }
+  }
+}
+
+template <typename ItemType, size_t bits_per_tag, size_t bits_per_value,
+          typename HashFamily, typename Allocator>
+Status CuckooMap<ItemType, bits_per_tag, bits_per_value, HashFamily,
+                 Allocator>::Delete(const ItemType &item) {
+  size_t i1, i2;
+  uint32_t tag;
+
+  GenerateIndexTagHash(item, &i1, &tag);
+  i2 = AltIndex(i1, tag);
+
+  if (table_.DeleteTagFromBucket(i1, tag) ||
+      table_.DeleteTagFromBucket(i2, tag)) {
+    num_items_--;
+    // The freed slot may make room for a stashed item.
+    if (stash_.size != 0) {
+      Unstash();
+    }
+    return Ok;
+  }
+  const size_t j = Layout::FindInStash(stash_, i1, i2, tag);
+  if (j != kStashSize) {
+    Layout::RemoveFromStash(&stash_, j);
+    num_items_--;
+    return Ok;
+  }
+  return NotFound;
+}
+
+template <typename ItemType, size_t bits_per_tag, size_t bits_per_value,
+          typename HashFamily, typename Allocator>
+std::string CuckooMap<ItemType, bits_per_tag, bits_per_value, HashFamily,
+                      Allocator>::Info() const {
+  std::stringstream ss;
+  ss << "CuckooMap Status:\n"
+     << "\t\t" << table_.Info() << "\n"
+     << "\t\tKeys stored: " << Size() << "\n"
+     << "\t\tKeys stashed: " << stash_.size << "\n"
+     << "\t\tLoad factor: " << LoadFactor() << "\n"
+     << "\t\tHashtable size: " << (table_.SizeInBytes() >> 10) << " KB\n";
+  if (Size() > 0) {
+    ss << "\t\tbit/key:   " << BitsPerItem() << "\n";
+  } else {
+    ss << "\t\tbit/key:   N/A\n";
+  }
+  return ss.str();
+}
+}  // namespace cuckoofilter
+#endif  // CUCKOO_FILTER_CUCKOO_MAP_H_
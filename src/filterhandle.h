@@ -0,0 +1,204 @@
+#ifndef CUCKOO_FILTER_FILTER_HANDLE_H_
+#define CUCKOO_FILTER_FILTER_HANDLE_H_
+
+#include <stdint.h>
+
+#include <cmath>
+#include <memory>
+#include <stdexcept>
+#include <string>
+
+#include "cuckoofilter.h"
+#include "simd-block.h"
+
+namespace cuckoofilter {
+
+// A filter over uint64_t keys whose type is chosen at run time. MakeFilter()
+// picks one of the compiled CuckooFilter or SimdBlockFilter specializations
+// for a requested false positive rate and capacity.
+//
+// The batch methods are the only virtual calls; each specialization runs its
+// per-key loop with the filter type known, so a batch costs one indirect call.
+// Batch lookups report into a packed bitmap: bit (i % 64) of found[i / 64] is
+// set iff keys[i] may be in the filter.
+class FilterHandle {
+ public:
+  virtual ~FilterHandle() {}
+
+  // Add keys[0, n) in order. Returns the number of keys added, which is less
+  // than n only if the filter ran out of space.
+  virtual size_t AddMany(const uint64_t *keys, size_t n) = 0;
+
+  // Look up keys[0, n), overwriting the first (n + 63) / 64 words of found.
+  // Returns the number of keys reported as present.
+  virtual size_t ContainMany(const uint64_t *keys, size_t n,
+                             uint64_t *found) const = 0;
+
+  // Delete keys[0, n). Returns the number of keys deleted; always 0 if
+  // !SupportsDelete().
+  virtual size_t DeleteMany(const uint64_t *keys, size_t n) = 0;
+
+  virtual bool SupportsDelete() const = 0;
+
+  // name of the chosen specialization, as in the benchmarks (e.g. "Cuckoo12")
+  virtual std::string Name() const = 0;
+
+  // size of the filter in bytes.
+  virtual size_t SizeInBytes() const = 0;
+
+  Status Add(uint64_t key) { return AddMany(&key, 1) ? Ok : NotEnoughSpace; }
+
+  Status Contain(uint64_t key) const {
+    uint64_t found;
+    return ContainMany(&key, 1, &found) ? Ok : NotFound;
+  }
+
+  Status Delete(uint64_t key) {
+    if (!SupportsDelete()) return NotSupported;
+    return DeleteMany(&key, 1) ? Ok : NotFound;
+  }
+};
+
+template <size_t bits_per_item, template <size_t, typename> class TableType>
+class CuckooFilterHandle : public FilterHandle {
+  CuckooFilter<uint64_t, bits_per_item, TableType> filter_;
+  const char *name_;
+
+ public:
+  CuckooFilterHandle(const size_t max_num_keys, const char *name)
+      : filter_(max_num_keys), name_(name) {}
+
+  size_t AddMany(const uint64_t *keys, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+      if (filter_.Add(keys[i]) != Ok) return i;
+    }
+    return n;
+  }
+
+  size_t ContainMany(const uint64_t *keys, size_t n, uint64_t *found) const {
+    size_t count = 0;
+    for (size_t i = 0; i < n; i += 64) {
+      uint64_t word = 0;
+      for (size_t j = 0; j < 64 && i + j < n; j++) {
+        word |= static_cast<uint64_t>(filter_.Contain(keys[i + j]) == Ok) << j;
+      }
+      found[i / 64] = word;
+      count += __builtin_popcountll(word);
+    }
+    return count;
+  }
+
+  size_t DeleteMany(const uint64_t *keys, size_t n) {
+    size_t count = 0;
+    for (size_t i = 0; i < n; i++) {
+      count += (filter_.Delete(keys[i]) == Ok);
+    }
+    return count;
+  }
+
+  bool SupportsDelete() const { return true; }
+  std::string Name() const { return name_; }
+  size_t SizeInBytes() const { return filter_.SizeInBytes(); }
+};
+
+class SimdBlockFilterHandle : public FilterHandle {
+  SimdBlockFilter<> filter_;
+
+ public:
+  explicit SimdBlockFilterHandle(const uint64_t heap_space)
+      : filter_(SimdBlockFilter<>::WithHeapSpace(heap_space)) {}
+
+  size_t AddMany(const uint64_t *keys, size_t n) {
+    filter_.AddMany(keys, n);
+    return n;
+  }
+
+  size_t ContainMany(const uint64_t *keys, size_t n, uint64_t *found) const {
+    return filter_.FindMany(keys, n, found);
+  }
+
+  size_t DeleteMany(const uint64_t *, size_t) { return 0; }
+  bool SupportsDelete() const { return false; }
+  std::string Name() const { return "SimdBlock8"; }
+  size_t SizeInBytes() const { return filter_.SizeInBytes(); }
+};
+
+// The estimated false positive rate of a full CuckooFilter with tags of
+// bits_per_tag bits: each lookup compares against the 8 slots of two buckets,
+// and tags are never 0.
+inline double CuckooFalsePositiveRate(const size_t bits_per_tag,
+                                      const size_t max_num_keys) {
+  const double load =
+      1.0 * max_num_keys / (4 * CuckooFilter<uint64_t, 8>::NumBucketsFor(max_num_keys));
+  return 1 - pow(1 - 1.0 / ((1ULL << bits_per_tag) - 1), 8 * load);
+}
+
+// Create the smallest filter expected to hold max_num_keys keys with a false
+// positive rate of at most false_positive_rate. Ties go to the faster filter.
+// If no filter is accurate enough, the most accurate one is returned.
+inline std::unique_ptr<FilterHandle> MakeFilter(const double false_positive_rate,
+                                                const size_t max_num_keys) {
+  if (!(false_positive_rate > 0 && false_positive_rate < 1)) {
+    throw std::invalid_argument("false_positive_rate must be in (0, 1)");
+  }
+
+  // Candidates in order of decreasing speed. Semi-sorting (PackedTable) saves
+  // one bit per tag at the cost of lookup speed.
+  enum Kind { kSimdBlock, kCuckoo8, kCuckoo12, kCuckoo16, kSemiSort9,
+              kSemiSort13, kSemiSort17, kNumKinds };
+  static const size_t kTagBits[kNumKinds] = {0, 8, 12, 16, 9, 13, 17};
+  static const size_t kStoredBits[kNumKinds] = {0, 8, 12, 16, 8, 12, 16};
+
+  const size_t num_buckets =
+      CuckooFilter<uint64_t, 8>::NumBucketsFor(max_num_keys);
+  const uint64_t heap_space =
+      SimdBlockFilter<>::MinHeapSpace(max_num_keys, false_positive_rate);
+
+  int best = -1, most_accurate = 0;
+  double best_bytes = 0, fpr[kNumKinds], bytes[kNumKinds];
+  for (int k = 0; k < kNumKinds; k++) {
+    if (k == kSimdBlock) {
+      fpr[k] = SimdBlockFilter<>::FalsePositiveProbOfSpace(max_num_keys, heap_space);
+      bytes[k] = heap_space;
+    } else {
+      fpr[k] = CuckooFalsePositiveRate(kTagBits[k], max_num_keys);
+      bytes[k] = num_buckets * 4.0 * kStoredBits[k] / 8;
+    }
+    if (fpr[k] < fpr[most_accurate]) most_accurate = k;
+    if (fpr[k] <= false_positive_rate && (best < 0 || bytes[k] < best_bytes)) {
+      best = k;
+      best_bytes = bytes[k];
+    }
+  }
+  if (best < 0) best = most_accurate;
+
+  FilterHandle *result = nullptr;
+  switch (best) {
+    case kSimdBlock:
+      result = new SimdBlockFilterHandle(heap_space);
+      break;
+    case kCuckoo8:
+      result = new CuckooFilterHandle<8, SingleTable>(max_num_keys, "Cuckoo8");
+      break;
+    case kCuckoo12:
+      result = new CuckooFilterHandle<12, SingleTable>(max_num_keys, "Cuckoo12");
+      break;
+    case kCuckoo16:
+      result = new CuckooFilterHandle<16, SingleTable>(max_num_keys, "Cuckoo16");
+      break;
+    case kSemiSort9:
+      result = new CuckooFilterHandle<9, PackedTable>(max_num_keys, "SemiSort9");
+      break;
+    case kSemiSort13:
+      result = new CuckooFilterHandle<13, PackedTable>(max_num_keys, "SemiSort13");
+      break;
+    case kSemiSort17:
+      result = new CuckooFilterHandle<17, PackedTable>(max_num_keys, "SemiSort17");
+      break;
+  }
+  return std::unique_ptr<FilterHandle>(result);
+}
+
+}  // namespace cuckoofilter
+
+#endif  // CUCKOO_FILTER_FILTER_HANDLE_H_
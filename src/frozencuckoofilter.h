@@ -0,0 +1,215 @@
+#ifndef CUCKOO_FILTER_FROZEN_CUCKOO_FILTER_H_
+#define CUCKOO_FILTER_FROZEN_CUCKOO_FILTER_H_
+
+#include <string.h>
+
+#include <algorithm>
+#include <type_traits>
+#include <vector>
+
+#include "binaryfusefilter.h"
+#include "cuckoofilter.h"
+
+namespace cuckoofilter {
+
+// A read-only copy of a CuckooFilter, made by CuckooFilter::Freeze(). Both of
+// an item's buckets are found from either one and its tag, so the smaller
+// bucket index and the tag name the item the same way whichever bucket it
+// landed in. The frozen filter is a BinaryFuseFilter of these (bucket, tag)
+// pairs, which needs no empty slots: it takes about 1.13 fingerprints of space
+// per item, where the table takes 1 / load factor tags.
+//
+// The fingerprints are packed, bits_per_item bits each, so below a load
+// factor of about 0.88 the frozen filter is smaller than the table. Above
+// it, and for filters of a few dozen items, where the BinaryFuseFilter has a
+// minimum size, it is somewhat larger: the width is never cut, so freezing
+// keeps the false positive rate. An item is found if its pair was stored,
+// which is as likely as a false positive in the table, or if the
+// fingerprints collide, so the false positive rate is higher by
+// 2^-bits_per_item. Lookups hash once more and read three slots that lie
+// close together in a smaller array, which is about as fast as a SingleTable
+// and much faster than a PackedTable.
+//
+// It takes the template parameters of the CuckooFilter it copies, save the
+// table type, allocator and stash size. Filters are movable but not copyable.
+template <typename ItemType, size_t bits_per_item,
+          typename HashFamily = TwoIndependentMultiplyShift,
+          size_t alt_window = 0>
+class FrozenCuckooFilter {
+  // the fingerprints the BinaryFuseFilter is built with, before they are
+  // packed
+  typedef typename std::conditional<
+      bits_per_item <= 8, uint8_t,
+      typename std::conditional<bits_per_item <= 16, uint16_t,
+                                uint32_t>::type>::type FingerprintType;
+
+  // a fingerprint is read as the 8 bytes from its first, which may run past
+  // the last one
+  static const size_t kPaddingBytes = 7;
+
+  // The pairs are hashed items already, and BinaryFuseFilter mixes them with
+  // its seed, so they are used as they are.
+  struct PairHash {
+    uint64_t operator()(uint64_t pair) const { return pair; }
+  };
+
+  // The seed and segments of the filter of pairs; its fingerprints are
+  // moved to packed_ and freed.
+  BinaryFuseFilter<uint64_t, FingerprintType, PairHash> pairs_;
+
+  // the low bits_per_item bits of each of its fingerprints, in order
+  std::vector<char> packed_;
+
+  static const uint32_t kFingerprintMask = (1ULL << bits_per_item) - 1;
+
+  // Number of items stored
+  size_t num_items_;
+
+  // the number of buckets of the table, to find the buckets of an item as it
+  // does
+  size_t num_buckets_;
+
+  // the buckets and tags of CuckooFilter; the stash size does not matter
+  typedef CuckooLayout<bits_per_item, 1, alt_window> Layout;
+
+  size_t AltIndex(const size_t index, const uint32_t tag) const {
+    return Layout::AltIndex(index, tag, num_buckets_);
+  }
+
+  HashFamily hasher_;
+
+  // fingerprint i of the filter of pairs
+  inline uint32_t ReadFingerprint(const size_t i) const {
+    const size_t pos = i * bits_per_item;
+    uint64_t v;
+    memcpy(&v, packed_.data() + (pos >> 3), sizeof(v));
+    return (v >> (pos & 7)) & kFingerprintMask;
+  }
+
+  inline void WriteFingerprint(const size_t i, const uint32_t f) {
+    const size_t pos = i * bits_per_item;
+    char *p = packed_.data() + (pos >> 3);
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    v |= static_cast<uint64_t>(f) << (pos & 7);
+    memcpy(p, &v, sizeof(v));
+  }
+
+  static uint64_t Pair(const size_t i1, const size_t i2, const uint32_t tag) {
+    return (static_cast<uint64_t>(std::min(i1, i2)) << bits_per_item) | tag;
+  }
+
+  template <template <size_t, typename> class TableType, typename Allocator,
+            size_t stash_size>
+  static std::vector<uint64_t> Pairs(
+      const CuckooFilter<ItemType, bits_per_item, TableType, HashFamily,
+                         Allocator, stash_size, alt_window> &filter);
+
+ public:
+  template <template <size_t, typename> class TableType, typename Allocator,
+            size_t stash_size>
+  explicit FrozenCuckooFilter(
+      const CuckooFilter<ItemType, bits_per_item, TableType, HashFamily,
+                         Allocator, stash_size, alt_window> &filter);
+
+  FrozenCuckooFilter(FrozenCuckooFilter &&) = default;
+  FrozenCuckooFilter &operator=(FrozenCuckooFilter &&) = default;
+  FrozenCuckooFilter(const FrozenCuckooFilter &) = delete;
+  FrozenCuckooFilter &operator=(const FrozenCuckooFilter &) = delete;
+
+  // Report if the item is inserted, with false positive rate.
+  Status Contain(const ItemType &item) const;
+
+  // number of items stored in the filter that was frozen
+  size_t Size() const { return num_items_; }
+
+  // size of the filter in bytes
+  size_t SizeInBytes() const { return packed_.size(); }
+};
+
+// The (bucket, tag) pairs of every stored tag, including the stashed ones.
+template <typename ItemType, size_t bits_per_item, typename HashFamily,
+          size_t alt_window>
+template <template <size_t, typename> class TableType, typename Allocator,
+          size_t stash_size>
+std::vector<uint64_t>
+FrozenCuckooFilter<ItemType, bits_per_item, HashFamily, alt_window>::Pairs(
+    const CuckooFilter<ItemType, bits_per_item, TableType, HashFamily,
+                       Allocator, stash_size, alt_window> &filter) {
+  std::vector<uint64_t> result;
+  result.reserve(filter.Size());
+  uint32_t tags[4];
+  for (size_t i = 0; i < filter.table_.NumBuckets(); i++) {
+    filter.table_.ReadBucket(i, tags);
+    for (size_t j = 0; j < 4; j++) {
+      if (tags[j] != 0) {
+        result.push_back(Pair(i, filter.AltIndex(i, tags[j]), tags[j]));
+      }
+    }
+  }
+  for (size_t j = 0; j < stash_size; j++) {
+    const size_t i = filter.stash_.index[j];
+    const uint32_t tag = filter.stash_.tag[j];
+    if (tag != 0) {
+      result.push_back(Pair(i, filter.AltIndex(i, tag), tag));
+    }
+  }
+  return result;
+}
+
+template <typename ItemType, size_t bits_per_item, typename HashFamily,
+          size_t alt_window>
+template <template <size_t, typename> class TableType, typename Allocator,
+          size_t stash_size>
+FrozenCuckooFilter<ItemType, bits_per_item, HashFamily,
+                   alt_window>::FrozenCuckooFilter(
+    const CuckooFilter<ItemType, bits_per_item, TableType, HashFamily,
+                       Allocator, stash_size, alt_window> &filter)
+    : pairs_(nullptr, 0),
+      packed_(),
+      num_items_(filter.Size()),
+      num_buckets_(filter.table_.NumBuckets()),
+      hasher_(filter.hasher_) {
+  const std::vector<uint64_t> pairs = Pairs(filter);
+  pairs_ = BinaryFuseFilter<uint64_t, FingerprintType, PairHash>(
+      pairs.data(), pairs.size());
+
+  // The fingerprints xor to the fingerprint of each pair bit by bit, so their
+  // low bits are a filter of the pairs too.
+  std::vector<FingerprintType> wide;
+  wide.swap(pairs_.fingerprints_);
+  packed_.assign((wide.size() * bits_per_item + 7) / 8 + kPaddingBytes, 0);
+  for (size_t i = 0; i < wide.size(); i++) {
+    WriteFingerprint(i, wide[i] & kFingerprintMask);
+  }
+}
+
+template <typename ItemType, size_t bits_per_item, typename HashFamily,
+          size_t alt_window>
+Status FrozenCuckooFilter<ItemType, bits_per_item, HashFamily,
+                          alt_window>::Contain(const ItemType &key) const {
+  // the same buckets and tag as CuckooFilter::GenerateIndexTagHash()
+  const uint64_t hash = hasher_(key);
+  const size_t i1 = Layout::IndexHash(hash >> 32, num_buckets_);
+  const uint32_t tag = Layout::TagHash(hash);
+  // BinaryFuseFilter::Contain(), on the packed fingerprints
+  const uint64_t pair_hash = pairs_.Hash(Pair(i1, AltIndex(i1, tag), tag));
+  const uint32_t f = pairs_.Fingerprint(pair_hash) ^
+                     ReadFingerprint(pairs_.Slot(0, pair_hash)) ^
+                     ReadFingerprint(pairs_.Slot(1, pair_hash)) ^
+                     ReadFingerprint(pairs_.Slot(2, pair_hash));
+  return (f & kFingerprintMask) == 0 ? Ok : NotFound;
+}
+
+template <typename ItemType, size_t bits_per_item,
+          template <size_t, typename> class TableType, typename HashFamily,
+          typename Allocator, size_t stash_size, size_t alt_window>
+FrozenCuckooFilter<ItemType, bits_per_item, HashFamily, alt_window>
+CuckooFilter<ItemType, bits_per_item, TableType, HashFamily, Allocator,
+             stash_size, alt_window>::Freeze() const {
+  return FrozenCuckooFilter<ItemType, bits_per_item, HashFamily, alt_window>(
+      *this);
+}
+
+}  // namespace cuckoofilter
+#endif  // CUCKOO_FILTER_FROZEN_CUCKOO_FILTER_H_
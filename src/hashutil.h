@@ -3,6 +3,7 @@
 
 #include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/types.h>
 
 #include <string>
@@ -61,9 +62,26 @@ class TwoIndependentMultiplyShift {
     }
   }
 
+  // The same seed gives the same hash function on every machine, so filters
+  // built apart can be combined.
+  explicit TwoIndependentMultiplyShift(uint64_t seed) {
+    ::std::mt19937_64 random(seed);
+    for (auto v : {&multiply_, &add_}) {
+      *v = random();
+      *v = (*v << 64) | random();
+    }
+  }
+
   uint64_t operator()(uint64_t key) const {
     return (add_ + multiply_ * static_cast<decltype(multiply_)>(key)) >> 64;
   }
+
+  bool operator==(const TwoIndependentMultiplyShift &that) const {
+    return multiply_ == that.multiply_ && add_ == that.add_;
+  }
+  bool operator!=(const TwoIndependentMultiplyShift &that) const {
+    return !(*this == that);
+  }
 };
 
 // See Patrascu and Thorup's "The Power of Simple Tabulation Hashing"
@@ -80,6 +98,15 @@ class SimpleTabulation {
     }
   }
 
+  explicit SimpleTabulation(uint64_t seed) {
+    ::std::mt19937_64 random(seed);
+    for (unsigned i = 0; i < sizeof(uint64_t); ++i) {
+      for (int j = 0; j < (1 << CHAR_BIT); ++j) {
+        tables_[i][j] = random();
+      }
+    }
+  }
+
   uint64_t operator()(uint64_t key) const {
     uint64_t result = 0;
     for (unsigned i = 0; i < sizeof(key); ++i) {
@@ -87,6 +114,13 @@ class SimpleTabulation {
     }
     return result;
   }
+
+  bool operator==(const SimpleTabulation &that) const {
+    return 0 == memcmp(tables_, that.tables_, sizeof(tables_));
+  }
+  bool operator!=(const SimpleTabulation &that) const {
+    return !(*this == that);
+  }
 };
 }
 
@@ -0,0 +1,365 @@
+#ifndef CUCKOO_FILTER_MORTON_TABLE_H_
+#define CUCKOO_FILTER_MORTON_TABLE_H_
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <memory>
+#include <sstream>
+#include <utility>
+
+#include "allocation.h"
+#include "debug.h"
+#include "printutil.h"
+
+namespace cuckoofilter {
+
+// A table of 64-byte blocks, after the Morton filter of Breslow and Jayasena.
+// A block holds a run of logical buckets as a 3-bit count of tags per bucket
+// and one array of tags packed end to end, bucket after bucket, so an empty
+// slot takes no space. There are twice as many logical buckets as a
+// SingleTable of the same capacity has, each holding up to 4 tags, and a block
+// has room for about 2.1 tags per bucket, so a bucket holds about half as many
+// tags and lookups match about half as many false positives. Every bucket lies
+// in one cache line.
+//
+// A tag fits in a bucket while the bucket has fewer than 4 tags and its block
+// has a free slot. A kick-out from a full bucket replaces one of its tags. A
+// kick-out from a bucket with room in a full block replaces a tag of any
+// bucket of the block, and InsertTagToBucket() sets its index argument to that
+// bucket, so the cuckoo path goes on from the bucket the kicked tag came from.
+// Otherwise items whose buckets are both empty buckets of full blocks could
+// never be placed.
+template <size_t bits_per_tag, typename Allocator = std::allocator<char>>
+class MortonTable {
+  static_assert(bits_per_tag >= 2 && bits_per_tag <= 32,
+                "tags must have 2 to 32 bits");
+
+  static const size_t kTagsPerBucket = 4;
+  static const size_t kBitsPerBlock = 512;
+  static const size_t kWordsPerBlock = kBitsPerBlock / 64;
+  static const size_t kBitsPerCount = 3;
+  // about 2.1 slots per bucket, less the bits of the counts
+  static const size_t kBucketsPerBlock =
+      10 * kBitsPerBlock / (10 * kBitsPerCount + 21 * bits_per_tag);
+  // the counts take the top of the block, the slots the bottom
+  static const size_t kCountsBit =
+      kBitsPerBlock - kBitsPerCount * kBucketsPerBlock;
+  static const size_t kSlotsPerBlock = kCountsBit / bits_per_tag;
+  static const size_t kSlotsBits = kSlotsPerBlock * bits_per_tag;
+  static const uint32_t kTagMask = (1ULL << bits_per_tag) - 1;
+
+  ByteStorage<Allocator> storage_;
+  // the first block, aligned to a cache line
+  uint64_t *blocks_;
+  size_t num_buckets_;
+
+  static size_t NumBlocks(const size_t num_buckets) {
+    return (num_buckets + kBucketsPerBlock - 1) / kBucketsPerBlock;
+  }
+
+  static uint64_t *AlignBlocks(char *data) {
+    return reinterpret_cast<uint64_t *>(
+        (reinterpret_cast<uintptr_t>(data) + 63) & ~static_cast<uintptr_t>(63));
+  }
+
+  // read len bits of block b starting at bit pos
+  static inline uint32_t GetBits(const uint64_t *b, const size_t pos,
+                                 const size_t len) {
+    const size_t w = pos / 64, off = pos % 64;
+    uint64_t v = b[w] >> off;
+    if (off + len > 64) {
+      v |= b[w + 1] << (64 - off);
+    }
+    return v & ((1ULL << len) - 1);
+  }
+
+  // Read the 64 bits of block b starting at bit pos, without branches. The
+  // bits past the end of the block are garbage, so callers mask them; they are
+  // not read from the next block, which would load a second cache line.
+  static inline uint64_t GetWord(const uint64_t *b, const size_t pos) {
+    const size_t w = pos / 64, off = pos % 64;
+    const size_t next = std::min(w + 1, kWordsPerBlock - 1);
+    return (b[w] >> off) | ((b[next] << 1) << (63 - off));
+  }
+
+  // write len bits of block b starting at bit pos
+  static inline void SetBits(uint64_t *b, const size_t pos, const size_t len,
+                             const uint32_t value) {
+    const size_t w = pos / 64, off = pos % 64;
+    const uint64_t mask = (1ULL << len) - 1;
+    b[w] = (b[w] & ~(mask << off)) | (static_cast<uint64_t>(value) << off);
+    if (off + len > 64) {
+      b[w + 1] = (b[w + 1] & ~(mask >> (64 - off))) |
+                 (static_cast<uint64_t>(value) >> (64 - off));
+    }
+  }
+
+  // the bits of word w of a block that lie in [lo, hi)
+  static inline uint64_t WordMask(const size_t w, const size_t lo,
+                                  const size_t hi) {
+    const size_t a = std::max(lo, 64 * w), e = std::min(hi, 64 * w + 64);
+    if (a >= e) return 0;
+    return (e - a == 64 ? ~0ULL : ((1ULL << (e - a)) - 1)) << (a - 64 * w);
+  }
+
+  // Move the slots from bit pos on one slot up, or one slot down if up is
+  // false, leaving the counts alone. Moving up drops the top slot, which must
+  // be free; moving down clears it.
+  static inline void ShiftSlots(uint64_t *b, const size_t pos, const bool up) {
+    uint64_t shifted[kWordsPerBlock];
+    for (size_t w = 0; w < kWordsPerBlock; w++) {
+      if (up) {
+        shifted[w] = (b[w] << bits_per_tag) |
+                     (w > 0 ? b[w - 1] >> (64 - bits_per_tag) : 0);
+      } else {
+        shifted[w] = (b[w] >> bits_per_tag) |
+                     (w + 1 < kWordsPerBlock ? b[w + 1] << (64 - bits_per_tag)
+                                             : 0);
+      }
+    }
+    const size_t end = up ? kSlotsBits : kSlotsBits - bits_per_tag;
+    for (size_t w = 0; w < kWordsPerBlock; w++) {
+      const uint64_t moved = WordMask(w, pos, end);
+      b[w] = (b[w] & ~moved) | (shifted[w] & moved);
+    }
+    if (!up) {
+      SetBits(b, end, bits_per_tag, 0);
+    }
+  }
+
+  inline uint64_t *Block(const size_t i) const {
+    return blocks_ + (i / kBucketsPerBlock) * kWordsPerBlock;
+  }
+
+  static inline size_t Count(const uint64_t *b, const size_t j) {
+    return GetWord(b, kCountsBit + kBitsPerCount * j) & 7;
+  }
+
+  static inline void SetCount(uint64_t *b, const size_t j, const size_t count) {
+    SetBits(b, kCountsBit + kBitsPerCount * j, kBitsPerCount, count);
+  }
+
+  // the sum of the 3-bit counts in the low 63 bits of v
+  static inline size_t SumFields(uint64_t v) {
+    // add pairs of counts into 6-bit sums, then pairs of those into 12-bit
+    // ones, which a multiplication adds up in bits 48 to 59, but for the last
+    v = (v & 0x71c71c71c71c71c7ULL) + ((v >> 3) & 0x71c71c71c71c71c7ULL);
+    v = (v & 0xf03f03f03f03f03fULL) + ((v >> 6) & 0xf03f03f03f03f03fULL);
+    return (((v * 0x1001001001001ULL) >> 48) & 0xfff) + (v >> 60);
+  }
+
+  // the sum of the first n counts of block b, 21 counts to a word
+  static inline size_t SumCounts(const uint64_t *b, const size_t n) {
+    size_t sum = 0;
+    for (size_t j = 0; j < kBucketsPerBlock; j += 21) {
+      const size_t fields = n < j ? 0 : std::min<size_t>(n - j, 21);
+      const uint64_t v = GetWord(b, kCountsBit + kBitsPerCount * j);
+      sum += SumFields(v & ((1ULL << (kBitsPerCount * fields)) - 1));
+    }
+    return sum;
+  }
+
+  // the first slot of bucket j of block b and its number of tags
+  static inline void Locate(const uint64_t *b, const size_t j, size_t *start,
+                            size_t *count) {
+    if (kBucketsPerBlock <= 21) {
+      // one word holds all the counts
+      const uint64_t v = GetWord(b, kCountsBit);
+      *start = SumFields(v & ((1ULL << (kBitsPerCount * j)) - 1));
+      *count = (v >> (kBitsPerCount * j)) & 7;
+    } else {
+      *start = SumCounts(b, j);
+      *count = Count(b, j);
+    }
+  }
+
+  // the bucket of block b that slot s is in
+  static inline size_t BucketOfSlot(const uint64_t *b, const size_t s) {
+    size_t j = 0;
+    for (size_t sum = Count(b, 0); sum <= s; sum += Count(b, j)) {
+      j++;
+    }
+    return j;
+  }
+
+ public:
+  // A table asked for num buckets of 4 slots has 2 * num logical buckets, and
+  // about as many slots.
+  static const size_t kBucketMultiple = 2;
+
+  explicit MortonTable(const size_t num,
+                       const Allocator &allocator = Allocator())
+      : storage_(StorageBytes(num), allocator),
+        blocks_(AlignBlocks(storage_.data())),
+        num_buckets_(kBucketMultiple * num) {}
+
+  MortonTable(MortonTable &&that) noexcept
+      : storage_(std::move(that.storage_)),
+        blocks_(that.blocks_),
+        num_buckets_(that.num_buckets_) {
+    that.blocks_ = nullptr;
+    that.num_buckets_ = 0;
+  }
+
+  MortonTable &operator=(MortonTable &&that) noexcept {
+    storage_ = std::move(that.storage_);
+    std::swap(blocks_, that.blocks_);
+    std::swap(num_buckets_, that.num_buckets_);
+    return *this;
+  }
+
+  MortonTable(const MortonTable &) = delete;
+  MortonTable &operator=(const MortonTable &) = delete;
+
+  // bytes requested from the allocator for a table asked for num buckets,
+  // with room to align the blocks
+  static size_t StorageBytes(const size_t num) {
+    return kBitsPerBlock / 8 * (NumBlocks(2 * num) + 1);
+  }
+
+  // the allocator the storage came from
+  Allocator get_allocator() const { return storage_.get_allocator(); }
+
+  // Zero up to bytes bytes of the storage from byte begin on, and return the
+  // byte after the last one zeroed. Once every byte has been zeroed, over
+  // any number of calls, the table is empty.
+  size_t ClearStorage(const size_t begin, const size_t bytes) {
+    if (begin >= storage_.size()) return begin;
+    const size_t n = bytes < storage_.size() - begin ? bytes
+                                                     : storage_.size() - begin;
+    memset(storage_.data() + begin, 0, n);
+    return begin + n;
+  }
+
+  size_t NumBuckets() const {
+    return num_buckets_;
+  }
+
+  size_t SizeInBytes() const {
+    return kBitsPerBlock / 8 * NumBlocks(num_buckets_);
+  }
+
+  size_t SizeInTags() const {
+    return kSlotsPerBlock * NumBlocks(num_buckets_);
+  }
+
+  std::string Info() const {
+    std::stringstream ss;
+    ss << "MortonHashtable with tag size: " << bits_per_tag << " bits \n";
+    ss << "\t\tAssociativity: " << kTagsPerBucket << "\n";
+    ss << "\t\tBuckets per block: " << kBucketsPerBlock << "\n";
+    ss << "\t\tSlots per block: " << kSlotsPerBlock << "\n";
+    ss << "\t\tTotal # of rows: " << num_buckets_ << "\n";
+    ss << "\t\tTotal # slots: " << SizeInTags() << "\n";
+    return ss.str();
+  }
+
+  // start loading bucket i into the cache, for writing if rw is 1
+  template <int rw>
+  inline void PrefetchBucket(const size_t i) const {
+    __builtin_prefetch(Block(i), rw);
+  }
+
+  // read the tags of bucket i, 0 for an empty slot
+  inline void ReadBucket(const size_t i, uint32_t tags[kTagsPerBucket]) const {
+    const uint64_t *b = Block(i);
+    size_t start, count;
+    Locate(b, i % kBucketsPerBlock, &start, &count);
+    for (size_t j = 0; j < kTagsPerBucket; j++) {
+      tags[j] =
+          j < count ? GetBits(b, (start + j) * bits_per_tag, bits_per_tag) : 0;
+    }
+  }
+
+  inline bool FindTagInBucket(const size_t i, const uint32_t tag) const {
+    const uint64_t *b = Block(i);
+    size_t start, count;
+    Locate(b, i % kBucketsPerBlock, &start, &count);
+    if (kTagsPerBucket * bits_per_tag <= 64) {
+      // compare the whole bucket at once, as hasvalue8() and the like do, with
+      // the fields past its tags set so they cannot match
+      uint64_t low = 0;
+      for (size_t j = 0; j < kTagsPerBucket; j++) {
+        low |= 1ULL << (j * bits_per_tag);
+      }
+      const uint64_t high = low << (bits_per_tag - 1);
+      // in two shifts, as a full bucket of 16-bit tags shifts by 64
+      const size_t used = count * bits_per_tag;
+      const uint64_t unused = (~0ULL << (used / 2)) << (used - used / 2);
+      const uint64_t v = (GetWord(b, start * bits_per_tag) ^ (low * tag)) |
+                         unused;
+      return ((v - low) & ~v & high) != 0;
+    }
+    for (size_t j = start; j < start + count; j++) {
+      if (GetBits(b, j * bits_per_tag, bits_per_tag) == tag) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  inline bool FindTagInBuckets(const size_t i1, const size_t i2,
+                               const uint32_t tag) const {
+    // both are looked at, so the two blocks load at once
+    return FindTagInBucket(i1, tag) | FindTagInBucket(i2, tag);
+  }
+
+  inline bool DeleteTagFromBucket(const size_t i, const uint32_t tag) {
+    uint64_t *b = Block(i);
+    const size_t bucket = i % kBucketsPerBlock;
+    size_t start, count;
+    Locate(b, bucket, &start, &count);
+    for (size_t j = start; j < start + count; j++) {
+      if (GetBits(b, j * bits_per_tag, bits_per_tag) == tag) {
+        ShiftSlots(b, j * bits_per_tag, false);
+        SetCount(b, bucket, count - 1);
+        return true;
+      }
+    }
+    return false;
+  }
+
+  // i is a reference: see the note on kick-outs above
+  inline bool InsertTagToBucket(size_t &i, const uint32_t tag,
+                                const bool kickout, uint32_t &oldtag) {
+    uint64_t *b = Block(i);
+    const size_t bucket = i % kBucketsPerBlock;
+    size_t start, count;
+    Locate(b, bucket, &start, &count);
+    if (count < kTagsPerBucket &&
+        SumCounts(b, kBucketsPerBlock) < kSlotsPerBlock) {
+      const size_t pos = (start + count) * bits_per_tag;
+      ShiftSlots(b, pos, true);
+      SetBits(b, pos, bits_per_tag, tag & kTagMask);
+      SetCount(b, bucket, count + 1);
+      return true;
+    }
+    if (kickout) {
+      if (count == kTagsPerBucket) {
+        const size_t pos = (start + rand() % count) * bits_per_tag;
+        oldtag = GetBits(b, pos, bits_per_tag);
+        SetBits(b, pos, bits_per_tag, tag & kTagMask);
+      } else {
+        // the block is full: free a slot of any bucket, then insert
+        const size_t slot = rand() % kSlotsPerBlock;
+        const size_t victim = BucketOfSlot(b, slot);
+        oldtag = GetBits(b, slot * bits_per_tag, bits_per_tag);
+        ShiftSlots(b, slot * bits_per_tag, false);
+        SetCount(b, victim, Count(b, victim) - 1);
+        uint32_t unused;
+        InsertTagToBucket(i, tag, false, unused);
+        i += victim - bucket;
+      }
+    }
+    return false;
+  }
+
+  inline size_t NumTagsInBucket(const size_t i) const {
+    return Count(Block(i), i % kBucketsPerBlock);
+  }
+};
+}  // namespace cuckoofilter
+#endif  // CUCKOO_FILTER_MORTON_TABLE_H_
@@ -1,9 +1,13 @@
 #ifndef CUCKOO_FILTER_PACKED_TABLE_H_
 #define CUCKOO_FILTER_PACKED_TABLE_H_
 
+#include <string.h>
+
+#include <memory>
 #include <sstream>
 #include <utility>
 
+#include "allocation.h"
 #include "debug.h"
 #include "permencoding.h"
 #include "printutil.h"
@@ -11,30 +15,79 @@
 namespace cuckoofilter {
 
 // Using Permutation encoding to save 1 bit per tag
-template <size_t bits_per_tag>
+template <size_t bits_per_tag, typename Allocator = std::allocator<char>>
 class PackedTable {
   static const size_t kDirBitsPerTag = bits_per_tag - 4;
   static const size_t kBitsPerBucket = (3 + kDirBitsPerTag) * 4;
   static const size_t kBytesPerBucket = (kBitsPerBucket + 7) >> 3;
   static const uint32_t kDirBitsMask = ((1ULL << kDirBitsPerTag) - 1) << 4;
 
+  ByteStorage<Allocator> storage_;
   // using a pointer adds one more indirection
   size_t len_;
   size_t num_buckets_;
   char *buckets_;
-  PermEncoding perm_;
+  // the encoding tables are large and identical for every table, so they are
+  // shared rather than rebuilt per instance
+  const PermEncoding *perm_;
+
+  static const PermEncoding &SharedPermEncoding() {
+    static const PermEncoding perm;
+    return perm;
+  }
 
  public:
-  explicit PackedTable(size_t num) : num_buckets_(num) {
+  // NumBuckets() is this many times the buckets the table is asked for
+  static const size_t kBucketMultiple = 1;
+
+  explicit PackedTable(size_t num, const Allocator &allocator = Allocator())
+      : storage_(StorageBytes(num), allocator),
+        len_(StorageBytes(num)),
+        num_buckets_(num),
+        buckets_(storage_.data()),
+        perm_(&SharedPermEncoding()) {}
+
+  PackedTable(PackedTable &&that) noexcept
+      : storage_(std::move(that.storage_)),
+        len_(that.len_),
+        num_buckets_(that.num_buckets_),
+        buckets_(that.buckets_),
+        perm_(that.perm_) {
+    that.len_ = 0;
+    that.num_buckets_ = 0;
+    that.buckets_ = nullptr;
+  }
+
+  PackedTable &operator=(PackedTable &&that) noexcept {
+    storage_ = std::move(that.storage_);
+    std::swap(len_, that.len_);
+    std::swap(num_buckets_, that.num_buckets_);
+    std::swap(buckets_, that.buckets_);
+    return *this;
+  }
+
+  PackedTable(const PackedTable &) = delete;
+  PackedTable &operator=(const PackedTable &) = delete;
+
+  // bytes requested from the allocator for a table of num buckets
+  static size_t StorageBytes(const size_t num) {
     // NOTE(binfan): use 7 extra bytes to avoid overrun as we
     // always read a uint64
-    len_ = kBytesPerBucket * num_buckets_ + 7;
-    buckets_ = new char[len_];
-    memset(buckets_, 0, len_); 
+    return kBytesPerBucket * num + 7;
   }
 
-  ~PackedTable() { 
-    delete[] buckets_; 
+  // the allocator the storage came from
+  Allocator get_allocator() const { return storage_.get_allocator(); }
+
+  // Zero up to bytes bytes of the storage from byte begin on, and return the
+  // byte after the last one zeroed. Once every byte has been zeroed, over
+  // any number of calls, the table is empty.
+  size_t ClearStorage(const size_t begin, const size_t bytes) {
+    if (begin >= storage_.size()) return begin;
+    const size_t n = bytes < storage_.size() - begin ? bytes
+                                                     : storage_.size() - begin;
+    memset(storage_.data() + begin, 0, n);
+    return begin + n;
   }
 
   size_t NumBuckets() const {
@@ -82,7 +135,7 @@ class PackedTable {
       lowbits[j] = tags[j] & 0x0f;
       dirbits[j] = (tags[j] & kDirBitsMask) >> 4;
     }
-    uint16_t codeword = perm_.encode(lowbits);
+    uint16_t codeword = perm_->encode(lowbits);
     std::cout << "\tcodeword  ="
               << PrintUtil::bytes_to_hex((char *)&codeword, 2) << std::endl;
     for (size_t j = 0; j < 4; j++) {
@@ -112,6 +165,12 @@ class PackedTable {
     SortPair(tags[1], tags[2]);
   }
 
+  // start loading bucket i into the cache, for writing if rw is 1
+  template <int rw>
+  inline void PrefetchBucket(const size_t i) const {
+    __builtin_prefetch(buckets_ + ((kBitsPerBucket * i) >> 3), rw);
+  }
+
   /* read and decode the bucket i, pass the 4 decoded tags to the 2nd arg
    * bucket bits = 12 codeword bits + dir bits of tag1 + dir bits of tag2 ...
    */
@@ -189,7 +248,7 @@ class PackedTable {
     }
 
     /* codeword is the lowest 12 bits in the bucket */
-    uint16_t v = perm_.dec_table[codeword];
+    uint16_t v = perm_->dec_table[codeword];
     lowbits[0] = (v & 0x000f);
     lowbits[2] = ((v >> 4) & 0x000f);
     lowbits[1] = ((v >> 8) & 0x000f);
@@ -237,7 +296,7 @@ class PackedTable {
 
     // note that :  tags[j] = lowbits[j] | highbits[j]
 
-    uint16_t codeword = perm_.encode(lowbits);
+    uint16_t codeword = perm_->encode(lowbits);
     DPRINTF(DEBUG_TABLE, "codeword=%s\n",
             PrintUtil::bytes_to_hex((char *)&codeword, 2).c_str());
 
@@ -309,7 +368,6 @@ class PackedTable {
 
   bool FindTagInBuckets(const size_t i1, const size_t i2,
                         const uint32_t tag) const {
-    //            DPRINTF(DEBUG_TABLE, "PackedTable::FindTagInBucket %zu\n", i);
     uint32_t tags1[4];
     uint32_t tags2[4];
 
@@ -317,33 +375,10 @@ class PackedTable {
     // _mm_prefetch( buckets_ + (i1 * kBitsPerBucket) / 8,  _MM_HINT_NTA);
     // _mm_prefetch( buckets_ + (i2 * kBitsPerBucket) / 8,  _MM_HINT_NTA);
 
-    // ReadBucket(i1, tags1);
-    // ReadBucket(i2, tags2);
-
-    uint16_t v;
-    uint64_t bucketbits1 = *((uint64_t *)(buckets_ + kBitsPerBucket * i1 / 8));
-    uint64_t bucketbits2 = *((uint64_t *)(buckets_ + kBitsPerBucket * i2 / 8));
-
-    tags1[0] = (bucketbits1 >> 8) & kDirBitsMask;
-    tags1[1] = (bucketbits1 >> 17) & kDirBitsMask;
-    tags1[2] = (bucketbits1 >> 26) & kDirBitsMask;
-    tags1[3] = (bucketbits1 >> 35) & kDirBitsMask;
-    v = perm_.dec_table[(bucketbits1)&0x0fff];
-    // the order 0 2 1 3 is not a bug
-    tags1[0] |= (v & 0x000f);
-    tags1[2] |= ((v >> 4) & 0x000f);
-    tags1[1] |= ((v >> 8) & 0x000f);
-    tags1[3] |= ((v >> 12) & 0x000f);
-
-    tags2[0] = (bucketbits2 >> 8) & kDirBitsMask;
-    tags2[1] = (bucketbits2 >> 17) & kDirBitsMask;
-    tags2[2] = (bucketbits2 >> 26) & kDirBitsMask;
-    tags2[3] = (bucketbits2 >> 35) & kDirBitsMask;
-    v = perm_.dec_table[(bucketbits2)&0x0fff];
-    tags2[0] |= (v & 0x000f);
-    tags2[2] |= ((v >> 4) & 0x000f);
-    tags2[1] |= ((v >> 8) & 0x000f);
-    tags2[3] |= ((v >> 12) & 0x000f);
+    // NOTE: the bucket layout depends on bits_per_tag, so decode through
+    // ReadBucket rather than assuming the 13-bit layout.
+    ReadBucket(i1, tags1);
+    ReadBucket(i2, tags2);
 
     return (tags1[0] == tag) || (tags1[1] == tag) || (tags1[2] == tag) ||
            (tags1[3] == tag) || (tags2[0] == tag) || (tags2[1] == tag) ||
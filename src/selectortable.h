@@ -0,0 +1,183 @@
+#ifndef CUCKOO_FILTER_SELECTOR_TABLE_H_
+#define CUCKOO_FILTER_SELECTOR_TABLE_H_
+
+#include <string.h>
+
+#include <memory>
+#include <sstream>
+#include <utility>
+
+#include "allocation.h"
+#include "debug.h"
+
+namespace cuckoofilter {
+
+// A table like SingleTable with a selector of selector_bits bits in each
+// bucket, after its four tags, that records which of several fingerprint
+// hashes made the tags of the bucket. A lookup compares each bucket with the
+// tag its item has for that bucket's selector. Buckets are packed into as few
+// bytes as they fit in. A tag of 0 marks an empty slot; a fresh table has
+// every selector at 0.
+template <size_t bits_per_tag, size_t selector_bits,
+          typename Allocator = std::allocator<char>>
+class SelectorTable {
+  static_assert(bits_per_tag >= 2 && bits_per_tag <= 32,
+                "tags are 2 to 32 bits");
+  static_assert(selector_bits >= 1 && selector_bits <= 2,
+                "a bucket has one or two selector bits");
+
+ public:
+  static const size_t kNumSelectors = 1 << selector_bits;
+
+ private:
+  static const size_t kTagsPerBucket = 4;
+  static const size_t kBitsPerBucket =
+      bits_per_tag * kTagsPerBucket + selector_bits;
+  static const size_t kBytesPerBucket = (kBitsPerBucket + 7) >> 3;
+  static const uint32_t kTagMask = (1ULL << bits_per_tag) - 1;
+  // a field is read as the 8 bytes from its first, which may run past the
+  // last bucket
+  static const size_t kPaddingBytes = 7;
+
+  ByteStorage<Allocator> storage_;
+  char *buckets_;
+  size_t num_buckets_;
+
+  // the kBits bits from bit pos of bucket i
+  template <size_t kBits>
+  inline uint32_t ReadBits(const size_t i, const size_t pos) const {
+    uint64_t v;
+    memcpy(&v, buckets_ + i * kBytesPerBucket + (pos >> 3), sizeof(v));
+    return (v >> (pos & 7)) & ((1ULL << kBits) - 1);
+  }
+
+  template <size_t kBits>
+  inline void WriteBits(const size_t i, const size_t pos, const uint32_t x) {
+    char *p = buckets_ + i * kBytesPerBucket + (pos >> 3);
+    const uint64_t mask = ((1ULL << kBits) - 1) << (pos & 7);
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    v = (v & ~mask) | (static_cast<uint64_t>(x) << (pos & 7));
+    memcpy(p, &v, sizeof(v));
+  }
+
+  // bit 0 of each tag of a bucket that fits in a word
+  static const uint64_t kTagOnes =
+      kBitsPerBucket > 64 ? 0
+                          : 1 | (1ULL << (bits_per_tag % 64)) |
+                                (1ULL << (2 * bits_per_tag % 64)) |
+                                (1ULL << (3 * bits_per_tag % 64));
+
+  // For a bucket read into v, whether one of its tags is the tag spread
+  // through the word, as kTagOnes * tag. This is haszero() of bitsutil.h: a
+  // borrow only crosses into the next tag from one that is zero, so the
+  // answer is exact, and the bits above the four tags are ignored.
+  static inline bool HasTag(const uint64_t v, const uint64_t spread) {
+    const uint64_t diff = v ^ spread;
+    return ((diff - kTagOnes) & ~diff & (kTagOnes << (bits_per_tag - 1))) !=
+           0;
+  }
+
+  // tags[s] for the selector s of a bucket read into v, in a form the
+  // compiler turns into conditional moves
+  static inline uint32_t Select(const uint64_t v, const uint32_t *tags) {
+    const uint64_t s =
+        (v >> (kTagsPerBucket * bits_per_tag % 64)) & (kNumSelectors - 1);
+    uint32_t tag = tags[0];
+    for (size_t k = 1; k < kNumSelectors; k++) {
+      tag = s == k ? tags[k] : tag;
+    }
+    return tag;
+  }
+
+ public:
+  explicit SelectorTable(const size_t num,
+                         const Allocator &allocator = Allocator())
+      : storage_(StorageBytes(num), allocator),
+        buckets_(storage_.data()),
+        num_buckets_(num) {}
+
+  SelectorTable(SelectorTable &&that) noexcept
+      : storage_(std::move(that.storage_)),
+        buckets_(that.buckets_),
+        num_buckets_(that.num_buckets_) {
+    that.buckets_ = nullptr;
+    that.num_buckets_ = 0;
+  }
+
+  SelectorTable &operator=(SelectorTable &&that) noexcept {
+    storage_ = std::move(that.storage_);
+    std::swap(buckets_, that.buckets_);
+    std::swap(num_buckets_, that.num_buckets_);
+    return *this;
+  }
+
+  SelectorTable(const SelectorTable &) = delete;
+  SelectorTable &operator=(const SelectorTable &) = delete;
+
+  // bytes requested from the allocator for a table of num buckets
+  static size_t StorageBytes(const size_t num) {
+    return kBytesPerBucket * num + kPaddingBytes;
+  }
+
+  size_t NumBuckets() const { return num_buckets_; }
+
+  size_t SizeInBytes() const { return kBytesPerBucket * num_buckets_; }
+
+  size_t SizeInTags() const { return kTagsPerBucket * num_buckets_; }
+
+  std::string Info() const {
+    std::stringstream ss;
+    ss << "SelectorTable with tag size: " << bits_per_tag << " bits \n";
+    ss << "\t\tAssociativity: " << kTagsPerBucket << "\n";
+    ss << "\t\tTotal # of rows: " << num_buckets_ << "\n";
+    ss << "\t\tTotal # slots: " << SizeInTags() << "\n";
+    return ss.str();
+  }
+
+  // start loading bucket i into the cache, for writing if rw is 1
+  template <int rw>
+  inline void PrefetchBucket(const size_t i) const {
+    __builtin_prefetch(buckets_ + i * kBytesPerBucket, rw);
+  }
+
+  // read tag from pos(i,j)
+  inline uint32_t ReadTag(const size_t i, const size_t j) const {
+    return ReadBits<bits_per_tag>(i, j * bits_per_tag);
+  }
+
+  // write tag to pos(i,j)
+  inline void WriteTag(const size_t i, const size_t j, const uint32_t t) {
+    WriteBits<bits_per_tag>(i, j * bits_per_tag, t & kTagMask);
+  }
+
+  inline uint32_t ReadSelector(const size_t i) const {
+    return ReadBits<selector_bits>(i, kTagsPerBucket * bits_per_tag);
+  }
+
+  inline void WriteSelector(const size_t i, const uint32_t selector) {
+    WriteBits<selector_bits>(i, kTagsPerBucket * bits_per_tag, selector);
+  }
+
+  // Whether bucket i1 holds tags[s] for its selector s, or bucket i2 for
+  // its own. tags has kNumSelectors entries.
+  inline bool FindTagInBuckets(const size_t i1, const size_t i2,
+                               const uint32_t *tags) const {
+    if (kBitsPerBucket <= 64) {
+      uint64_t v1, v2;
+      memcpy(&v1, buckets_ + i1 * kBytesPerBucket, sizeof(v1));
+      memcpy(&v2, buckets_ + i2 * kBytesPerBucket, sizeof(v2));
+      return HasTag(v1, kTagOnes * Select(v1, tags)) |
+             HasTag(v2, kTagOnes * Select(v2, tags));
+    }
+    const uint32_t t1 = tags[ReadSelector(i1)];
+    const uint32_t t2 = tags[ReadSelector(i2)];
+    bool found = false;
+    for (size_t j = 0; j < kTagsPerBucket; j++) {
+      found |= (ReadTag(i1, j) == t1) | (ReadTag(i2, j) == t2);
+    }
+    return found;
+  }
+};
+}  // namespace cuckoofilter
+#endif  // CUCKOO_FILTER_SELECTOR_TABLE_H_
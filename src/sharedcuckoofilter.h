@@ -0,0 +1,362 @@
+#ifndef CUCKOO_FILTER_SHARED_CUCKOO_FILTER_H_
+#define CUCKOO_FILTER_SHARED_CUCKOO_FILTER_H_
+
+#include <fcntl.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <cerrno>
+#include <new>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <type_traits>
+
+#include "cuckoofilter.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+namespace cuckoofilter {
+
+// An allocator that hands out one fixed region of a mapped segment. The
+// region is named by its offset from the segment start, so the same allocator
+// state is meaningful in every process that maps the segment.
+template <typename T>
+class SegmentAllocator {
+ public:
+  typedef T value_type;
+
+  SegmentAllocator(char *base, size_t offset, size_t size)
+      : base_(base), offset_(offset), size_(size) {}
+
+  template <typename U>
+  SegmentAllocator(const SegmentAllocator<U> &that)
+      : base_(that.base_), offset_(that.offset_), size_(that.size_) {}
+
+  T *allocate(size_t n) {
+    if (n * sizeof(T) > size_) throw std::bad_alloc();
+    return reinterpret_cast<T *>(base_ + offset_);
+  }
+
+  // the segment outlives the filter; unmapping releases it
+  void deallocate(T *, size_t) {}
+
+  bool operator==(const SegmentAllocator &that) const {
+    return base_ == that.base_ && offset_ == that.offset_;
+  }
+  bool operator!=(const SegmentAllocator &that) const {
+    return !(*this == that);
+  }
+
+ private:
+  template <typename>
+  friend class SegmentAllocator;
+
+  char *base_;
+  size_t offset_;
+  size_t size_;
+};
+
+// A new segment is zero-filled by ftruncate(), and an attached segment already
+// holds a table, so the table must not clear it either way.
+template <typename T>
+struct AllocatorZeroesMemory<SegmentAllocator<T>> : std::true_type {};
+
+// A cuckoo filter whose table and metadata (item count, stash and hash
+// parameters) live in a POSIX shared-memory segment, so many processes can
+// share one copy. The segment holds a header followed by the table and
+// contains no pointers.
+//
+// The process that creates the segment is its only writer. Any number of
+// processes may attach read-only and query concurrently with the writer: each
+// update is bracketed by a sequence counter in the header, and a reader
+// retries a lookup that overlapped an update (a seqlock). A reader spins
+// briefly, then yields between retries, and gives up with Busy if the writer
+// is still updating after many of them, as it would forever if it died
+// mid-update. Calls on the writer's side must come from one thread at a time.
+//
+// The header, hash parameters included, must fit in the kTableOffset bytes
+// before the table. That rules out hash families with large state, such as
+// SimpleTabulation and its 16 KiB of tables.
+template <typename ItemType, size_t bits_per_item,
+          template <size_t, typename> class TableType = SingleTable,
+          typename HashFamily = TwoIndependentMultiplyShift>
+class SharedCuckooFilter {
+  typedef CuckooFilter<ItemType, bits_per_item, TableType, HashFamily,
+                       SegmentAllocator<char>>
+      Filter;
+  typedef typename Filter::Stash Stash;
+
+  static_assert(std::is_trivially_copyable<HashFamily>::value,
+                "the hash family is stored in shared memory");
+
+  static const uint64_t kMagic = 0x43554b4f4f534846ULL;  // "FHSOOKUC"
+  static const uint32_t kVersion = 3;
+  static const size_t kTableOffset = 4096;
+  // A reader spins this many times before yielding its CPU to the writer, and
+  // gives up after this many retries in all: most of a second of yields on an
+  // idle machine, longer on a busy one.
+  static const size_t kSpinRetries = 64;
+  static const size_t kMaxRetries = 1 << 23;
+
+  struct Header {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t bits_per_tag;
+    uint64_t max_num_keys;
+    uint64_t table_offset;
+    uint64_t table_bytes;
+    // odd while the writer is updating the filter
+    std::atomic<uint64_t> sequence;
+    uint64_t num_items;
+    Stash stash;
+    HashFamily hasher;
+  };
+
+  static_assert(sizeof(Header) <= kTableOffset, "header overlaps the table");
+
+  // The mapping is set up before, and torn down after, the filter that uses it.
+  class Segment {
+    char *base_;
+    size_t size_;
+    // the name of a segment this process created, unlinked on destruction
+    // unless Keep() was called, so a filter that fails to construct leaves no
+    // segment behind
+    std::string created_;
+
+   public:
+    Segment(const std::string &name, const size_t max_num_keys)
+        : base_(), size_(), created_() {
+      size_ = kTableOffset +
+              TableType<bits_per_item, SegmentAllocator<char>>::StorageBytes(
+                  Filter::NumBucketsFor(max_num_keys));
+      int fd = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0644);
+      if (fd < 0) {
+        throw std::system_error(errno, std::generic_category(), "shm_open");
+      }
+      if (ftruncate(fd, size_) != 0) {
+        int err = errno;
+        close(fd);
+        shm_unlink(name.c_str());
+        throw std::system_error(err, std::generic_category(), "ftruncate");
+      }
+      try {
+        Map(fd, PROT_READ | PROT_WRITE);
+      } catch (...) {
+        shm_unlink(name.c_str());
+        throw;
+      }
+      created_ = name;
+      Header *header = new (base_) Header();
+      header->magic = kMagic;
+      header->version = kVersion;
+      header->bits_per_tag = bits_per_item;
+      header->max_num_keys = max_num_keys;
+      header->table_offset = kTableOffset;
+      header->table_bytes = size_ - kTableOffset;
+      header->sequence.store(0, std::memory_order_relaxed);
+      header->num_items = 0;
+      header->stash = Stash();
+    }
+
+    explicit Segment(const std::string &name)
+        : base_(), size_(), created_() {
+      int fd = shm_open(name.c_str(), O_RDONLY, 0);
+      if (fd < 0) {
+        throw std::system_error(errno, std::generic_category(), "shm_open");
+      }
+      struct stat st;
+      if (fstat(fd, &st) != 0) {
+        int err = errno;
+        close(fd);
+        throw std::system_error(err, std::generic_category(), "fstat");
+      }
+      size_ = st.st_size;
+      if (size_ < kTableOffset) {
+        close(fd);
+        throw std::runtime_error("shared filter segment is truncated");
+      }
+      Map(fd, PROT_READ);
+      const Header *header = this->header();
+      if (header->magic != kMagic || header->version != kVersion ||
+          header->bits_per_tag != bits_per_item ||
+          header->table_offset != kTableOffset ||
+          header->table_offset + header->table_bytes != size_) {
+        munmap(base_, size_);
+        throw std::runtime_error(
+            "shared filter segment has a different layout");
+      }
+    }
+
+    ~Segment() {
+      munmap(base_, size_);
+      if (!created_.empty()) shm_unlink(created_.c_str());
+    }
+
+    void Keep() { created_.clear(); }
+
+    Header *header() const { return reinterpret_cast<Header *>(base_); }
+
+    SegmentAllocator<char> allocator() const {
+      return SegmentAllocator<char>(base_, header()->table_offset,
+                                    header()->table_bytes);
+    }
+
+   private:
+    void Map(int fd, int prot) {
+      void *p = mmap(nullptr, size_, prot, MAP_SHARED, fd, 0);
+      int err = errno;
+      close(fd);
+      if (p == MAP_FAILED) {
+        throw std::system_error(err, std::generic_category(), "mmap");
+      }
+      base_ = static_cast<char *>(p);
+    }
+
+    Segment(const Segment &) = delete;
+    void operator=(const Segment &) = delete;
+  };
+
+  Segment segment_;
+  Header *header_;
+  Filter filter_;
+  const bool writable_;
+
+  // Publish the writer's metadata and end the update.
+  void EndWrite(const uint64_t sequence) {
+    header_->num_items = filter_.num_items_;
+    header_->stash = filter_.stash_;
+    header_->sequence.store(sequence + 2, std::memory_order_release);
+  }
+
+  // Wait before a reader's retry: a pause while the update is likely short,
+  // then a yield, so a writer preempted on this CPU can finish.
+  static void Backoff(const size_t retry) {
+    if (retry < kSpinRetries) {
+#if defined(__x86_64__) || defined(__i386__)
+      _mm_pause();
+#endif
+    } else {
+      sched_yield();
+    }
+  }
+
+  uint64_t BeginWrite() {
+    if (!writable_) {
+      throw std::logic_error("shared filter is attached read-only");
+    }
+    const uint64_t sequence = header_->sequence.load(std::memory_order_relaxed);
+    header_->sequence.store(sequence + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    return sequence;
+  }
+
+ public:
+  // Create the segment /name, sized for max_num_keys items, and become its
+  // writer. Fails if the segment already exists.
+  SharedCuckooFilter(const std::string &name, const size_t max_num_keys)
+      : segment_(name, max_num_keys),
+        header_(segment_.header()),
+        filter_(max_num_keys, segment_.allocator()),
+        writable_(true) {
+    header_->hasher = filter_.hasher_;
+    segment_.Keep();
+  }
+
+  // Attach read-only to the existing segment /name.
+  explicit SharedCuckooFilter(const std::string &name)
+      : segment_(name),
+        header_(segment_.header()),
+        filter_(header_->max_num_keys, segment_.allocator(), header_->hasher),
+        writable_(false) {}
+
+  // Remove the name of segment /name; attached processes keep their mapping.
+  static void Remove(const std::string &name) { shm_unlink(name.c_str()); }
+
+  // Add an item to the filter. Only the creating process may call this.
+  Status Add(const ItemType &item) {
+    const uint64_t sequence = BeginWrite();
+    const Status result = filter_.Add(item);
+    EndWrite(sequence);
+    return result;
+  }
+
+  // Add an item to the filter, or leave it unchanged if there is no room, as
+  // CuckooFilter::TryAdd() does. Only the creating process may call this.
+  Status TryAdd(const ItemType &item) {
+    const uint64_t sequence = BeginWrite();
+    const Status result = filter_.TryAdd(item);
+    EndWrite(sequence);
+    return result;
+  }
+
+  // Add an item unless it is found, as CuckooFilter::AddIfAbsent() does. Only
+  // the creating process may call this.
+  Status AddIfAbsent(const ItemType &item) {
+    const uint64_t sequence = BeginWrite();
+    const Status result = filter_.AddIfAbsent(item);
+    EndWrite(sequence);
+    return result;
+  }
+
+  // Delete an item from the filter. Only the creating process may call this.
+  Status Delete(const ItemType &item) {
+    const uint64_t sequence = BeginWrite();
+    const Status result = filter_.Delete(item);
+    EndWrite(sequence);
+    return result;
+  }
+
+  // CuckooFilter::DeleteMany(), as one write, so readers retry until the
+  // whole batch is done.
+  size_t DeleteMany(const ItemType *items, const size_t n, uint64_t *deleted) {
+    const uint64_t sequence = BeginWrite();
+    const size_t result = filter_.DeleteMany(items, n, deleted);
+    EndWrite(sequence);
+    return result;
+  }
+
+  // Report if the item is inserted, with false positive rate. A reader
+  // returns Busy if the writer stays mid-update for kMaxRetries retries.
+  Status Contain(const ItemType &item) const {
+    if (writable_) return filter_.Contain(item);
+
+    size_t i1, i2;
+    uint32_t tag;
+    filter_.GenerateIndexTagHash(item, &i1, &tag);
+    i2 = filter_.AltIndex(i1, tag);
+    for (size_t retry = 0; retry < kMaxRetries; retry++) {
+      if (retry != 0) Backoff(retry);
+      const uint64_t sequence =
+          header_->sequence.load(std::memory_order_acquire);
+      if (sequence & 1) continue;
+      const bool found = Filter::StashContains(header_->stash, i1, i2, tag) ||
+                         filter_.table_.FindTagInBuckets(i1, i2, tag);
+      std::atomic_thread_fence(std::memory_order_acquire);
+      if (header_->sequence.load(std::memory_order_relaxed) == sequence) {
+        return found ? Ok : NotFound;
+      }
+    }
+    return Busy;
+  }
+
+  // number of current inserted items;
+  size_t Size() const {
+    return writable_ ? filter_.Size() : header_->num_items;
+  }
+
+  // size of the filter in bytes.
+  size_t SizeInBytes() const { return filter_.SizeInBytes(); }
+
+  SharedCuckooFilter(const SharedCuckooFilter &) = delete;
+  SharedCuckooFilter &operator=(const SharedCuckooFilter &) = delete;
+};
+
+}  // namespace cuckoofilter
+
+#endif  // CUCKOO_FILTER_SHARED_CUCKOO_FILTER_H_
@@ -9,133 +9,1321 @@
 //
 // 2. The number of bits set per Add() is contant in order to take advantage of SIMD
 // instructions.
+//
+// 3. Buckets are either 256 bits (eight 32-bit lanes) or 512 bits (sixteen 32-bit lanes,
+// one cache line). Both set one bit per lane.
+//
+// 4. The bucket operations have scalar, SSE2, SSE4.1, AVX2 and (for 512-bit buckets)
+// AVX-512 versions, all with the same bit layout. Each filter uses the fastest one the
+// CPU supports, so one binary runs everywhere and filter contents are portable. Built
+// for an instruction set that is already the fastest (e.g. -march=core-avx2 for 256-bit
+// buckets), Add() and Find() inline its kernel with no dispatch at all.
 
 #pragma once
 
+#include <cmath>
 #include <cstdint>
 #include <cstdlib>
+#include <cstring>
 
 #include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <istream>
+#include <memory>
 #include <new>
+#include <ostream>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <type_traits>
 
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#if defined(__x86_64__) || defined(__i386__)
 #include <immintrin.h>
+#endif
 
 #include "hashutil.h"
 
 using uint32_t = ::std::uint32_t;
 using uint64_t = ::std::uint64_t;
 
-template<typename HashFamily = ::cuckoofilter::TwoIndependentMultiplyShift>
+// The bit layout of a bucket. A bucket is split into lanes of LANE_BITS bits, and each
+// Add() sets BITS_PER_KEY bits, the same number in every lane: bit j of a key (for j <
+// BITS_PER_KEY) goes to lane j % lanes, at the position given by the most significant 5
+// (for 32-bit lanes) or 6 (for 64-bit lanes) bits of hash * SimdBlockRehash()[j]
+// (multiply-shift hashing ala Dietzfelbinger et al.). Every kernel below sets exactly
+// these bits, so a filter built with one instruction set answers the same with any other.
+inline const uint32_t* SimdBlockRehash() {
+  // Odd contants for hashing:
+  alignas(64) static constexpr uint32_t kRehash[32] = {0x47b6137bU, 0x44974d91U,
+      0x8824ad5bU, 0xa2b7289dU, 0x705495c7U, 0x2df1424bU, 0x9efc4947U, 0x5c6bfb31U,
+      0x8c5187c1U, 0x137c56afU, 0x58886f39U, 0x993955bfU, 0xd848292dU, 0x9b11bf0dU,
+      0x49e1859fU, 0x1634106fU, 0xdb5586afU, 0xc8764d7fU, 0x336da9d9U, 0x5457da23U,
+      0xc7ec2c93U, 0x1053383bU, 0xdd0fc8a1U, 0x7513bda5U, 0x80986de3U, 0xf3cb0027U,
+      0x8b863917U, 0xca8b4383U, 0x1d969e0fU, 0xd53c68dbU, 0x3886b777U, 0xe042d32dU};
+  return kRehash;
+}
+
+// The most bits an Add() can set; one rehash constant each.
+constexpr int kSimdBlockMaxBitsPerKey = 32;
+
+// The bucket of a key: the low 32 bits of its hash scaled to num_buckets with a
+// multiply-high. The high 32 bits pick the bits set in that bucket.
+inline uint32_t SimdBlockBucketIndex(const uint64_t hash, const uint64_t num_buckets) {
+  return (static_cast<uint64_t>(static_cast<uint32_t>(hash)) * num_buckets) >> 32;
+}
+
+// The operations on a single bucket of (1 << LOG_BUCKET_BYTE_SIZE) bytes, one struct
+// per instruction set. This one is plain C++, runs anywhere and handles every geometry;
+// for buckets of one or two 32-bit lanes or one 64-bit lane (register-blocked filters)
+// it is also the fastest, and SimdBlockFilter calls it directly.
+template <int LOG_BUCKET_BYTE_SIZE, int LANE_BITS, int BITS_PER_KEY>
+struct ScalarBucket {
+  static constexpr const char* kInstructionSet = "scalar";
+  using Lane = typename ::std::conditional<LANE_BITS == 64, uint64_t, uint32_t>::type;
+  static constexpr int kWords = (1 << LOG_BUCKET_BYTE_SIZE) / sizeof(uint32_t);
+  static constexpr int kLanes = (1 << LOG_BUCKET_BYTE_SIZE) / sizeof(Lane);
+  static constexpr int kRounds = BITS_PER_KEY / kLanes;
+  // Keep the most significant 6 or 5 bits of the 32-bit product:
+  static constexpr int kShift = LANE_BITS == 64 ? 26 : 27;
+
+  static Lane LaneMask(const uint32_t hash, const int lane) noexcept {
+    Lane mask = 0;
+    for (int r = 0; r < kRounds; ++r) {
+      mask |= Lane{1} << ((hash * SimdBlockRehash()[r * kLanes + lane]) >> kShift);
+    }
+    return mask;
+  }
+
+  static void Insert(uint32_t* const bucket, const uint32_t hash) noexcept {
+    Lane* const lanes = reinterpret_cast<Lane*>(bucket);
+    for (int i = 0; i < kLanes; ++i) lanes[i] |= LaneMask(hash, i);
+  }
+
+  static bool Contains(const uint32_t* const bucket, const uint32_t hash) noexcept {
+    const Lane* const lanes = reinterpret_cast<const Lane*>(bucket);
+    // Accumulate the missing bits of all lanes rather than branching on each lane.
+    Lane missing = 0;
+    for (int i = 0; i < kLanes; ++i) missing |= ~lanes[i] & LaneMask(hash, i);
+    return 0 == missing;
+  }
+
+  // Add() and Find() of a key in the num_buckets buckets at directory: the hashing and
+  // the choice of bucket too, so that each kernel compiles the whole operation for its
+  // instruction set.
+  template <typename HashFamily>
+  static void InsertKey(uint32_t* const directory, const uint64_t num_buckets,
+      const HashFamily& hasher, const uint64_t key) noexcept {
+    const uint64_t hash = hasher(key);
+    Insert(directory + kWords * SimdBlockBucketIndex(hash, num_buckets), hash >> 32);
+  }
+
+  template <typename HashFamily>
+  static bool ContainsKey(const uint32_t* const directory, const uint64_t num_buckets,
+      const HashFamily& hasher, const uint64_t key) noexcept {
+    const uint64_t hash = hasher(key);
+    return Contains(
+        directory + kWords * SimdBlockBucketIndex(hash, num_buckets), hash >> 32);
+  }
+
+  // Insert, but safe against concurrent calls on the same bucket. Each 64-bit word is
+  // updated with one atomic fetch-or, skipped if its bits are already set; locked
+  // operations dominate the cost, so this is cheaper than one per 32-bit lane.
+  static void InsertAtomic(uint32_t* const bucket, const uint32_t hash) noexcept {
+    Lane masks[kLanes];
+    for (int i = 0; i < kLanes; ++i) masks[i] = LaneMask(hash, i);
+    uint64_t* const words = reinterpret_cast<uint64_t*>(bucket);
+    for (int i = 0; i < kWords / 2; ++i) {
+      uint64_t mask;
+      memcpy(&mask, reinterpret_cast<const char*>(masks) + sizeof(mask) * i,
+          sizeof(mask));
+      if (mask != (__atomic_load_n(words + i, __ATOMIC_RELAXED) & mask)) {
+        __atomic_fetch_or(words + i, mask, __ATOMIC_RELAXED);
+      }
+    }
+  }
+
+  // The batch forms apply Insert or Contains to bucket index[i] of directory with
+  // hash[i], for each i < n <= 64. Bit i of the result of ContainsMany is Contains()
+  // of key i.
+  static void InsertMany(uint32_t* const directory, const uint32_t* const index,
+      const uint32_t* const hash, const int n) noexcept {
+    for (int i = 0; i < n; ++i) Insert(directory + kWords * index[i], hash[i]);
+  }
+
+  static uint64_t ContainsMany(const uint32_t* const directory,
+      const uint32_t* const index, const uint32_t* const hash, const int n) noexcept {
+    uint64_t found = 0;
+    for (int i = 0; i < n; ++i) {
+      found |= uint64_t{Contains(directory + kWords * index[i], hash[i])} << i;
+    }
+    return found;
+  }
+
+  // Set the num_buckets buckets at out to the bitwise or (and) of those at x and y. out
+  // may be x or y.
+  static void UnionBuckets(uint32_t* const out, const uint32_t* const x,
+      const uint32_t* const y, const size_t num_buckets) noexcept {
+    for (size_t i = 0; i < num_buckets * kWords; ++i) out[i] = x[i] | y[i];
+  }
+
+  static void IntersectBuckets(uint32_t* const out, const uint32_t* const x,
+      const uint32_t* const y, const size_t num_buckets) noexcept {
+    for (size_t i = 0; i < num_buckets * kWords; ++i) out[i] = x[i] & y[i];
+  }
+};
+
+#if defined(__x86_64__) || defined(__i386__)
+
+// The x86 kernels are compiled for their instruction sets through target attributes, so
+// none of them need be enabled for the whole program; SimdBlockFilter picks one when it
+// is constructed and calls it through a function pointer, unless the compiler already
+// targets the instruction set (see SimdBlockInlineKernel). They handle 32-bit lanes in
+// buckets of at least one vector, setting BITS_PER_KEY / lanes bits per lane in as many
+// rounds.
+//
+// The SIMD reinterpret_casts technically violate C++'s strict aliasing rules. However, we
+// compile with -fno-strict-aliasing.
+
+// SSE has no per-lane variable shift, so the 128-bit kernels make 1 << shift from the
+// float with exponent field shift + 127, which is 2^shift. Truncating 2^31 back to an
+// integer overflows to 0x80000000, which is also the bit we want.
+template <int LOG_BUCKET_BYTE_SIZE, int BITS_PER_KEY>
+struct Sse2Bucket {
+  static constexpr const char* kInstructionSet = "SSE2";
+  static bool Supported() { return __builtin_cpu_supports("sse2"); }
+  static constexpr int kLanes = (1 << LOG_BUCKET_BYTE_SIZE) / sizeof(uint32_t);
+  static constexpr int kRounds = BITS_PER_KEY / kLanes;
+  static constexpr int kVectors = (1 << LOG_BUCKET_BYTE_SIZE) / sizeof(__m128i);
+
+  // SSE2 also lacks a 32-bit multiply, so multiply the even and odd lanes separately
+  // as 64-bit products and interleave their low halves.
+  [[gnu::always_inline, gnu::target("sse2")]] static inline __m128i MakeMask(
+      const uint32_t hash, const int v) noexcept {
+    const __m128i hash_data = _mm_set1_epi32(hash);
+    __m128i mask = _mm_setzero_si128();
+    for (int r = 0; r < kRounds; ++r) {
+      const __m128i rehash = _mm_load_si128(
+          reinterpret_cast<const __m128i*>(SimdBlockRehash() + r * kLanes) + v);
+      const __m128i even = _mm_mul_epu32(rehash, hash_data);
+      const __m128i odd = _mm_mul_epu32(_mm_srli_epi64(rehash, 32), hash_data);
+      __m128i product = _mm_unpacklo_epi32(
+          _mm_shuffle_epi32(even, _MM_SHUFFLE(0, 0, 2, 0)),
+          _mm_shuffle_epi32(odd, _MM_SHUFFLE(0, 0, 2, 0)));
+      product = _mm_srli_epi32(product, 27);
+      const __m128i exponent =
+          _mm_add_epi32(_mm_slli_epi32(product, 23), _mm_set1_epi32(0x3f800000));
+      mask = _mm_or_si128(mask, _mm_cvttps_epi32(_mm_castsi128_ps(exponent)));
+    }
+    return mask;
+  }
+
+  [[gnu::target("sse2")]] static void Insert(
+      uint32_t* const bucket, const uint32_t hash) noexcept {
+    __m128i* const vector = reinterpret_cast<__m128i*>(bucket);
+    for (int v = 0; v < kVectors; ++v) {
+      _mm_store_si128(vector + v, _mm_or_si128(vector[v], MakeMask(hash, v)));
+    }
+  }
+
+  [[gnu::target("sse2")]] static bool Contains(
+      const uint32_t* const bucket, const uint32_t hash) noexcept {
+    const __m128i* const vector = reinterpret_cast<const __m128i*>(bucket);
+    int all_set = 0xffff;
+    for (int v = 0; v < kVectors; ++v) {
+      const __m128i mask = MakeMask(hash, v);
+      all_set &=
+          _mm_movemask_epi8(_mm_cmpeq_epi32(_mm_and_si128(vector[v], mask), mask));
+    }
+    return 0xffff == all_set;
+  }
+
+  template <typename HashFamily>
+  [[gnu::target("sse2")]] static void InsertKey(uint32_t* const directory,
+      const uint64_t num_buckets, const HashFamily& hasher, const uint64_t key) noexcept {
+    const uint64_t hash = hasher(key);
+    Insert(directory + kLanes * SimdBlockBucketIndex(hash, num_buckets), hash >> 32);
+  }
+
+  template <typename HashFamily>
+  [[gnu::target("sse2")]] static bool ContainsKey(const uint32_t* const directory,
+      const uint64_t num_buckets, const HashFamily& hasher, const uint64_t key) noexcept {
+    const uint64_t hash = hasher(key);
+    return Contains(
+        directory + kLanes * SimdBlockBucketIndex(hash, num_buckets), hash >> 32);
+  }
+
+  [[gnu::target("sse2")]] static void InsertMany(uint32_t* const directory,
+      const uint32_t* const index, const uint32_t* const hash, const int n) noexcept {
+    for (int i = 0; i < n; ++i) Insert(directory + kLanes * index[i], hash[i]);
+  }
+
+  [[gnu::target("sse2")]] static uint64_t ContainsMany(
+      const uint32_t* const directory, const uint32_t* const index,
+      const uint32_t* const hash, const int n) noexcept {
+    uint64_t found = 0;
+    for (int i = 0; i < n; ++i) {
+      found |= uint64_t{Contains(directory + kLanes * index[i], hash[i])} << i;
+    }
+    return found;
+  }
+
+  [[gnu::target("sse2")]] static void UnionBuckets(uint32_t* const out,
+      const uint32_t* const x, const uint32_t* const y,
+      const size_t num_buckets) noexcept {
+    __m128i* const o = reinterpret_cast<__m128i*>(out);
+    const __m128i* const a = reinterpret_cast<const __m128i*>(x);
+    const __m128i* const b = reinterpret_cast<const __m128i*>(y);
+    for (size_t v = 0; v < num_buckets * kVectors; ++v) {
+      o[v] = _mm_or_si128(a[v], b[v]);
+    }
+  }
+
+  [[gnu::target("sse2")]] static void IntersectBuckets(uint32_t* const out,
+      const uint32_t* const x, const uint32_t* const y,
+      const size_t num_buckets) noexcept {
+    __m128i* const o = reinterpret_cast<__m128i*>(out);
+    const __m128i* const a = reinterpret_cast<const __m128i*>(x);
+    const __m128i* const b = reinterpret_cast<const __m128i*>(y);
+    for (size_t v = 0; v < num_buckets * kVectors; ++v) {
+      o[v] = _mm_and_si128(a[v], b[v]);
+    }
+  }
+};
+
+template <int LOG_BUCKET_BYTE_SIZE, int BITS_PER_KEY>
+struct Sse41Bucket {
+  static constexpr const char* kInstructionSet = "SSE4.1";
+  static bool Supported() { return __builtin_cpu_supports("sse4.1"); }
+  static constexpr int kLanes = (1 << LOG_BUCKET_BYTE_SIZE) / sizeof(uint32_t);
+  static constexpr int kRounds = BITS_PER_KEY / kLanes;
+  static constexpr int kVectors = (1 << LOG_BUCKET_BYTE_SIZE) / sizeof(__m128i);
+
+  [[gnu::always_inline, gnu::target("sse4.1")]] static inline __m128i MakeMask(
+      const uint32_t hash, const int v) noexcept {
+    const __m128i hash_data = _mm_set1_epi32(hash);
+    __m128i mask = _mm_setzero_si128();
+    for (int r = 0; r < kRounds; ++r) {
+      const __m128i rehash = _mm_load_si128(
+          reinterpret_cast<const __m128i*>(SimdBlockRehash() + r * kLanes) + v);
+      __m128i product = _mm_mullo_epi32(rehash, hash_data);
+      product = _mm_srli_epi32(product, 27);
+      const __m128i exponent =
+          _mm_add_epi32(_mm_slli_epi32(product, 23), _mm_set1_epi32(0x3f800000));
+      mask = _mm_or_si128(mask, _mm_cvttps_epi32(_mm_castsi128_ps(exponent)));
+    }
+    return mask;
+  }
+
+  [[gnu::target("sse4.1")]] static void Insert(
+      uint32_t* const bucket, const uint32_t hash) noexcept {
+    __m128i* const vector = reinterpret_cast<__m128i*>(bucket);
+    for (int v = 0; v < kVectors; ++v) {
+      _mm_store_si128(vector + v, _mm_or_si128(vector[v], MakeMask(hash, v)));
+    }
+  }
+
+  [[gnu::target("sse4.1")]] static bool Contains(
+      const uint32_t* const bucket, const uint32_t hash) noexcept {
+    const __m128i* const vector = reinterpret_cast<const __m128i*>(bucket);
+    int all_set = 1;
+    for (int v = 0; v < kVectors; ++v) {
+      all_set &= _mm_testc_si128(vector[v], MakeMask(hash, v));
+    }
+    return all_set;
+  }
+
+  template <typename HashFamily>
+  [[gnu::target("sse4.1")]] static void InsertKey(uint32_t* const directory,
+      const uint64_t num_buckets, const HashFamily& hasher, const uint64_t key) noexcept {
+    const uint64_t hash = hasher(key);
+    Insert(directory + kLanes * SimdBlockBucketIndex(hash, num_buckets), hash >> 32);
+  }
+
+  template <typename HashFamily>
+  [[gnu::target("sse4.1")]] static bool ContainsKey(const uint32_t* const directory,
+      const uint64_t num_buckets, const HashFamily& hasher, const uint64_t key) noexcept {
+    const uint64_t hash = hasher(key);
+    return Contains(
+        directory + kLanes * SimdBlockBucketIndex(hash, num_buckets), hash >> 32);
+  }
+
+  [[gnu::target("sse4.1")]] static void InsertMany(uint32_t* const directory,
+      const uint32_t* const index, const uint32_t* const hash, const int n) noexcept {
+    for (int i = 0; i < n; ++i) Insert(directory + kLanes * index[i], hash[i]);
+  }
+
+  [[gnu::target("sse4.1")]] static uint64_t ContainsMany(
+      const uint32_t* const directory, const uint32_t* const index,
+      const uint32_t* const hash, const int n) noexcept {
+    uint64_t found = 0;
+    for (int i = 0; i < n; ++i) {
+      found |= uint64_t{Contains(directory + kLanes * index[i], hash[i])} << i;
+    }
+    return found;
+  }
+
+  [[gnu::target("sse4.1")]] static void UnionBuckets(uint32_t* const out,
+      const uint32_t* const x, const uint32_t* const y,
+      const size_t num_buckets) noexcept {
+    __m128i* const o = reinterpret_cast<__m128i*>(out);
+    const __m128i* const a = reinterpret_cast<const __m128i*>(x);
+    const __m128i* const b = reinterpret_cast<const __m128i*>(y);
+    for (size_t v = 0; v < num_buckets * kVectors; ++v) {
+      o[v] = _mm_or_si128(a[v], b[v]);
+    }
+  }
+
+  [[gnu::target("sse4.1")]] static void IntersectBuckets(uint32_t* const out,
+      const uint32_t* const x, const uint32_t* const y,
+      const size_t num_buckets) noexcept {
+    __m128i* const o = reinterpret_cast<__m128i*>(out);
+    const __m128i* const a = reinterpret_cast<const __m128i*>(x);
+    const __m128i* const b = reinterpret_cast<const __m128i*>(y);
+    for (size_t v = 0; v < num_buckets * kVectors; ++v) {
+      o[v] = _mm_and_si128(a[v], b[v]);
+    }
+  }
+};
+
+template <int LOG_BUCKET_BYTE_SIZE, int BITS_PER_KEY>
+struct Avx2Bucket {
+  static constexpr const char* kInstructionSet = "AVX2";
+  static bool Supported() { return __builtin_cpu_supports("avx2"); }
+  static constexpr int kLanes = (1 << LOG_BUCKET_BYTE_SIZE) / sizeof(uint32_t);
+  static constexpr int kRounds = BITS_PER_KEY / kLanes;
+  static constexpr int kVectors = (1 << LOG_BUCKET_BYTE_SIZE) / sizeof(__m256i);
+
+  [[gnu::always_inline, gnu::target("avx2")]] static inline __m256i MakeMask(
+      const uint32_t hash, const int v) noexcept {
+    const __m256i ones = _mm256_set1_epi32(1);
+    // Load hash into a YMM register, repeated eight times
+    const __m256i hash_data = _mm256_set1_epi32(hash);
+    __m256i mask = _mm256_setzero_si256();
+    for (int r = 0; r < kRounds; ++r) {
+      const __m256i rehash = _mm256_load_si256(
+          reinterpret_cast<const __m256i*>(SimdBlockRehash() + r * kLanes) + v);
+      // Multiply 'hash' by eight different odd constants, then keep the 5 most
+      // significant bits from each product.
+      __m256i product = _mm256_mullo_epi32(rehash, hash_data);
+      product = _mm256_srli_epi32(product, 27);
+      // Use these 5 bits to shift a single bit to a location in each 32-bit lane
+      mask = _mm256_or_si256(mask, _mm256_sllv_epi32(ones, product));
+    }
+    return mask;
+  }
+
+  [[gnu::target("avx2")]] static void Insert(
+      uint32_t* const bucket, const uint32_t hash) noexcept {
+    __m256i* const vector = reinterpret_cast<__m256i*>(bucket);
+    for (int v = 0; v < kVectors; ++v) {
+      _mm256_store_si256(vector + v, _mm256_or_si256(vector[v], MakeMask(hash, v)));
+    }
+  }
+
+  [[gnu::target("avx2")]] static bool Contains(
+      const uint32_t* const bucket, const uint32_t hash) noexcept {
+    const __m256i* const vector = reinterpret_cast<const __m256i*>(bucket);
+    int all_set = 1;
+    for (int v = 0; v < kVectors; ++v) {
+      // We should return true if 'bucket' has a one wherever 'mask' does.
+      // _mm256_testc_si256 takes the negation of its first argument and ands that with
+      // its second argument. In our case, the result is zero everywhere iff there is a
+      // one in 'bucket' wherever 'mask' is one. testc returns 1 if the result is 0
+      // everywhere and returns 0 otherwise.
+      all_set &= _mm256_testc_si256(vector[v], MakeMask(hash, v));
+    }
+    return all_set;
+  }
+
+  template <typename HashFamily>
+  [[gnu::target("avx2")]] static void InsertKey(uint32_t* const directory,
+      const uint64_t num_buckets, const HashFamily& hasher, const uint64_t key) noexcept {
+    const uint64_t hash = hasher(key);
+    Insert(directory + kLanes * SimdBlockBucketIndex(hash, num_buckets), hash >> 32);
+  }
+
+  template <typename HashFamily>
+  [[gnu::target("avx2")]] static bool ContainsKey(const uint32_t* const directory,
+      const uint64_t num_buckets, const HashFamily& hasher, const uint64_t key) noexcept {
+    const uint64_t hash = hasher(key);
+    return Contains(
+        directory + kLanes * SimdBlockBucketIndex(hash, num_buckets), hash >> 32);
+  }
+
+  [[gnu::target("avx2")]] static void InsertMany(uint32_t* const directory,
+      const uint32_t* const index, const uint32_t* const hash, const int n) noexcept {
+    for (int i = 0; i < n; ++i) Insert(directory + kLanes * index[i], hash[i]);
+  }
+
+  [[gnu::target("avx2")]] static uint64_t ContainsMany(
+      const uint32_t* const directory, const uint32_t* const index,
+      const uint32_t* const hash, const int n) noexcept {
+    uint64_t found = 0;
+    for (int i = 0; i < n; ++i) {
+      found |= uint64_t{Contains(directory + kLanes * index[i], hash[i])} << i;
+    }
+    return found;
+  }
+
+  [[gnu::target("avx2")]] static void UnionBuckets(uint32_t* const out,
+      const uint32_t* const x, const uint32_t* const y,
+      const size_t num_buckets) noexcept {
+    __m256i* const o = reinterpret_cast<__m256i*>(out);
+    const __m256i* const a = reinterpret_cast<const __m256i*>(x);
+    const __m256i* const b = reinterpret_cast<const __m256i*>(y);
+    for (size_t v = 0; v < num_buckets * kVectors; ++v) {
+      o[v] = _mm256_or_si256(a[v], b[v]);
+    }
+  }
+
+  [[gnu::target("avx2")]] static void IntersectBuckets(uint32_t* const out,
+      const uint32_t* const x, const uint32_t* const y,
+      const size_t num_buckets) noexcept {
+    __m256i* const o = reinterpret_cast<__m256i*>(out);
+    const __m256i* const a = reinterpret_cast<const __m256i*>(x);
+    const __m256i* const b = reinterpret_cast<const __m256i*>(y);
+    for (size_t v = 0; v < num_buckets * kVectors; ++v) {
+      o[v] = _mm256_and_si256(a[v], b[v]);
+    }
+  }
+};
+
+// GCC 12 warns about the undefined source operand inside the AVX-512 shift and multiply
+// intrinsics when they are inlined into a target-attributed function.
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wuninitialized"
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+template <int LOG_BUCKET_BYTE_SIZE, int BITS_PER_KEY>
+struct Avx512Bucket {
+  static constexpr const char* kInstructionSet = "AVX-512";
+  static bool Supported() { return __builtin_cpu_supports("avx512f"); }
+  static constexpr int kLanes = (1 << LOG_BUCKET_BYTE_SIZE) / sizeof(uint32_t);
+  static constexpr int kRounds = BITS_PER_KEY / kLanes;
+  static constexpr int kVectors = (1 << LOG_BUCKET_BYTE_SIZE) / sizeof(__m512i);
+
+  [[gnu::always_inline, gnu::target("avx512f")]] static inline __m512i MakeMask(
+      const uint32_t hash, const int v) noexcept {
+    const __m512i ones = _mm512_set1_epi32(1);
+    const __m512i hash_data = _mm512_set1_epi32(hash);
+    __m512i mask = _mm512_setzero_si512();
+    for (int r = 0; r < kRounds; ++r) {
+      const __m512i rehash =
+          _mm512_load_si512(SimdBlockRehash() + r * kLanes + 16 * v);
+      __m512i product = _mm512_mullo_epi32(rehash, hash_data);
+      product = _mm512_srli_epi32(product, 27);
+      mask = _mm512_or_si512(mask, _mm512_sllv_epi32(ones, product));
+    }
+    return mask;
+  }
+
+  [[gnu::target("avx512f")]] static void Insert(
+      uint32_t* const bucket, const uint32_t hash) noexcept {
+    for (int v = 0; v < kVectors; ++v) {
+      const __m512i vector = _mm512_load_si512(bucket + 16 * v);
+      _mm512_store_si512(bucket + 16 * v, _mm512_or_si512(vector, MakeMask(hash, v)));
+    }
+  }
+
+  [[gnu::target("avx512f")]] static bool Contains(
+      const uint32_t* const bucket, const uint32_t hash) noexcept {
+    int all_set = 1;
+    for (int v = 0; v < kVectors; ++v) {
+      const __m512i mask = MakeMask(hash, v);
+      const __m512i vector = _mm512_load_si512(bucket + 16 * v);
+      all_set &=
+          0xffff == _mm512_cmpeq_epi32_mask(_mm512_and_si512(vector, mask), mask);
+    }
+    return all_set;
+  }
+
+  template <typename HashFamily>
+  [[gnu::target("avx512f")]] static void InsertKey(uint32_t* const directory,
+      const uint64_t num_buckets, const HashFamily& hasher, const uint64_t key) noexcept {
+    const uint64_t hash = hasher(key);
+    Insert(directory + kLanes * SimdBlockBucketIndex(hash, num_buckets), hash >> 32);
+  }
+
+  template <typename HashFamily>
+  [[gnu::target("avx512f")]] static bool ContainsKey(const uint32_t* const directory,
+      const uint64_t num_buckets, const HashFamily& hasher, const uint64_t key) noexcept {
+    const uint64_t hash = hasher(key);
+    return Contains(
+        directory + kLanes * SimdBlockBucketIndex(hash, num_buckets), hash >> 32);
+  }
+
+  [[gnu::target("avx512f")]] static void InsertMany(uint32_t* const directory,
+      const uint32_t* const index, const uint32_t* const hash, const int n) noexcept {
+    for (int i = 0; i < n; ++i) Insert(directory + kLanes * index[i], hash[i]);
+  }
+
+  [[gnu::target("avx512f")]] static uint64_t ContainsMany(
+      const uint32_t* const directory, const uint32_t* const index,
+      const uint32_t* const hash, const int n) noexcept {
+    uint64_t found = 0;
+    for (int i = 0; i < n; ++i) {
+      found |= uint64_t{Contains(directory + kLanes * index[i], hash[i])} << i;
+    }
+    return found;
+  }
+
+  [[gnu::target("avx512f")]] static void UnionBuckets(uint32_t* const out,
+      const uint32_t* const x, const uint32_t* const y,
+      const size_t num_buckets) noexcept {
+    __m512i* const o = reinterpret_cast<__m512i*>(out);
+    const __m512i* const a = reinterpret_cast<const __m512i*>(x);
+    const __m512i* const b = reinterpret_cast<const __m512i*>(y);
+    for (size_t v = 0; v < num_buckets * kVectors; ++v) {
+      o[v] = _mm512_or_si512(a[v], b[v]);
+    }
+  }
+
+  [[gnu::target("avx512f")]] static void IntersectBuckets(uint32_t* const out,
+      const uint32_t* const x, const uint32_t* const y,
+      const size_t num_buckets) noexcept {
+    __m512i* const o = reinterpret_cast<__m512i*>(out);
+    const __m512i* const a = reinterpret_cast<const __m512i*>(x);
+    const __m512i* const b = reinterpret_cast<const __m512i*>(y);
+    for (size_t v = 0; v < num_buckets * kVectors; ++v) {
+      o[v] = _mm512_and_si512(a[v], b[v]);
+    }
+  }
+};
+#pragma GCC diagnostic pop
+
+#endif  // defined(__x86_64__) || defined(__i386__)
+
+// The operations of the instruction set a filter runs on, for keys hashed by
+// HashFamily.
+template <typename HashFamily>
+struct SimdBlockKernel {
+  const char* instruction_set;
+  void (*insert_key)(
+      uint32_t* directory, uint64_t num_buckets, const HashFamily& hasher, uint64_t key);
+  bool (*contains_key)(const uint32_t* directory, uint64_t num_buckets,
+      const HashFamily& hasher, uint64_t key);
+  void (*insert_many)(
+      uint32_t* directory, const uint32_t* index, const uint32_t* hash, int n);
+  uint64_t (*contains_many)(
+      const uint32_t* directory, const uint32_t* index, const uint32_t* hash, int n);
+  void (*union_buckets)(
+      uint32_t* out, const uint32_t* x, const uint32_t* y, size_t num_buckets);
+  void (*intersect_buckets)(
+      uint32_t* out, const uint32_t* x, const uint32_t* y, size_t num_buckets);
+
+  template <typename Ops>
+  static SimdBlockKernel Of() {
+    return SimdBlockKernel{Ops::kInstructionSet,
+        &Ops::template InsertKey<HashFamily>, &Ops::template ContainsKey<HashFamily>,
+        &Ops::InsertMany, &Ops::ContainsMany, &Ops::UnionBuckets,
+        &Ops::IntersectBuckets};
+  }
+
+  // Set *kernel to Ops if it fits the geometry (usable) and this CPU supports it. Ops is
+  // not instantiated unless usable.
+  template <typename Ops, bool usable>
+  struct Try {
+    static bool Pick(SimdBlockKernel* kernel) {
+      if (!Ops::Supported()) return false;
+      *kernel = Of<Ops>();
+      return true;
+    }
+  };
+
+  template <typename Ops>
+  struct Try<Ops, false> {
+    static bool Pick(SimdBlockKernel*) { return false; }
+  };
+};
+
+// The fastest kernel this CPU supports for the given bucket geometry.
+template <typename HashFamily, int LOG_BUCKET_BYTE_SIZE, int LANE_BITS, int BITS_PER_KEY>
+SimdBlockKernel<HashFamily> SimdBlockBestKernel() {
+  using Kernel = SimdBlockKernel<HashFamily>;
+  Kernel result =
+      Kernel::template Of<ScalarBucket<LOG_BUCKET_BYTE_SIZE, LANE_BITS, BITS_PER_KEY>>();
+#if defined(__x86_64__) || defined(__i386__)
+  constexpr bool kLanes32 = LANE_BITS == 32;
+  __builtin_cpu_init();
+  Kernel::template Try<Avx512Bucket<LOG_BUCKET_BYTE_SIZE, BITS_PER_KEY>,
+      kLanes32 && LOG_BUCKET_BYTE_SIZE >= 6>::Pick(&result) ||
+  Kernel::template Try<Avx2Bucket<LOG_BUCKET_BYTE_SIZE, BITS_PER_KEY>,
+      kLanes32 && LOG_BUCKET_BYTE_SIZE >= 5>::Pick(&result) ||
+  Kernel::template Try<Sse41Bucket<LOG_BUCKET_BYTE_SIZE, BITS_PER_KEY>,
+      kLanes32 && LOG_BUCKET_BYTE_SIZE >= 4>::Pick(&result) ||
+  Kernel::template Try<Sse2Bucket<LOG_BUCKET_BYTE_SIZE, BITS_PER_KEY>,
+      kLanes32 && LOG_BUCKET_BYTE_SIZE >= 4>::Pick(&result);
+#endif
+  return result;
+}
+
+// The fastest kernel for the given bucket geometry among the instruction sets the
+// compiler targets, such as AVX2 under -march=core-avx2, as type. No CPU this program
+// runs on can lack it, so it may be called directly and inlined. kBest is set if no
+// other instruction set could do better on any CPU, so the kernel SimdBlockBestKernel()
+// picks is this one.
+template <int LOG_BUCKET_BYTE_SIZE, int LANE_BITS, int BITS_PER_KEY>
+struct SimdBlockInlineKernel {
+  using Scalar = ScalarBucket<LOG_BUCKET_BYTE_SIZE, LANE_BITS, BITS_PER_KEY>;
+#if defined(__x86_64__) || defined(__i386__)
+  static constexpr bool kLanes32 = LANE_BITS == 32;
+#ifdef __AVX512F__
+  static constexpr bool kAvx512 = kLanes32 && LOG_BUCKET_BYTE_SIZE >= 6;
+#else
+  static constexpr bool kAvx512 = false;
+#endif
+#ifdef __AVX2__
+  static constexpr bool kAvx2 = kLanes32 && LOG_BUCKET_BYTE_SIZE >= 5;
+#else
+  static constexpr bool kAvx2 = false;
+#endif
+#ifdef __SSE4_1__
+  static constexpr bool kSse41 = kLanes32 && LOG_BUCKET_BYTE_SIZE >= 4;
+#else
+  static constexpr bool kSse41 = false;
+#endif
+#ifdef __SSE2__
+  static constexpr bool kSse2 = kLanes32 && LOG_BUCKET_BYTE_SIZE >= 4;
+#else
+  static constexpr bool kSse2 = false;
+#endif
+  using type = typename ::std::conditional<kAvx512,
+      Avx512Bucket<LOG_BUCKET_BYTE_SIZE, BITS_PER_KEY>,
+      typename ::std::conditional<kAvx2, Avx2Bucket<LOG_BUCKET_BYTE_SIZE, BITS_PER_KEY>,
+          typename ::std::conditional<kSse41,
+              Sse41Bucket<LOG_BUCKET_BYTE_SIZE, BITS_PER_KEY>,
+              typename ::std::conditional<kSse2,
+                  Sse2Bucket<LOG_BUCKET_BYTE_SIZE, BITS_PER_KEY>,
+                  Scalar>::type>::type>::type>::type;
+  static constexpr bool kBest = !kLanes32 || LOG_BUCKET_BYTE_SIZE < 4 ||
+      kAvx512 || (kAvx2 && LOG_BUCKET_BYTE_SIZE < 6) ||
+      (kSse41 && LOG_BUCKET_BYTE_SIZE < 5);
+#else
+  using type = Scalar;
+  static constexpr bool kBest = true;
+#endif
+};
+
+// The geometry is set by three template parameters:
+//
+//   log_bucket_byte_size: 3, 4, 5 or 6, for buckets of 64, 128, 256 or 512 bits. Every
+//   bucket lies in one cache line, so Add() and Find() touch one line at any size.
+//
+//   lane_bits: 32 or 64, the width of the lanes a bucket is split into.
+//
+//   bits_per_key: the number of bits an Add() sets, a multiple of the number of lanes
+//   and at most 32. The default sets one bit per lane.
+//
+// The default, 256-bit buckets of eight 32-bit lanes and 8 bits per key, suits about 8
+// to 16 bits of filter per key. Setting more bits per key lowers the false positive
+// probability at high bits of filter per key: 512-bit buckets with 16 bits per key pay
+// off from about 20. 64-bit register-blocked buckets with fewer bits per key are the
+// fastest, and lose the least at low bits of filter per key. The bulk-insert-and-query
+// benchmark compares several geometries. Buckets of 32-bit lanes and at least 128 bits
+// use SIMD kernels; the others run scalar code inline.
+template <typename HashFamily = ::cuckoofilter::TwoIndependentMultiplyShift,
+    int log_bucket_byte_size = 5, int lane_bits = 32,
+    int bits_per_key = (CHAR_BIT << log_bucket_byte_size) / lane_bits>
 class SimdBlockFilter {
  private:
+  // log2(number of bytes in a bucket):
+  static constexpr int LOG_BUCKET_BYTE_SIZE = log_bucket_byte_size;
+
   // The filter is divided up into Buckets:
-  using Bucket = uint32_t[8];
+  using Bucket = uint32_t[(1 << LOG_BUCKET_BYTE_SIZE) / sizeof(uint32_t)];
 
-  // log2(number of bytes in a bucket):
-  static constexpr int LOG_BUCKET_BYTE_SIZE = 5;
+  static constexpr int kLanes = CHAR_BIT * sizeof(Bucket) / lane_bits;
 
-  static_assert(
-      (1 << LOG_BUCKET_BYTE_SIZE) == sizeof(Bucket) && sizeof(Bucket) == sizeof(__m256i),
+  static_assert((1 << LOG_BUCKET_BYTE_SIZE) == sizeof(Bucket) &&
+                    3 <= LOG_BUCKET_BYTE_SIZE && LOG_BUCKET_BYTE_SIZE <= 6,
       "Bucket sizing has gone awry.");
+  static_assert(lane_bits == 32 || lane_bits == 64, "Lanes are 32 or 64 bits");
+  static_assert(bits_per_key % kLanes == 0 && bits_per_key >= kLanes &&
+                    bits_per_key <= kSimdBlockMaxBitsPerKey,
+      "bits_per_key must be a multiple of the number of lanes, and at most 32");
+
+  using ScalarOps = ScalarBucket<LOG_BUCKET_BYTE_SIZE, lane_bits, bits_per_key>;
 
-  // log_num_buckets_ is the log (base 2) of the number of buckets in the directory:
-  const int log_num_buckets_;
+  // Add() and Find() call InlineOps directly, hashing and all inlined, when it is the
+  // kernel this filter would pick anyway: always for buckets with no SIMD kernel, and
+  // for the others when the compiler targets the best instruction set for them.
+  // Otherwise they make one call through kernel_, to a function that hashes the key,
+  // picks its bucket and tests or sets its bits all in the kernel's instruction set.
+  using InlineOps =
+      typename SimdBlockInlineKernel<LOG_BUCKET_BYTE_SIZE, lane_bits, bits_per_key>::type;
+  static constexpr bool kInline =
+      SimdBlockInlineKernel<LOG_BUCKET_BYTE_SIZE, lane_bits, bits_per_key>::kBest;
 
-  // directory_mask_ is (1 << log_num_buckets_) - 1. It is precomputed in the contructor
-  // for efficiency reasons:
-  const uint32_t directory_mask_;
+  // A key's bucket is chosen by the low 32 bits of its hash and the bits set in that
+  // bucket by the high 32 bits. The low bits are scaled to the number of buckets with a
+  // multiply-high rather than masked, so the directory can have any number of buckets,
+  // from 2 to 2^32. Halving a directory of an even number of buckets (see Fold()) sends
+  // each key from bucket i to bucket i / 2 and sets the same bits there.
+  uint64_t num_buckets_;
 
   Bucket* directory_;
 
+  // The file mapping directory_ points into, for filters from Map(); otherwise null and
+  // directory_ is from posix_memalign.
+  void* mapping_;
+  size_t mapping_size_;
+
   HashFamily hasher_;
 
+  // Chosen for this CPU when the filter is constructed:
+  const SimdBlockKernel<HashFamily> kernel_;
+
+  uint32_t BucketIndex(const uint64_t hash) const noexcept {
+    return SimdBlockBucketIndex(hash, num_buckets_);
+  }
+
+  // The number of buckets in heap_space bytes, clamped to [2, 2^32]:
+  static uint64_t NumBucketsFor(const uint64_t heap_space) {
+    const uint64_t num_buckets = heap_space / sizeof(Bucket);
+    return ::std::min<uint64_t>(1ull << 32, ::std::max<uint64_t>(2, num_buckets));
+  }
+
+  static double FalsePositiveProbOfBuckets(const size_t ndv, const uint64_t num_buckets);
+
+  // The batch methods work on groups of this many keys, one word of found bits each.
+  // Every bucket of a group is prefetched before any is touched, so the cache misses of
+  // a group overlap instead of each key waiting on the last.
+  static constexpr int kBatchSize = 64;
+
+  // Fill index[i] and hash[i] for keys[0, n) and prefetch their buckets, for writing if
+  // rw is 1.
+  template <int rw>
+  void PrepareBatch(
+      const uint64_t* keys, int n, uint32_t* index, uint32_t* hash) const noexcept;
+
+  // Throws invalid_argument unless that has the same size and an equal hasher.
+  void CheckCompatible(const SimdBlockFilter& that) const;
+
+  // The saved format is this header, the bytes of the hasher, zero padding and then the
+  // directory, which starts at a multiple of 64 bytes so a mapped file can be used in
+  // place. Integers are in the byte order of the saving machine; a file from a machine
+  // of the other byte order fails the magic number check.
+  struct FileHeader {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t bucket_bytes;
+    uint32_t bits_per_lane;
+    uint32_t bits_set_per_key;
+    uint32_t hasher_bytes;
+    uint32_t reserved;
+    uint64_t num_buckets;
+    uint64_t directory_offset;
+    uint64_t directory_bytes;
+    uint64_t padding;
+  };
+  static_assert(sizeof(FileHeader) == 64, "FileHeader must fill one cache line");
+
+  static constexpr uint64_t kFileMagic = 0x314b4c42444d4953ULL;  // "SIMDBLK1"
+  static constexpr uint32_t kFileVersion = 2;
+
+  FileHeader MakeFileHeader() const;
+
+  // Throws runtime_error unless header describes a file of file_size bytes (if known)
+  // that this type of filter can read.
+  static void CheckFileHeader(const FileHeader& header, uint64_t file_size);
+
+  // Takes ownership of the mapping.
+  SimdBlockFilter(const FileHeader& header, const HashFamily& hasher, void* mapping,
+      size_t mapping_size);
+
+  SimdBlockFilter(const HashFamily& hasher, uint64_t num_buckets);
+
  public:
-  // Consumes at most (1 << log_heap_space) bytes on the heap:
-  explicit SimdBlockFilter(const int log_heap_space);
+  // Consumes at most (1 << log_heap_space) bytes on the heap. Filters that will be
+  // combined need equal hashers, e.g. HashFamily(seed) with a shared seed.
+  explicit SimdBlockFilter(
+      const int log_heap_space, const HashFamily& hasher = HashFamily());
+
+  // The smallest filter, to the bucket, with a false positive probability of at most
+  // fpp once ndv distinct keys have been added; see MinHeapSpace().
+  SimdBlockFilter(
+      const size_t ndv, const double fpp, const HashFamily& hasher = HashFamily());
+
+  // A filter of heap_space bytes rounded down to a whole number of buckets, and of at
+  // least two buckets.
+  static SimdBlockFilter WithHeapSpace(
+      const uint64_t heap_space, const HashFamily& hasher = HashFamily()) {
+    return SimdBlockFilter(hasher, NumBucketsFor(heap_space));
+  }
+
   SimdBlockFilter(SimdBlockFilter&& that)
-    : log_num_buckets_(that.log_num_buckets_),
-      directory_mask_(that.directory_mask_),
+    : num_buckets_(that.num_buckets_),
       directory_(that.directory_),
-      hasher_(that.hasher_) {}
+      mapping_(that.mapping_),
+      mapping_size_(that.mapping_size_),
+      hasher_(that.hasher_),
+      kernel_(that.kernel_) {
+    that.directory_ = nullptr;
+    that.mapping_ = nullptr;
+  }
   ~SimdBlockFilter() noexcept;
   void Add(const uint64_t key) noexcept;
   bool Find(const uint64_t key) const noexcept;
-  uint64_t SizeInBytes() const { return sizeof(Bucket) * (1ull << log_num_buckets_); }
 
- private:
-  // A helper function for Insert()/Find(). Turns a 32-bit hash into a 256-bit Bucket
-  // with 1 single 1-bit set in each 32-bit lane.
-  static __m256i MakeMask(const uint32_t hash) noexcept;
+  // Add keys[0, n).
+  void AddMany(const uint64_t* keys, size_t n) noexcept;
+
+  // Add() and AddMany() for building one filter from many threads at once, using atomic
+  // fetch-or on the bucket words. These may run concurrently with each other and with
+  // Find() or FindMany(), which stay lock-free. A lookup racing an add may miss that key;
+  // once the adding threads are joined (or otherwise synchronized with), every key they
+  // added is found. The plain Add() and AddMany() must not run concurrently with any of
+  // these. The atomics make each thread several times slower than AddMany(), so these
+  // only pay off with several threads adding.
+  void AddConcurrent(const uint64_t key) noexcept;
+  void AddManyConcurrent(const uint64_t* keys, size_t n) noexcept;
+
+  // Look up keys[0, n), overwriting the first (n + 63) / 64 words of found: bit (i % 64)
+  // of found[i / 64] is set iff keys[i] may be in the filter. Returns the number of keys
+  // found.
+  size_t FindMany(const uint64_t* keys, size_t n, uint64_t* found) const noexcept;
+
+  // Make this filter find every key that it or that finds. that must have the same size
+  // and an equal hasher.
+  void UnionWith(const SimdBlockFilter& that);
+
+  // Make this filter find only keys that both it and that find. Every key added to both
+  // is still found, and the false positive probability is at most either one's; it is
+  // generally higher than that of a filter built from the common keys alone. that must
+  // have the same size and an equal hasher.
+  void IntersectWith(const SimdBlockFilter& that);
+
+  // UnionWith() and IntersectWith() into a new filter.
+  static SimdBlockFilter Union(const SimdBlockFilter& x, const SimdBlockFilter& y);
+  static SimdBlockFilter Intersect(const SimdBlockFilter& x, const SimdBlockFilter& y);
+
+  // Halve the size of the filter by or-ing each pair of adjacent buckets into one. Every
+  // key added is still found, at the false positive probability of a filter half the
+  // size. Throws logic_error unless the directory has an even number of buckets, and
+  // more than two.
+  void Fold();
+
+  // Write the filter to out in a compact binary format. Throws runtime_error if the
+  // stream fails. HashFamily must be trivially copyable.
+  void Save(::std::ostream& out) const;
+
+  // Read a filter written by Save(). Throws runtime_error if the data is not a saved
+  // filter of this type.
+  static SimdBlockFilter Load(::std::istream& in);
+
+  // Use the filter saved in the file at path in place, without copying it, through a
+  // read-only shared mapping: many processes mapping the same file share one copy.
+  // Throws system_error or runtime_error if the file cannot be mapped or read.
+  static ::std::unique_ptr<const SimdBlockFilter> Map(const ::std::string& path);
+
+  uint64_t SizeInBytes() const { return sizeof(Bucket) * num_buckets_; }
+
+  // The instruction set of the bucket operations in use, such as "AVX2":
+  const char* InstructionSet() const { return kernel_.instruction_set; }
+
+  // The smallest log_heap_space that gives a false positive probability of at most fpp
+  // once ndv distinct keys have been added:
+  static int MinLogSpace(const size_t ndv, const double fpp);
+
+  // The false positive probability of a filter of (1 << log_heap_space) bytes holding
+  // ndv distinct keys:
+  static double FalsePositiveProb(const size_t ndv, const int log_heap_space);
 
+  // MinLogSpace() and FalsePositiveProb() for filters of any number of buckets, in bytes
+  // rather than their log:
+  static uint64_t MinHeapSpace(const size_t ndv, const double fpp);
+  static double FalsePositiveProbOfSpace(const size_t ndv, const uint64_t heap_space) {
+    return FalsePositiveProbOfBuckets(ndv, NumBucketsFor(heap_space));
+  }
+
+ private:
   SimdBlockFilter(const SimdBlockFilter&) = delete;
   void operator=(const SimdBlockFilter&) = delete;
 };
 
-template<typename HashFamily>
-SimdBlockFilter<HashFamily>::SimdBlockFilter(const int log_heap_space)
+template <typename HashFamily, int log_bucket_byte_size, int lane_bits, int bits_per_key>
+SimdBlockFilter<HashFamily, log_bucket_byte_size, lane_bits,
+    bits_per_key>::SimdBlockFilter(
+    const int log_heap_space, const HashFamily& hasher)
   :  // Since log_heap_space is in bytes, we need to convert it to the number of Buckets
-     // we will use.
-    log_num_buckets_(::std::max(1, log_heap_space - LOG_BUCKET_BYTE_SIZE)),
-    // Don't use log_num_buckets_ if it will lead to undefined behavior by a shift that is
-    // too large.
-    directory_mask_((1ull << ::std::min(63, log_num_buckets_)) - 1),
+     // we will use. Don't shift by more than the directory can hold.
+    SimdBlockFilter(hasher,
+        1ull << ::std::min(32, ::std::max(1, log_heap_space - LOG_BUCKET_BYTE_SIZE))) {}
+
+template <typename HashFamily, int log_bucket_byte_size, int lane_bits, int bits_per_key>
+SimdBlockFilter<HashFamily, log_bucket_byte_size, lane_bits,
+    bits_per_key>::SimdBlockFilter(
+    const size_t ndv, const double fpp, const HashFamily& hasher)
+  : SimdBlockFilter(hasher, MinHeapSpace(ndv, fpp) / sizeof(Bucket)) {}
+
+template <typename HashFamily, int log_bucket_byte_size, int lane_bits, int bits_per_key>
+SimdBlockFilter<HashFamily, log_bucket_byte_size, lane_bits,
+    bits_per_key>::SimdBlockFilter(
+    const HashFamily& hasher, const uint64_t num_buckets)
+  : num_buckets_(num_buckets),
     directory_(nullptr),
-    hasher_() {
-  if (!__builtin_cpu_supports("avx2")) {
-    throw ::std::runtime_error("SimdBlockFilter does not work without AVX2 instructions");
-  }
-  const size_t alloc_size = 1ull << (log_num_buckets_ + LOG_BUCKET_BYTE_SIZE);
+    mapping_(nullptr),
+    mapping_size_(0),
+    hasher_(hasher),
+    kernel_(SimdBlockBestKernel<HashFamily, LOG_BUCKET_BYTE_SIZE, lane_bits,
+        bits_per_key>()) {
+  const size_t alloc_size = num_buckets_ * sizeof(Bucket);
   const int malloc_failed =
       posix_memalign(reinterpret_cast<void**>(&directory_), 64, alloc_size);
   if (malloc_failed) throw ::std::bad_alloc();
   memset(directory_, 0, alloc_size);
 }
 
-template<typename HashFamily>
-SimdBlockFilter<HashFamily>::~SimdBlockFilter() noexcept {
-  free(directory_);
+template <typename HashFamily, int log_bucket_byte_size, int lane_bits, int bits_per_key>
+SimdBlockFilter<HashFamily, log_bucket_byte_size, lane_bits,
+    bits_per_key>::~SimdBlockFilter() noexcept {
+  if (mapping_ != nullptr) {
+    munmap(mapping_, mapping_size_);
+  } else {
+    free(directory_);
+  }
   directory_ = nullptr;
 }
 
-// The SIMD reinterpret_casts technically violate C++'s strict aliasing rules. However, we
-// compile with -fno-strict-aliasing.
-template <typename HashFamily>
-[[gnu::always_inline]] inline __m256i
-SimdBlockFilter<HashFamily>::MakeMask(const uint32_t hash) noexcept {
-  const __m256i ones = _mm256_set1_epi32(1);
-  // Odd contants for hashing:
-  const __m256i rehash = _mm256_setr_epi32(0x47b6137bU, 0x44974d91U, 0x8824ad5bU,
-      0xa2b7289dU, 0x705495c7U, 0x2df1424bU, 0x9efc4947U, 0x5c6bfb31U);
-  // Load hash into a YMM register, repeated eight times
-  __m256i hash_data = _mm256_set1_epi32(hash);
-  // Multiply-shift hashing ala Dietzfelbinger et al.: multiply 'hash' by eight different
-  // odd constants, then keep the 5 most significant bits from each product.
-  hash_data = _mm256_mullo_epi32(rehash, hash_data);
-  hash_data = _mm256_srli_epi32(hash_data, 27);
-  // Use these 5 bits to shift a single bit to a location in each 32-bit lane
-  return _mm256_sllv_epi32(ones, hash_data);
+template <typename HashFamily, int log_bucket_byte_size, int lane_bits, int bits_per_key>
+int SimdBlockFilter<HashFamily, log_bucket_byte_size, lane_bits,
+    bits_per_key>::MinLogSpace(const size_t ndv, const double fpp) {
+  int log_heap_space = LOG_BUCKET_BYTE_SIZE + 1;
+  while (log_heap_space < 63 && FalsePositiveProb(ndv, log_heap_space) > fpp) {
+    ++log_heap_space;
+  }
+  return log_heap_space;
 }
 
-template <typename HashFamily>
+template <typename HashFamily, int log_bucket_byte_size, int lane_bits, int bits_per_key>
+uint64_t SimdBlockFilter<HashFamily, log_bucket_byte_size, lane_bits,
+    bits_per_key>::MinHeapSpace(const size_t ndv, const double fpp) {
+  // The false positive probability falls as the number of buckets grows, so binary
+  // search for the fewest buckets that reach fpp.
+  uint64_t low = 2, high = 1ull << 32;
+  while (low < high) {
+    const uint64_t middle = low + (high - low) / 2;
+    if (FalsePositiveProbOfBuckets(ndv, middle) > fpp) {
+      low = middle + 1;
+    } else {
+      high = middle;
+    }
+  }
+  return low * sizeof(Bucket);
+}
+
+template <typename HashFamily, int log_bucket_byte_size, int lane_bits, int bits_per_key>
+double SimdBlockFilter<HashFamily, log_bucket_byte_size, lane_bits,
+    bits_per_key>::FalsePositiveProb(
+    const size_t ndv, const int log_heap_space) {
+  return FalsePositiveProbOfBuckets(ndv,
+      1ull << ::std::min(32, ::std::max(1, log_heap_space - LOG_BUCKET_BYTE_SIZE)));
+}
+
+// The number of keys in a bucket is Poisson distributed with mean ndv / num_buckets. Each
+// key sets `rounds` bits in every lane, so a bucket holding j keys has each bit set with
+// probability 1 - (1 - 1 / lane_bits)^(j * rounds), and a lookup checks bits_per_key of
+// them. This ignores a lookup's bits colliding with each other in a lane, which matters
+// only for many bits per lane.
+template <typename HashFamily, int log_bucket_byte_size, int lane_bits, int bits_per_key>
+double SimdBlockFilter<HashFamily, log_bucket_byte_size, lane_bits,
+    bits_per_key>::FalsePositiveProbOfBuckets(
+    const size_t ndv, const uint64_t num_buckets) {
+  if (0 == ndv) return 0;
+  const double lambda = ndv / static_cast<double>(num_buckets);
+  const double rounds = bits_per_key / kLanes;
+  const double spread = 10 * sqrt(lambda) + 10;
+  double result = 0;
+  for (double j = ::std::max(0.0, floor(lambda - spread)); j <= lambda + spread; ++j) {
+    const double log_poisson = -lambda + j * log(lambda) - lgamma(j + 1);
+    const double bit_set = 1 - pow(1 - 1.0 / lane_bits, j * rounds);
+    result += exp(log_poisson) * pow(bit_set, bits_per_key);
+  }
+  return ::std::min(1.0, result);
+}
+
+template <typename HashFamily, int log_bucket_byte_size, int lane_bits, int bits_per_key>
 [[gnu::always_inline]] inline void
-SimdBlockFilter<HashFamily>::Add(const uint64_t key) noexcept {
-  const auto hash = hasher_(key);
-  const uint32_t bucket_idx = hash & directory_mask_;
-  const __m256i mask = MakeMask(hash >> log_num_buckets_);
-  __m256i* const bucket = &reinterpret_cast<__m256i*>(directory_)[bucket_idx];
-  _mm256_store_si256(bucket, _mm256_or_si256(*bucket, mask));
+SimdBlockFilter<HashFamily, log_bucket_byte_size, lane_bits,
+    bits_per_key>::Add(const uint64_t key) noexcept {
+  if (kInline) {
+    InlineOps::InsertKey(directory_[0], num_buckets_, hasher_, key);
+  } else {
+    kernel_.insert_key(directory_[0], num_buckets_, hasher_, key);
+  }
 }
 
-template <typename HashFamily>
+template <typename HashFamily, int log_bucket_byte_size, int lane_bits, int bits_per_key>
 [[gnu::always_inline]] inline bool
-SimdBlockFilter<HashFamily>::Find(const uint64_t key) const noexcept {
+SimdBlockFilter<HashFamily, log_bucket_byte_size, lane_bits,
+    bits_per_key>::Find(const uint64_t key) const noexcept {
+  if (kInline) return InlineOps::ContainsKey(directory_[0], num_buckets_, hasher_, key);
+  return kernel_.contains_key(directory_[0], num_buckets_, hasher_, key);
+}
+
+template <typename HashFamily, int log_bucket_byte_size, int lane_bits, int bits_per_key>
+template <int rw>
+inline void SimdBlockFilter<HashFamily, log_bucket_byte_size, lane_bits,
+    bits_per_key>::PrepareBatch(
+    const uint64_t* keys, const int n, uint32_t* index, uint32_t* hash) const noexcept {
+  for (int i = 0; i < n; ++i) {
+    const auto h = hasher_(keys[i]);
+    index[i] = BucketIndex(h);
+    hash[i] = h >> 32;
+    __builtin_prefetch(directory_[index[i]], rw);
+  }
+}
+
+template <typename HashFamily, int log_bucket_byte_size, int lane_bits, int bits_per_key>
+void SimdBlockFilter<HashFamily, log_bucket_byte_size, lane_bits, bits_per_key>::AddMany(
+    const uint64_t* keys, const size_t n) noexcept {
+  uint32_t index[kBatchSize], hash[kBatchSize];
+  for (size_t i = 0; i < n; i += kBatchSize) {
+    const int m = ::std::min<size_t>(kBatchSize, n - i);
+    PrepareBatch<1>(keys + i, m, index, hash);
+    kernel_.insert_many(directory_[0], index, hash, m);
+  }
+}
+
+template <typename HashFamily, int log_bucket_byte_size, int lane_bits, int bits_per_key>
+size_t SimdBlockFilter<HashFamily, log_bucket_byte_size, lane_bits,
+    bits_per_key>::FindMany(
+    const uint64_t* keys, const size_t n, uint64_t* found) const noexcept {
+  uint32_t index[kBatchSize], hash[kBatchSize];
+  size_t count = 0;
+  for (size_t i = 0; i < n; i += kBatchSize) {
+    const int m = ::std::min<size_t>(kBatchSize, n - i);
+    PrepareBatch<0>(keys + i, m, index, hash);
+    found[i / kBatchSize] = kernel_.contains_many(directory_[0], index, hash, m);
+    count += __builtin_popcountll(found[i / kBatchSize]);
+  }
+  return count;
+}
+
+template <typename HashFamily, int log_bucket_byte_size, int lane_bits, int bits_per_key>
+inline void SimdBlockFilter<HashFamily, log_bucket_byte_size, lane_bits,
+    bits_per_key>::AddConcurrent(
+    const uint64_t key) noexcept {
   const auto hash = hasher_(key);
-  const uint32_t bucket_idx = hash & directory_mask_;
-  const __m256i mask = MakeMask(hash >> log_num_buckets_);
-  const __m256i bucket = reinterpret_cast<__m256i*>(directory_)[bucket_idx];
-  // We should return true if 'bucket' has a one wherever 'mask' does. _mm256_testc_si256
-  // takes the negation of its first argument and ands that with its second argument. In
-  // our case, the result is zero everywhere iff there is a one in 'bucket' wherever
-  // 'mask' is one. testc returns 1 if the result is 0 everywhere and returns 0 otherwise.
-  return _mm256_testc_si256(bucket, mask);
+  const uint32_t bucket_idx = BucketIndex(hash);
+  ScalarOps::InsertAtomic(directory_[bucket_idx], hash >> 32);
+}
+
+template <typename HashFamily, int log_bucket_byte_size, int lane_bits, int bits_per_key>
+void SimdBlockFilter<HashFamily, log_bucket_byte_size, lane_bits,
+    bits_per_key>::AddManyConcurrent(
+    const uint64_t* keys, const size_t n) noexcept {
+  uint32_t index[kBatchSize], hash[kBatchSize];
+  for (size_t i = 0; i < n; i += kBatchSize) {
+    const int m = ::std::min<size_t>(kBatchSize, n - i);
+    PrepareBatch<1>(keys + i, m, index, hash);
+    for (int j = 0; j < m; ++j) {
+      ScalarOps::InsertAtomic(directory_[index[j]], hash[j]);
+    }
+  }
+}
+
+template <typename HashFamily, int log_bucket_byte_size, int lane_bits, int bits_per_key>
+void SimdBlockFilter<HashFamily, log_bucket_byte_size, lane_bits,
+    bits_per_key>::CheckCompatible(
+    const SimdBlockFilter& that) const {
+  if (num_buckets_ != that.num_buckets_) {
+    throw ::std::invalid_argument("SimdBlockFilters differ in size");
+  }
+  if (hasher_ != that.hasher_) {
+    throw ::std::invalid_argument("SimdBlockFilters differ in hash function");
+  }
+}
+
+template <typename HashFamily, int log_bucket_byte_size, int lane_bits, int bits_per_key>
+void SimdBlockFilter<HashFamily, log_bucket_byte_size, lane_bits,
+    bits_per_key>::UnionWith(
+    const SimdBlockFilter& that) {
+  CheckCompatible(that);
+  kernel_.union_buckets(
+      directory_[0], directory_[0], that.directory_[0], num_buckets_);
+}
+
+template <typename HashFamily, int log_bucket_byte_size, int lane_bits, int bits_per_key>
+void SimdBlockFilter<HashFamily, log_bucket_byte_size, lane_bits,
+    bits_per_key>::IntersectWith(
+    const SimdBlockFilter& that) {
+  CheckCompatible(that);
+  kernel_.intersect_buckets(
+      directory_[0], directory_[0], that.directory_[0], num_buckets_);
+}
+
+template <typename HashFamily, int log_bucket_byte_size, int lane_bits, int bits_per_key>
+SimdBlockFilter<HashFamily, log_bucket_byte_size, lane_bits, bits_per_key>
+SimdBlockFilter<HashFamily, log_bucket_byte_size, lane_bits, bits_per_key>::Union(
+    const SimdBlockFilter& x, const SimdBlockFilter& y) {
+  x.CheckCompatible(y);
+  SimdBlockFilter result(x.hasher_, x.num_buckets_);
+  result.kernel_.union_buckets(
+      result.directory_[0], x.directory_[0], y.directory_[0], x.num_buckets_);
+  return result;
+}
+
+template <typename HashFamily, int log_bucket_byte_size, int lane_bits, int bits_per_key>
+SimdBlockFilter<HashFamily, log_bucket_byte_size, lane_bits, bits_per_key>
+SimdBlockFilter<HashFamily, log_bucket_byte_size, lane_bits, bits_per_key>::Intersect(
+    const SimdBlockFilter& x, const SimdBlockFilter& y) {
+  x.CheckCompatible(y);
+  SimdBlockFilter result(x.hasher_, x.num_buckets_);
+  result.kernel_.intersect_buckets(
+      result.directory_[0], x.directory_[0], y.directory_[0], x.num_buckets_);
+  return result;
+}
+
+template <typename HashFamily, int log_bucket_byte_size, int lane_bits, int bits_per_key>
+void SimdBlockFilter<HashFamily, log_bucket_byte_size, lane_bits, bits_per_key>::Fold() {
+  if (num_buckets_ <= 2 || num_buckets_ % 2 != 0) {
+    throw ::std::logic_error("SimdBlockFilter cannot be folded");
+  }
+  const size_t half = num_buckets_ / 2;
+  Bucket* folded = nullptr;
+  if (posix_memalign(reinterpret_cast<void**>(&folded), 64, half * sizeof(Bucket))) {
+    throw ::std::bad_alloc();
+  }
+  for (size_t i = 0; i < half; ++i) {
+    ScalarOps::UnionBuckets(folded[i], directory_[2 * i], directory_[2 * i + 1], 1);
+  }
+  free(directory_);
+  directory_ = folded;
+  num_buckets_ = half;
+}
+
+template <typename HashFamily, int log_bucket_byte_size, int lane_bits, int bits_per_key>
+typename SimdBlockFilter<HashFamily, log_bucket_byte_size, lane_bits,
+    bits_per_key>::FileHeader
+SimdBlockFilter<HashFamily, log_bucket_byte_size, lane_bits,
+    bits_per_key>::MakeFileHeader() const {
+  FileHeader header;
+  memset(&header, 0, sizeof(header));
+  header.magic = kFileMagic;
+  header.version = kFileVersion;
+  header.bucket_bytes = sizeof(Bucket);
+  header.bits_per_lane = lane_bits;
+  header.bits_set_per_key = bits_per_key;
+  header.hasher_bytes = sizeof(HashFamily);
+  header.num_buckets = num_buckets_;
+  header.directory_offset = (sizeof(FileHeader) + sizeof(HashFamily) + 63) / 64 * 64;
+  header.directory_bytes = SizeInBytes();
+  return header;
+}
+
+template <typename HashFamily, int log_bucket_byte_size, int lane_bits, int bits_per_key>
+void SimdBlockFilter<HashFamily, log_bucket_byte_size, lane_bits,
+    bits_per_key>::CheckFileHeader(
+    const FileHeader& header, const uint64_t file_size) {
+  if (header.magic != kFileMagic || header.version != kFileVersion) {
+    throw ::std::runtime_error("not a saved SimdBlockFilter");
+  }
+  const uint64_t num_buckets = header.num_buckets;
+  if (header.bucket_bytes != sizeof(Bucket) ||
+      header.bits_per_lane != lane_bits || header.bits_set_per_key != bits_per_key ||
+      header.hasher_bytes != sizeof(HashFamily)) {
+    throw ::std::runtime_error("saved SimdBlockFilter has a different geometry");
+  }
+  if (num_buckets < 2 || num_buckets > (1ull << 32) ||
+      header.directory_bytes != num_buckets * sizeof(Bucket) ||
+      header.directory_offset % 64 != 0 ||
+      header.directory_offset < sizeof(FileHeader) + sizeof(HashFamily) ||
+      (file_size != 0 &&
+          (header.directory_offset > file_size ||
+              header.directory_bytes != file_size - header.directory_offset))) {
+    throw ::std::runtime_error("saved SimdBlockFilter is corrupt");
+  }
+}
+
+template <typename HashFamily, int log_bucket_byte_size, int lane_bits, int bits_per_key>
+SimdBlockFilter<HashFamily, log_bucket_byte_size, lane_bits,
+    bits_per_key>::SimdBlockFilter(
+    const FileHeader& header, const HashFamily& hasher, void* mapping,
+    const size_t mapping_size)
+  : num_buckets_(header.num_buckets),
+    directory_(reinterpret_cast<Bucket*>(
+        static_cast<char*>(mapping) + header.directory_offset)),
+    mapping_(mapping),
+    mapping_size_(mapping_size),
+    hasher_(hasher),
+    kernel_(SimdBlockBestKernel<HashFamily, LOG_BUCKET_BYTE_SIZE, lane_bits,
+        bits_per_key>()) {}
+
+template <typename HashFamily, int log_bucket_byte_size, int lane_bits, int bits_per_key>
+void SimdBlockFilter<HashFamily, log_bucket_byte_size, lane_bits,
+    bits_per_key>::Save(::std::ostream& out) const {
+  static_assert(::std::is_trivially_copyable<HashFamily>::value,
+      "the hasher is saved byte for byte");
+  const FileHeader header = MakeFileHeader();
+  const char zeros[64] = {};
+  out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+  out.write(reinterpret_cast<const char*>(&hasher_), sizeof(hasher_));
+  out.write(zeros, header.directory_offset - sizeof(header) - sizeof(hasher_));
+  out.write(reinterpret_cast<const char*>(directory_), header.directory_bytes);
+  if (!out) throw ::std::runtime_error("failed to save SimdBlockFilter");
+}
+
+template <typename HashFamily, int log_bucket_byte_size, int lane_bits, int bits_per_key>
+SimdBlockFilter<HashFamily, log_bucket_byte_size, lane_bits, bits_per_key>
+SimdBlockFilter<HashFamily, log_bucket_byte_size, lane_bits,
+    bits_per_key>::Load(::std::istream& in) {
+  static_assert(::std::is_trivially_copyable<HashFamily>::value,
+      "the hasher is saved byte for byte");
+  FileHeader header;
+  if (!in.read(reinterpret_cast<char*>(&header), sizeof(header))) {
+    throw ::std::runtime_error("not a saved SimdBlockFilter");
+  }
+  CheckFileHeader(header, 0);
+  HashFamily hasher;
+  in.read(reinterpret_cast<char*>(&hasher), sizeof(hasher));
+  in.ignore(header.directory_offset - sizeof(header) - sizeof(hasher));
+  SimdBlockFilter result(hasher, header.num_buckets);
+  in.read(reinterpret_cast<char*>(result.directory_), header.directory_bytes);
+  if (!in) throw ::std::runtime_error("saved SimdBlockFilter is truncated");
+  return result;
+}
+
+template <typename HashFamily, int log_bucket_byte_size, int lane_bits, int bits_per_key>
+::std::unique_ptr<const SimdBlockFilter<HashFamily, log_bucket_byte_size, lane_bits,
+    bits_per_key>>
+SimdBlockFilter<HashFamily, log_bucket_byte_size, lane_bits,
+    bits_per_key>::Map(const ::std::string& path) {
+  static_assert(::std::is_trivially_copyable<HashFamily>::value,
+      "the hasher is saved byte for byte");
+  const int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) throw ::std::system_error(errno, ::std::generic_category(), path);
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    const int err = errno;
+    close(fd);
+    throw ::std::system_error(err, ::std::generic_category(), path);
+  }
+  const size_t size = st.st_size;
+  if (size < sizeof(FileHeader)) {
+    close(fd);
+    throw ::std::runtime_error("not a saved SimdBlockFilter");
+  }
+  void* const mapping = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+  const int err = errno;
+  close(fd);
+  if (mapping == MAP_FAILED) {
+    throw ::std::system_error(err, ::std::generic_category(), path);
+  }
+  const FileHeader& header = *static_cast<const FileHeader*>(mapping);
+  HashFamily hasher;
+  try {
+    CheckFileHeader(header, size);
+    memcpy(&hasher, static_cast<const char*>(mapping) + sizeof(header), sizeof(hasher));
+  } catch (...) {
+    munmap(mapping, size);
+    throw;
+  }
+  return ::std::unique_ptr<const SimdBlockFilter>(
+      new SimdBlockFilter(header, hasher, mapping, size));
 }
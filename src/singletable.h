@@ -2,9 +2,13 @@
 #define CUCKOO_FILTER_SINGLE_TABLE_H_
 
 #include <assert.h>
+#include <string.h>
 
+#include <memory>
 #include <sstream>
+#include <utility>
 
+#include "allocation.h"
 #include "bitsutil.h"
 #include "debug.h"
 #include "printutil.h"
@@ -12,7 +16,7 @@
 namespace cuckoofilter {
 
 // the most naive table implementation: one huge bit array
-template <size_t bits_per_tag>
+template <size_t bits_per_tag, typename Allocator = std::allocator<char>>
 class SingleTable {
   static const size_t kTagsPerBucket = 4;
   static const size_t kBytesPerBucket =
@@ -27,18 +31,56 @@ class SingleTable {
     char bits_[kBytesPerBucket];
   } __attribute__((__packed__));
 
+  ByteStorage<Allocator> storage_;
   // using a pointer adds one more indirection
   Bucket *buckets_;
   size_t num_buckets_;
 
  public:
-  explicit SingleTable(const size_t num) : num_buckets_(num) {
-    buckets_ = new Bucket[num_buckets_ + kPaddingBuckets];
-    memset(buckets_, 0, kBytesPerBucket * (num_buckets_ + kPaddingBuckets));
+  // NumBuckets() is this many times the buckets the table is asked for
+  static const size_t kBucketMultiple = 1;
+
+  explicit SingleTable(const size_t num,
+                       const Allocator &allocator = Allocator())
+      : storage_(StorageBytes(num), allocator),
+        buckets_(reinterpret_cast<Bucket *>(storage_.data())),
+        num_buckets_(num) {}
+
+  SingleTable(SingleTable &&that) noexcept
+      : storage_(std::move(that.storage_)),
+        buckets_(that.buckets_),
+        num_buckets_(that.num_buckets_) {
+    that.buckets_ = nullptr;
+    that.num_buckets_ = 0;
+  }
+
+  SingleTable &operator=(SingleTable &&that) noexcept {
+    storage_ = std::move(that.storage_);
+    std::swap(buckets_, that.buckets_);
+    std::swap(num_buckets_, that.num_buckets_);
+    return *this;
+  }
+
+  SingleTable(const SingleTable &) = delete;
+  SingleTable &operator=(const SingleTable &) = delete;
+
+  // bytes requested from the allocator for a table of num buckets
+  static size_t StorageBytes(const size_t num) {
+    return kBytesPerBucket * (num + kPaddingBuckets);
   }
 
-  ~SingleTable() { 
-    delete[] buckets_;
+  // the allocator the storage came from
+  Allocator get_allocator() const { return storage_.get_allocator(); }
+
+  // Zero up to bytes bytes of the storage from byte begin on, and return the
+  // byte after the last one zeroed. Once every byte has been zeroed, over
+  // any number of calls, the table is empty.
+  size_t ClearStorage(const size_t begin, const size_t bytes) {
+    if (begin >= storage_.size()) return begin;
+    const size_t n = bytes < storage_.size() - begin ? bytes
+                                                     : storage_.size() - begin;
+    memset(storage_.data() + begin, 0, n);
+    return begin + n;
   }
 
   size_t NumBuckets() const {
@@ -62,6 +104,12 @@ class SingleTable {
     return ss.str();
   }
 
+  // start loading bucket i into the cache, for writing if rw is 1
+  template <int rw>
+  inline void PrefetchBucket(const size_t i) const {
+    __builtin_prefetch(buckets_[i].bits_, rw);
+  }
+
   // read tag from pos(i,j)
   inline uint32_t ReadTag(const size_t i, const size_t j) const {
     const char *p = buckets_[i].bits_;
@@ -87,6 +135,13 @@ class SingleTable {
     return tag & kTagMask;
   }
 
+  // read the kTagsPerBucket tags of bucket i, 0 for an empty slot
+  inline void ReadBucket(const size_t i, uint32_t tags[kTagsPerBucket]) const {
+    for (size_t j = 0; j < kTagsPerBucket; j++) {
+      tags[j] = ReadTag(i, j);
+    }
+  }
+
   // write tag to pos(i,j)
   inline void WriteTag(const size_t i, const size_t j, const uint32_t t) {
     char *p = buckets_[i].bits_;
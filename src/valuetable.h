@@ -0,0 +1,232 @@
+#ifndef CUCKOO_FILTER_VALUE_TABLE_H_
+#define CUCKOO_FILTER_VALUE_TABLE_H_
+
+#include <assert.h>
+#include <string.h>
+
+#include <memory>
+#include <sstream>
+#include <utility>
+
+#include "allocation.h"
+#include "debug.h"
+
+namespace cuckoofilter {
+
+// A table like SingleTable whose slots each hold a tag and, next to it, a
+// value of bits_per_value bits. A slot is bits_per_tag + bits_per_value bits
+// with the tag in the low bits, and the four slots of a bucket are packed into
+// as few bytes as they fit in, so a lookup that finds the tag reads the value
+// from the same cache line. A tag of 0 marks an empty slot.
+template <size_t bits_per_tag, size_t bits_per_value,
+          typename Allocator = std::allocator<char>>
+class ValueTable {
+  static_assert(bits_per_tag >= 1 && bits_per_value >= 1 &&
+                    bits_per_tag + bits_per_value <= 32,
+                "a slot holds a tag and a value of at most 32 bits together");
+
+  static const size_t kTagsPerBucket = 4;
+  static const size_t kBitsPerSlot = bits_per_tag + bits_per_value;
+  static const size_t kBytesPerBucket =
+      (kBitsPerSlot * kTagsPerBucket + 7) >> 3;
+  static const uint32_t kTagMask = (1ULL << bits_per_tag) - 1;
+  static const uint32_t kValueMask = (1ULL << bits_per_value) - 1;
+  // a slot is read as the 8 bytes from its first, which may run past the
+  // last bucket
+  static const size_t kPaddingBytes = 7;
+
+  ByteStorage<Allocator> storage_;
+  char *buckets_;
+  size_t num_buckets_;
+
+  // the slot j of bucket i, tag in the low bits
+  inline uint32_t ReadSlot(const size_t i, const size_t j) const {
+    const size_t bit = j * kBitsPerSlot;
+    uint64_t v;
+    memcpy(&v, buckets_ + i * kBytesPerBucket + (bit >> 3), sizeof(v));
+    return (v >> (bit & 7)) & ((1ULL << kBitsPerSlot) - 1);
+  }
+
+  inline void WriteSlot(const size_t i, const size_t j, const uint32_t slot) {
+    const size_t bit = j * kBitsPerSlot;
+    char *p = buckets_ + i * kBytesPerBucket + (bit >> 3);
+    const uint64_t mask = ((1ULL << kBitsPerSlot) - 1) << (bit & 7);
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    v = (v & ~mask) | (static_cast<uint64_t>(slot) << (bit & 7));
+    memcpy(p, &v, sizeof(v));
+  }
+
+  static inline uint32_t MakeSlot(const uint32_t tag, const uint32_t value) {
+    return (tag & kTagMask) | ((value & kValueMask) << bits_per_tag);
+  }
+
+  // bit 0 of each slot of a bucket that fits in a word
+  static const uint64_t kSlotOnes =
+      kTagsPerBucket * kBitsPerSlot > 64
+          ? 0
+          : 1 | (1ULL << (kBitsPerSlot % 64)) |
+                (1ULL << (2 * kBitsPerSlot % 64)) |
+                (1ULL << (3 * kBitsPerSlot % 64));
+
+  // For a bucket read into v, the first value bit of each slot that holds
+  // tag, and no other bits.
+  static inline uint64_t MatchingSlots(const uint64_t v, const uint32_t tag) {
+    const uint64_t diff = (v ^ (kSlotOnes * tag)) & (kSlotOnes * kTagMask);
+    return ~(diff + kSlotOnes * kTagMask) & (kSlotOnes << bits_per_tag);
+  }
+
+ public:
+  explicit ValueTable(const size_t num,
+                      const Allocator &allocator = Allocator())
+      : storage_(StorageBytes(num), allocator),
+        buckets_(storage_.data()),
+        num_buckets_(num) {}
+
+  ValueTable(ValueTable &&that) noexcept
+      : storage_(std::move(that.storage_)),
+        buckets_(that.buckets_),
+        num_buckets_(that.num_buckets_) {
+    that.buckets_ = nullptr;
+    that.num_buckets_ = 0;
+  }
+
+  ValueTable &operator=(ValueTable &&that) noexcept {
+    storage_ = std::move(that.storage_);
+    std::swap(buckets_, that.buckets_);
+    std::swap(num_buckets_, that.num_buckets_);
+    return *this;
+  }
+
+  ValueTable(const ValueTable &) = delete;
+  ValueTable &operator=(const ValueTable &) = delete;
+
+  // bytes requested from the allocator for a table of num buckets
+  static size_t StorageBytes(const size_t num) {
+    return kBytesPerBucket * num + kPaddingBytes;
+  }
+
+  size_t NumBuckets() const { return num_buckets_; }
+
+  size_t SizeInBytes() const { return kBytesPerBucket * num_buckets_; }
+
+  size_t SizeInTags() const { return kTagsPerBucket * num_buckets_; }
+
+  std::string Info() const {
+    std::stringstream ss;
+    ss << "ValueTable with tag size: " << bits_per_tag << " bits, "
+       << "value size: " << bits_per_value << " bits \n";
+    ss << "\t\tAssociativity: " << kTagsPerBucket << "\n";
+    ss << "\t\tTotal # of rows: " << num_buckets_ << "\n";
+    ss << "\t\tTotal # slots: " << SizeInTags() << "\n";
+    return ss.str();
+  }
+
+  // start loading bucket i into the cache, for writing if rw is 1
+  template <int rw>
+  inline void PrefetchBucket(const size_t i) const {
+    __builtin_prefetch(buckets_ + i * kBytesPerBucket, rw);
+  }
+
+  // Sets *value to the value next to tag in bucket i1 or i2, which hold a tag
+  // at most once. Every slot is compared without branching, so a lookup that
+  // finds the tag costs no more mispredictions than one that does not.
+  inline bool FindValueInBuckets(const size_t i1, const size_t i2,
+                                 const uint32_t tag, uint32_t *value) const {
+    if (kTagsPerBucket * kBitsPerSlot <= 64) {
+      // Compare the four tags of a bucket at once: a slot whose tag differs
+      // keeps a nonzero tag field, which carries into the first value bit
+      // when the field's maximum is added to it. There is always a value bit
+      // above the tag, so no carry reaches the next slot.
+      uint64_t v1, v2;
+      memcpy(&v1, buckets_ + i1 * kBytesPerBucket, sizeof(v1));
+      memcpy(&v2, buckets_ + i2 * kBytesPerBucket, sizeof(v2));
+      const uint64_t m1 = MatchingSlots(v1, tag);
+      const uint64_t m2 = MatchingSlots(v2, tag);
+      const uint64_t v = m1 != 0 ? v1 : v2;
+      const uint64_t m = m1 != 0 ? m1 : m2;
+      // bit 63 only keeps the count defined; it is never a value bit here
+      *value = (v >> __builtin_ctzll(m | (1ULL << 63))) & kValueMask;
+      return m != 0;
+    }
+    bool found = false;
+    uint32_t match = 0;
+    for (size_t j = kTagsPerBucket; j-- > 0;) {
+      const uint32_t s1 = ReadSlot(i1, j);
+      const uint32_t s2 = ReadSlot(i2, j);
+      const bool f1 = (s1 & kTagMask) == tag;
+      const bool f2 = (s2 & kTagMask) == tag;
+      match = f2 ? s2 : match;
+      found |= f2;
+      match = f1 ? s1 : match;
+      found |= f1;
+    }
+    *value = match >> bits_per_tag;
+    return found;
+  }
+
+  inline bool FindTagInBucket(const size_t i, const uint32_t tag) const {
+    for (size_t j = 0; j < kTagsPerBucket; j++) {
+      if ((ReadSlot(i, j) & kTagMask) == tag) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  // overwrite the value next to tag in bucket i, if tag is there
+  inline bool ReplaceValueInBucket(const size_t i, const uint32_t tag,
+                                   const uint32_t value) {
+    for (size_t j = 0; j < kTagsPerBucket; j++) {
+      if ((ReadSlot(i, j) & kTagMask) == tag) {
+        WriteSlot(i, j, MakeSlot(tag, value));
+        return true;
+      }
+    }
+    return false;
+  }
+
+  inline bool DeleteTagFromBucket(const size_t i, const uint32_t tag) {
+    for (size_t j = 0; j < kTagsPerBucket; j++) {
+      if ((ReadSlot(i, j) & kTagMask) == tag) {
+        assert(FindTagInBucket(i, tag) == true);
+        WriteSlot(i, j, 0);
+        return true;
+      }
+    }
+    return false;
+  }
+
+  // As SingleTable::InsertTagToBucket(), but a kicked-out tag takes its value
+  // along in oldvalue.
+  inline bool InsertTagToBucket(const size_t i, const uint32_t tag,
+                                const uint32_t value, const bool kickout,
+                                uint32_t &oldtag, uint32_t &oldvalue) {
+    for (size_t j = 0; j < kTagsPerBucket; j++) {
+      if ((ReadSlot(i, j) & kTagMask) == 0) {
+        WriteSlot(i, j, MakeSlot(tag, value));
+        return true;
+      }
+    }
+    if (kickout) {
+      size_t r = rand() % kTagsPerBucket;
+      const uint32_t old = ReadSlot(i, r);
+      oldtag = old & kTagMask;
+      oldvalue = old >> bits_per_tag;
+      WriteSlot(i, r, MakeSlot(tag, value));
+    }
+    return false;
+  }
+
+  inline size_t NumTagsInBucket(const size_t i) const {
+    size_t num = 0;
+    for (size_t j = 0; j < kTagsPerBucket; j++) {
+      if ((ReadSlot(i, j) & kTagMask) != 0) {
+        num++;
+      }
+    }
+    return num;
+  }
+};
+}  // namespace cuckoofilter
+#endif  // CUCKOO_FILTER_VALUE_TABLE_H_
@@ -0,0 +1,255 @@
+#ifndef CUCKOO_FILTER_WINDOWED_CUCKOO_FILTER_H_
+#define CUCKOO_FILTER_WINDOWED_CUCKOO_FILTER_H_
+
+#include <stdint.h>
+
+#include <memory>
+#include <sstream>
+#include <vector>
+
+#include "cuckoofilter.h"
+
+namespace cuckoofilter {
+
+// A filter over a sliding window of num_generations generations, such as the
+// last ten minutes of a stream in one-minute generations, for deduplicating
+// events seen within the window. Each generation is a CuckooFilter of
+// max_num_keys items. Adds go to the current generation, lookups check every
+// live one, and Advance() starts a new generation and expires the oldest.
+//
+// All generations share one hash function and one table size, so an item is
+// hashed once and has the same buckets and tag in every generation. Expiring
+// a generation only changes which filter is which: there is one spare filter
+// besides the live ones, and each add zeroes a slice of it, sized so that it
+// is clean by the time the current generation has had max_num_keys adds.
+// Advance() then reuses it without clearing a whole table, and only zeroes
+// what is left if it comes sooner. The memory used is num_generations + 1
+// tables, whatever the rate of the stream.
+//
+// Calls must come from one thread at a time. Filters are movable but not
+// copyable.
+template <typename ItemType, size_t bits_per_item, size_t num_generations,
+          template <size_t, typename> class TableType = SingleTable,
+          typename HashFamily = TwoIndependentMultiplyShift,
+          typename Allocator = std::allocator<char>>
+class WindowedCuckooFilter {
+  static_assert(num_generations >= 1, "the window needs a generation");
+
+  static const size_t kStashSize = 4;
+
+  typedef CuckooFilter<ItemType, bits_per_item, TableType, HashFamily,
+                       Allocator, kStashSize>
+      Filter;
+  typedef typename Filter::Stash Stash;
+
+  static const size_t kNumFilters = num_generations + 1;
+  // the spare filter is cleared once per this many adds, in one memset
+  static const size_t kClearBatch = 64;
+  // lookups are grouped like CuckooFilter's batch methods
+  static const size_t kBatchSize = Filter::kBatchSize;
+
+  // the live generations and the spare
+  std::vector<Filter> filters_;
+
+  // index in filters_ of the current generation; the one after it, cyclically,
+  // is the spare
+  size_t current_;
+
+  // bytes of the spare's storage zeroed so far, or SIZE_MAX if it is clean
+  size_t cleared_;
+
+  // bytes of the spare zeroed per add
+  size_t clear_per_add_;
+
+  // adds since the spare was last cleared a little
+  size_t adds_;
+
+  // the generation that is age generations old; 0 is the current one
+  Filter &Generation(const size_t age) {
+    return filters_[(current_ + kNumFilters - age) % kNumFilters];
+  }
+
+  const Filter &Generation(const size_t age) const {
+    return filters_[(current_ + kNumFilters - age) % kNumFilters];
+  }
+
+  Filter &Spare() { return filters_[(current_ + 1) % kNumFilters]; }
+
+  void ClearSpare(const size_t bytes) {
+    if (cleared_ != SIZE_MAX) {
+      const size_t end = Spare().table_.ClearStorage(cleared_, bytes);
+      cleared_ = end == cleared_ ? SIZE_MAX : end;
+    }
+  }
+
+  // the buckets and tag of an item, the same in every generation
+  void Hash(const ItemType &item, size_t *i1, size_t *i2,
+            uint32_t *tag) const {
+    const Filter &filter = filters_[current_];
+    filter.GenerateIndexTagHash(item, i1, tag);
+    *i2 = filter.AltIndex(*i1, *tag);
+  }
+
+  static bool Find(const Filter &filter, const size_t i1, const size_t i2,
+                   const uint32_t tag) {
+    return Filter::StashContains(filter.stash_, i1, i2, tag) ||
+           filter.table_.FindTagInBuckets(i1, i2, tag);
+  }
+
+  Status ContainImpl(const size_t i1, const size_t i2,
+                     const uint32_t tag) const {
+    // Start every generation's loads before waiting on any of them.
+    for (size_t age = 0; age < num_generations; age++) {
+      Generation(age).table_.template PrefetchBucket<0>(i1);
+      Generation(age).table_.template PrefetchBucket<0>(i2);
+    }
+    for (size_t age = 0; age < num_generations; age++) {
+      if (Find(Generation(age), i1, i2, tag)) return Ok;
+    }
+    return NotFound;
+  }
+
+  Status AddImpl(const size_t i1, const uint32_t tag) {
+    const Status status = filters_[current_].AddImpl(i1, tag);
+    if (status != Ok) {
+      return status;
+    }
+    if (++adds_ == kClearBatch) {
+      ClearSpare(kClearBatch * clear_per_add_);
+      adds_ = 0;
+    }
+    return Ok;
+  }
+
+ public:
+  explicit WindowedCuckooFilter(const size_t max_num_keys,
+                                const Allocator &allocator = Allocator(),
+                                const HashFamily &hasher = HashFamily())
+      : filters_(),
+        current_(0),
+        cleared_(SIZE_MAX),
+        clear_per_add_(0),
+        adds_(0) {
+    filters_.reserve(kNumFilters);
+    for (size_t k = 0; k < kNumFilters; k++) {
+      filters_.emplace_back(max_num_keys, allocator, hasher);
+    }
+    // The storage is a little larger than the table, by padding and
+    // alignment; Advance() zeroes the rest.
+    clear_per_add_ =
+        (filters_[0].SizeInBytes() + max_num_keys - 1) / max_num_keys;
+  }
+
+  WindowedCuckooFilter(WindowedCuckooFilter &&) = default;
+  WindowedCuckooFilter &operator=(WindowedCuckooFilter &&) = default;
+  WindowedCuckooFilter(const WindowedCuckooFilter &) = delete;
+  WindowedCuckooFilter &operator=(const WindowedCuckooFilter &) = delete;
+
+  // Add an item to the current generation. Fails with NotEnoughSpace once
+  // its stash is full, as CuckooFilter::Add() does.
+  Status Add(const ItemType &item) {
+    size_t i1, i2;
+    uint32_t tag;
+    Hash(item, &i1, &i2, &tag);
+    return AddImpl(i1, tag);
+  }
+
+  // Add the item to the current generation unless Contain() would find it,
+  // hashing it once. Returns AlreadyPresent if it was found.
+  Status AddIfAbsent(const ItemType &item) {
+    size_t i1, i2;
+    uint32_t tag;
+    Hash(item, &i1, &i2, &tag);
+    if (ContainImpl(i1, i2, tag) == Ok) {
+      return AlreadyPresent;
+    }
+    return AddImpl(i1, tag);
+  }
+
+  // Report if the item was added to a live generation, with the false
+  // positive rate of a filter times num_generations.
+  Status Contain(const ItemType &item) const {
+    size_t i1, i2;
+    uint32_t tag;
+    Hash(item, &i1, &i2, &tag);
+    return ContainImpl(i1, i2, tag);
+  }
+
+  // Contain() for items[0, n). Sets bit i % 64 of found[i / 64] if items[i]
+  // was found, overwriting the first (n + 63) / 64 words, and returns the
+  // number found. The items are hashed once; then the buckets of a group of
+  // 64 are prefetched in one generation at a time, so their cache misses
+  // overlap, and an item is looked for only until it is found.
+  size_t ContainMany(const ItemType *items, const size_t n,
+                     uint64_t *found) const {
+    size_t i1[kBatchSize], i2[kBatchSize];
+    uint32_t tag[kBatchSize];
+    size_t count = 0;
+
+    for (size_t i = 0; i < n; i += kBatchSize) {
+      const size_t m = n - i < kBatchSize ? n - i : kBatchSize;
+      for (size_t j = 0; j < m; j++) {
+        Hash(items[i + j], &i1[j], &i2[j], &tag[j]);
+      }
+      uint64_t word = 0;
+      for (size_t age = 0; age < num_generations; age++) {
+        const Filter &filter = Generation(age);
+        for (size_t j = 0; j < m; j++) {
+          if ((word >> j) & 1) continue;
+          filter.table_.template PrefetchBucket<0>(i1[j]);
+          filter.table_.template PrefetchBucket<0>(i2[j]);
+        }
+        for (size_t j = 0; j < m; j++) {
+          if ((word >> j) & 1) continue;
+          word |= static_cast<uint64_t>(Find(filter, i1[j], i2[j], tag[j]))
+                  << j;
+        }
+      }
+      found[i / kBatchSize] = word;
+      count += __builtin_popcountll(word);
+    }
+    return count;
+  }
+
+  // Start a new, empty current generation and expire the oldest, whose items
+  // are no longer found. Zeroes whatever adds have not already cleared of
+  // the filter the new generation reuses.
+  void Advance() {
+    ClearSpare(SIZE_MAX);
+    current_ = (current_ + 1) % kNumFilters;
+    Filter &expired = Spare();
+    expired.num_items_ = 0;
+    expired.stash_ = Stash();
+    cleared_ = 0;
+    adds_ = 0;
+  }
+
+  /* methods for providing stats  */
+  // summary infomation
+  std::string Info() const {
+    std::stringstream ss;
+    ss << "WindowedCuckooFilter Status:\n"
+       << "\t\tGenerations: " << num_generations << "\n"
+       << "\t\tKeys stored: " << Size() << "\n";
+    for (size_t age = 0; age < num_generations; age++) {
+      ss << "\t\tGeneration " << age << ": " << Generation(age).Size()
+         << " keys\n";
+    }
+    ss << "\t\tHashtable size: " << (SizeInBytes() >> 10) << " KB\n";
+    return ss.str();
+  }
+
+  // number of items added to the live generations
+  size_t Size() const {
+    size_t size = 0;
+    for (size_t age = 0; age < num_generations; age++) {
+      size += Generation(age).Size();
+    }
+    return size;
+  }
+
+  // size of every table, the spare's included, in bytes
+  size_t SizeInBytes() const { return kNumFilters * filters_[0].SizeInBytes(); }
+};
+}  // namespace cuckoofilter
+#endif  // CUCKOO_FILTER_WINDOWED_CUCKOO_FILTER_H_